@@ -1,4 +1,7 @@
 /**
+ * g++ -std=c++11 -O2 -o Condition Condition.cpp ../d7_thread_pool/common/Channel.h -lpthread
+ * ./Condition [生产者数] [消费者数] [每个生产者的消息数]
+ * 
  * 条件变量
  * 严格意义上来说，条件变量的主要作用不是处理线程同步, 而是进行线程的阻塞。
  * 如果在多线程程序中只使用条件变量无法实现线程的同步, 必须要配合互斥锁来使用。
@@ -34,144 +37,199 @@
  * 区别就在于pthread_cond_signal是唤醒至少一个被阻塞的线程（总个数不定），pthread_cond_broadcast是唤醒所有被阻塞的线程。
  * 
  * 
+ * 生产者消费者模型：
+ *      最直接的写法是一个全局数组加in/out/count，一把互斥锁和not_full/not_empty两个条件变量，
+ *      每放入或取出一个元素都要加锁解锁，并且signal一次，生产者和消费者都在同一把锁上排队，
+ *      线程间每秒要传递几千万条小消息时，锁和唤醒就成了瓶颈。
+ * 
+ *      这里改用../d7_thread_pool/common/Channel.h的有界通道：
+ *      1、一个生产者一个消费者时使用SPSC通道，没有原子读改写，读写下标各自缓存对方的值
+ *      2、多个生产者或消费者时使用MPMC通道，每个槽位带序号，一次CAS抢占位置
+ *      3、消息成批放入和取出，一批只有一次原子操作和一次通知
+ *      4、阻塞仍然是“条件不满足就睡眠，条件变化时唤醒”，只是睡眠用futex实现，
+ *         对方没有睡眠时唤醒不进内核，相当于只在真正有线程阻塞时才pthread_cond_signal
+ *      5、所有生产者结束后关闭通道，消费者取完剩下的消息后退出
+ * 
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <time.h>
 #include <iostream>
-#include <unistd.h>
+#include <atomic>
+#include <vector>
+#include "../d7_thread_pool/common/Channel.h"
 
 using namespace std;
 
 //缓冲区大小
-#define BUFFER_SIZE 5
-
-int buffer[BUFFER_SIZE];
-//缓冲区当前元素个数
-int count = 0;
-//生产者放入数据的位置
-int in = 0;
-//消费者取出数据的位置
-int out =0;
-
-//初始化互斥锁和两个条件变量
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
-pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+#define BUFFER_SIZE 4096
+//一批放入或取出的消息数
+#define BATCH_SIZE 64
 
 //生产者数量
-#define PRODUCER_NUM 3
+int producer_num = 3;
 //消费者数量
-#define CONSUMER_NUM 2
+int consumer_num = 2;
+//每个生产者产生的消息数
+long item_num = 1000000;
+
+//还在生产的生产者数，最后一个结束的生产者关闭通道
+std::atomic<int> producing(0);
 
+//线程参数
+struct Worker
+{
+    int index;
+    void* channel;
+    //消费者收到的消息数和消息之和，用于校验
+    long count;
+    long sum;
+};
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 //生产者
+template <typename Chan>
 void* producer(void* arg)
 {
-    int index = *((int*)arg);
-    int item;
-    while(1)
+    Worker* worker = (Worker*)arg;
+    Chan* channel = (Chan*)worker->channel;
+    int buffer[BATCH_SIZE];
+    long item = 0;
+    while(item < item_num)
     {
-        item = rand() % 100; //产生一个随机数
-
-        //加锁
-        pthread_mutex_lock(&mutex);
-
-        while(count == BUFFER_SIZE)
+        //产生一批数据
+        int n = 0;
+        while (n < BATCH_SIZE && item < item_num)
         {
-            //如果缓冲区已经满了，那么生产者线程阻塞等待,当缓冲区为空时再次生产
-            cout << "producer buff is full ,waiting...." << endl;
-
-            //注意这里wait等待，再次被唤醒时，会重新lock上mutex
-            pthread_cond_wait(&not_full, &mutex);
+            buffer[n++] = (int)(item++ % 100);
         }
 
-        buffer[in] = item;
-        cout << "producer index:" << index << " item:" << item << " count:" << count << endl;
-
-        in = (in + 1) % BUFFER_SIZE;
-        count++;
-
-        pthread_mutex_unlock(&mutex);
-
-        //通知消费者缓冲区有数据了
-        pthread_cond_signal(&not_empty);
+        //缓冲区满时阻塞等待，消费者取走数据后被唤醒
+        channel->pushN(buffer, n);
+    }
 
-        sleep(1);
+    //最后一个生产者关闭通道，通知消费者不会再有数据了
+    if (producing.fetch_sub(1) == 1)
+    {
+        channel->close();
     }
-    
     return NULL;
 }
 
 //消费者
+template <typename Chan>
 void* consumer(void* arg)
 {
-    int index = *((int*)arg);
-    int item;
-    while(1)
+    Worker* worker = (Worker*)arg;
+    Chan* channel = (Chan*)worker->channel;
+    int buffer[BATCH_SIZE];
+    size_t n;
+    //缓冲区为空时阻塞等待，通道关闭并且取完时返回0
+    while ((n = channel->popN(buffer, BATCH_SIZE)) > 0)
     {
-        //加锁
-        pthread_mutex_lock(&mutex);
-
-        while(count == 0)
+        for (size_t i = 0; i < n; i++)
         {
-            //如果缓冲区为空，那么消费者线程阻塞等待，当缓冲区有数据时再次消费
-            cout << "consumer buff is empty ,waiting...." << endl;
-            pthread_cond_wait(&not_empty, &mutex);
+            worker->sum += buffer[i];
         }
-
-        item = buffer[out];
-        cout<< "consumer index:" << index << "->>>>>>>>>>>>>>>>>>>>>>>> item:" << item << " count:" << count << endl;
-
-        out = (out + 1) % BUFFER_SIZE;
-        count--;
-
-        pthread_mutex_unlock(&mutex);
-
-        //通知生产者缓冲区有空位了
-        pthread_cond_signal(&not_full);
-
-        sleep(1);
+        worker->count += n;
     }
 
     return NULL;
 }
 
-int main()
+template <typename Chan>
+void run()
 {
+    Chan channel(BUFFER_SIZE);
+
     //生产者和消费者线程
-    pthread_t producer_thread[PRODUCER_NUM];
-    pthread_t consumer_thread[CONSUMER_NUM];
+    vector<pthread_t> producer_thread(producer_num);
+    vector<pthread_t> consumer_thread(consumer_num);
 
     //记录索引
-    int producer_index[PRODUCER_NUM];
-    int consumer_index[CONSUMER_NUM];
+    vector<Worker> producers(producer_num);
+    vector<Worker> consumers(consumer_num);
 
-    for (int i = 0; i < PRODUCER_NUM; i++)
+    double start = now_sec();
+    producing = producer_num;
+    for (int i = 0; i < producer_num; i++)
     {
-        producer_index[i] = i + 1;
-        pthread_create(&producer_thread[i], NULL, producer, &producer_index[i]);
+        producers[i] = Worker{i + 1, &channel, 0, 0};
+        pthread_create(&producer_thread[i], NULL, producer<Chan>, &producers[i]);
     }
-    
-    for (int i = 0; i < CONSUMER_NUM; i++)
+
+    for (int i = 0; i < consumer_num; i++)
     {
-        consumer_index[i] = i + 1;
-        pthread_create(&consumer_thread[i], NULL, consumer, &consumer_index[i]);
+        consumers[i] = Worker{i + 1, &channel, 0, 0};
+        pthread_create(&consumer_thread[i], NULL, consumer<Chan>, &consumers[i]);
     }
-    
 
     //等待线程结束
-    for (int i = 0; i < PRODUCER_NUM; i++)
+    for (int i = 0; i < producer_num; i++)
     {
         pthread_join(producer_thread[i], NULL);
     }
-    
-    for (int i = 0; i < CONSUMER_NUM; i++)
+
+    long count = 0;
+    long sum = 0;
+    for (int i = 0; i < consumer_num; i++)
     {
         pthread_join(consumer_thread[i], NULL);
+        cout << "consumer index:" << consumers[i].index << " items:" << consumers[i].count << endl;
+        count += consumers[i].count;
+        sum += consumers[i].sum;
+    }
+    double elapsed = now_sec() - start;
+
+    //每个生产者产生的数据之和都一样
+    long expect = 0;
+    for (long item = 0; item < item_num; item++)
+    {
+        expect += item % 100;
+    }
+    expect *= producer_num;
+    cout << "items:" << count << " sum:" << sum << (sum == expect ? " ok" : " MISMATCH")
+         << " seconds:" << elapsed << " Mitems/s:" << count / elapsed / 1e6 << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+    {
+        producer_num = atoi(argv[1]);
+    }
+    if (argc > 2)
+    {
+        consumer_num = atoi(argv[2]);
+    }
+    if (argc > 3)
+    {
+        item_num = atol(argv[3]);
+    }
+    if (producer_num < 1 || consumer_num < 1 || item_num < 0)
+    {
+        cout << "usage: " << argv[0] << " [producers] [consumers] [items per producer]" << endl;
+        return 1;
+    }
+
+    cout << "producers:" << producer_num << " consumers:" << consumer_num << " items per producer:" << item_num << endl;
+    //一个生产者一个消费者时用SPSC通道，否则用MPMC通道
+    if (producer_num == 1 && consumer_num == 1)
+    {
+        run<Channel<int, ChannelSPSC> >();
+    }
+    else
+    {
+        run<Channel<int, ChannelMPMC> >();
     }
-    
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,227 @@
+/**
+ * g++ -std=c++17 -O2 -o CounterBench CounterBench.cpp ../d7_thread_pool/common/ShardedCounter.h -lpthread
+ * ./CounterBench [每个线程的累加次数] [最多线程数]
+ *
+ * 计数器性能对比，场景和Mutex.cpp/Mutex11.cpp相同：多个线程对一个全局计数器累加，
+ * 去掉了每次累加后的打印和sleep，只比较累加本身的开销，线程数从1翻倍到最多线程数
+ *
+ * 改造前：
+ *      mutex           pthread_mutex_t保护的计数器（Mutex.cpp）
+ *      std-mutex       std::mutex保护的volatile计数器（Mutex11.cpp）
+ *      atomic          std::atomic全局计数器，不加锁，但所有线程抢同一个缓存行
+ * 改造后（../d7_thread_pool/common/ShardedCounter.h）：
+ *      sharded         ShardedCounter，每个线程修改自己的缓存行
+ *      sharded-gauge   ShardedGauge，每次先加一再减一，结束时应为0
+ *      sharded-max     ShardedMax，每次更新为当前的循环次数
+ *
+ * 运行期间有一个监控线程每毫秒用readApprox读一次计数器，模拟统计上报；
+ * 结束后校验计数器的值，每个线程的累加都不能丢。
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "../d7_thread_pool/common/ShardedCounter.h"
+
+using namespace std;
+
+//每个线程的累加次数
+long iterations = 1000000;
+
+//改造前：互斥锁保护的计数器
+pthread_mutex_t mutex_counter = PTHREAD_MUTEX_INITIALIZER;
+long counter = 0;
+std::mutex mtx;
+volatile long volatile_counter(0);
+std::atomic<long> atomic_counter(0);
+
+//改造后：分片计数器
+ShardedCounter sharded_counter;
+ShardedGauge sharded_gauge;
+ShardedMax sharded_max;
+
+std::atomic<bool> running(false);
+
+static long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void* mutex_thread(void* arg)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        pthread_mutex_lock(&mutex_counter);
+        counter ++;
+        pthread_mutex_unlock(&mutex_counter);
+    }
+    return NULL;
+}
+
+void* std_mutex_thread(void* arg)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        std::unique_lock<std::mutex> lck(mtx);
+        ++ volatile_counter;
+    }
+    return NULL;
+}
+
+void* atomic_thread(void* arg)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        atomic_counter.fetch_add(1, std::memory_order_relaxed);
+    }
+    return NULL;
+}
+
+void* sharded_thread(void* arg)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        sharded_counter.inc();
+    }
+    return NULL;
+}
+
+void* gauge_thread(void* arg)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        sharded_gauge.inc();
+        sharded_gauge.dec();
+    }
+    return NULL;
+}
+
+void* max_thread(void* arg)
+{
+    for (long i = 0; i < iterations; i++)
+    {
+        sharded_max.update(i);
+    }
+    return NULL;
+}
+
+//监控线程：每毫秒读一次计数器
+void* monitor_thread(void* arg)
+{
+    long (*read)() = (long (*)())arg;
+    long sink = 0;
+    while (running.load(std::memory_order_relaxed))
+    {
+        sink += read();
+        usleep(1000);
+    }
+    return (void*)sink;
+}
+
+long read_mutex()
+{
+    pthread_mutex_lock(&mutex_counter);
+    long value = counter;
+    pthread_mutex_unlock(&mutex_counter);
+    return value;
+}
+
+long read_std_mutex()
+{
+    std::unique_lock<std::mutex> lck(mtx);
+    return volatile_counter;
+}
+
+long read_atomic()
+{
+    return atomic_counter.load(std::memory_order_relaxed);
+}
+
+long read_sharded()
+{
+    return sharded_counter.readApprox();
+}
+
+long read_gauge()
+{
+    return sharded_gauge.readApprox();
+}
+
+long read_max()
+{
+    return sharded_max.readApprox();
+}
+
+void run(const char* name, void* (*func)(void*), long (*read)(), long (*final)(), long expect, int threads)
+{
+    vector<pthread_t> tids(threads);
+    pthread_t monitor;
+    running = true;
+    pthread_create(&monitor, NULL, monitor_thread, (void*)read);
+
+    long start = now_ns();
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_create(&tids[i], NULL, func, NULL);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+    long elapsed = now_ns() - start;
+    running = false;
+    pthread_join(monitor, NULL);
+
+    long value = final();
+    long ops = iterations * threads;
+    printf("%-14s %7d %12.2f %10.2f %14ld %s\n", name, threads, ops * 1000.0 / elapsed, (double)elapsed / ops,
+           value, value == expect ? "ok" : "MISMATCH");
+}
+
+long final_mutex() { return counter; }
+long final_std_mutex() { return volatile_counter; }
+long final_sharded() { return sharded_counter.read(); }
+long final_gauge() { return sharded_gauge.read(); }
+long final_max() { return sharded_max.read(); }
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+    {
+        iterations = atol(argv[1]);
+    }
+    int maxThreads = argc > 2 ? atoi(argv[2]) : 32;
+    if (iterations < 1 || maxThreads < 1)
+    {
+        printf("usage: %s [iterations per thread] [max threads]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-14s %7s %12s %10s %14s\n", "counter", "threads", "Mops/s", "ns/op", "value");
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        counter = 0;
+        volatile_counter = 0;
+        atomic_counter = 0;
+        sharded_counter.reset();
+        sharded_gauge.reset();
+        sharded_max.reset();
+
+        long total = iterations * threads;
+        run("mutex", mutex_thread, read_mutex, final_mutex, total, threads);
+        run("std-mutex", std_mutex_thread, read_std_mutex, final_std_mutex, total, threads);
+        run("atomic", atomic_thread, read_atomic, read_atomic, total, threads);
+        run("sharded", sharded_thread, read_sharded, final_sharded, total, threads);
+        run("sharded-gauge", gauge_thread, read_gauge, final_gauge, 0, threads);
+        run("sharded-max", max_thread, read_max, final_max, iterations - 1, threads);
+    }
+
+    return 0;
+}
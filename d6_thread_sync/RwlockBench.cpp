@@ -0,0 +1,261 @@
+/**
+ * g++ -std=c++17 -O2 -o RwlockBench RwlockBench.cpp ../d7_thread_pool/common/ScalableRWLock.h ../d7_thread_pool/common/SeqLock.h -lpthread
+ * ./RwlockBench [每组测试的秒数] [最多读线程数]
+ *
+ * 读写锁性能对比，场景和Rwlock.cpp相同：多个读线程读取share_resource，两个写线程隔一段时间修改一次
+ * 1、读线程不再sleep，一直加读锁读取，统计每秒读多少次，读线程数从1翻倍到64
+ * 2、写线程每次写完sleep 1ms，统计加写锁的平均和最大等待时间，看写者会不会被读者饿住
+ * 3、写线程同时修改两个变量，读线程检查两者是否相等，不相等说明锁没有保护住（torn）
+ *
+ * 对比的锁：
+ *      pthread            pthread_rwlock_t默认属性（读优先）
+ *      pthread-writer     pthread_rwlock_t写优先
+ *      scalable           ../d7_thread_pool/common/ScalableRWLock.h，写优先
+ *      scalable-reader    ScalableRWLock，读优先
+ *      seqlock            ../d7_thread_pool/common/SeqLock.h，多写者，读者拷贝两个变量
+ *
+ * pthread_rwlock_t的读锁每次都要修改锁里的读者计数，读线程越多争抢越厉害；
+ * ScalableRWLock的读锁只修改自己的槽位，读吞吐随核数增长，写锁多一次扫描槽位的开销；
+ * SeqLock的读者不写任何共享内存，只有写者正在写时才重试，retries列是所有读者的重试次数之和。
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <atomic>
+#include <vector>
+#include "../d7_thread_pool/common/ScalableRWLock.h"
+#include "../d7_thread_pool/common/SeqLock.h"
+
+using namespace std;
+
+#define NUM_WRITERS 2
+//写线程两次写之间的间隔
+#define WRITE_INTERVAL_US 1000
+
+//pthread_rwlock_t包装成和ScalableRWLock相同的接口
+class PthreadRWLock
+{
+public:
+    explicit PthreadRWLock(bool writerPreference)
+    {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        if (writerPreference)
+        {
+            pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        }
+        pthread_rwlock_init(&m_lock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+
+    ~PthreadRWLock()
+    {
+        pthread_rwlock_destroy(&m_lock);
+    }
+
+    void lock_shared() { pthread_rwlock_rdlock(&m_lock); }
+    void unlock_shared() { pthread_rwlock_unlock(&m_lock); }
+    void lock() { pthread_rwlock_wrlock(&m_lock); }
+    void unlock() { pthread_rwlock_unlock(&m_lock); }
+
+private:
+    pthread_rwlock_t m_lock;
+};
+
+//共享资源，写线程同时修改两个变量
+int share_resource = 0;
+int share_copy = 0;
+
+//顺序锁保护的共享资源，数据保存在锁里
+struct Resource
+{
+    int value;
+    int copy;
+};
+typedef SeqLock<Resource, true> ResourceSeqLock;
+
+std::atomic<bool> stop(false);
+
+//每个线程的统计，各占一个缓存行
+struct alignas(64) Stat
+{
+    long reads;
+    long torn;
+    uint64_t retries;
+    long writes;
+    long waitNs;
+    long maxWaitNs;
+};
+
+static long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+template <typename Lock>
+struct Context
+{
+    Lock* lock;
+    Stat* stat;
+};
+
+//读取共享资源：加读锁读取两个全局变量
+template <typename Lock>
+inline void readShared(Lock& lock, Stat* stat)
+{
+    //加读锁
+    lock.lock_shared();
+    //读取共享资源
+    if (share_resource != share_copy)
+    {
+        stat->torn++;
+    }
+    //释放读锁
+    lock.unlock_shared();
+}
+
+//顺序锁：拷贝一份，重试次数记在读者自己的统计里
+inline void readShared(ResourceSeqLock& lock, Stat* stat)
+{
+    Resource r = lock.load(stat->retries);
+    if (r.value != r.copy)
+    {
+        stat->torn++;
+    }
+}
+
+//修改共享资源：加写锁修改两个全局变量
+template <typename Lock>
+inline void writeShared(Lock& lock)
+{
+    lock.lock();
+    share_resource++;
+    share_copy = share_resource;
+    lock.unlock();
+}
+
+inline void writeShared(ResourceSeqLock& lock)
+{
+    lock.update([](Resource& r)
+    {
+        r.value++;
+        r.copy = r.value;
+    });
+}
+
+//读操作
+template <typename Lock>
+void* readerFunc(void* arg)
+{
+    Context<Lock>* ctx = (Context<Lock>*)arg;
+    Stat* stat = ctx->stat;
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        readShared(*ctx->lock, stat);
+        stat->reads++;
+    }
+
+    return NULL;
+}
+
+//写操作
+template <typename Lock>
+void* writerFunc(void* arg)
+{
+    Context<Lock>* ctx = (Context<Lock>*)arg;
+    Stat* stat = ctx->stat;
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        //加写锁并修改共享资源，记录耗时
+        long start = now_ns();
+        writeShared(*ctx->lock);
+        long wait = now_ns() - start;
+
+        stat->writes++;
+        stat->waitNs += wait;
+        if (wait > stat->maxWaitNs)
+        {
+            stat->maxWaitNs = wait;
+        }
+        //模拟写操作之间的间隔
+        usleep(WRITE_INTERVAL_US);
+    }
+
+    return NULL;
+}
+
+template <typename Lock>
+void run(const char* name, Lock& lock, int readers, double seconds)
+{
+    stop = false;
+    vector<Stat> stats(readers + NUM_WRITERS, Stat());
+    vector<Context<Lock> > ctx(readers + NUM_WRITERS);
+    vector<pthread_t> threads(readers + NUM_WRITERS);
+
+    for (int i = 0; i < readers + NUM_WRITERS; i++)
+    {
+        ctx[i].lock = &lock;
+        ctx[i].stat = &stats[i];
+        pthread_create(&threads[i], NULL, i < readers ? readerFunc<Lock> : writerFunc<Lock>, &ctx[i]);
+    }
+
+    long start = now_ns();
+    usleep((useconds_t)(seconds * 1000000));
+    stop = true;
+    for (int i = 0; i < readers + NUM_WRITERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    Stat total = Stat();
+    for (int i = 0; i < readers + NUM_WRITERS; i++)
+    {
+        total.reads += stats[i].reads;
+        total.torn += stats[i].torn;
+        total.retries += stats[i].retries;
+        total.writes += stats[i].writes;
+        total.waitNs += stats[i].waitNs;
+        if (stats[i].maxWaitNs > total.maxWaitNs)
+        {
+            total.maxWaitNs = stats[i].maxWaitNs;
+        }
+    }
+    printf("%-16s %7d %14.2f %10ld %14.1f %14.1f %6ld %10lu\n", name, readers, total.reads / elapsed / 1e6, total.writes,
+           total.writes > 0 ? total.waitNs / 1000.0 / total.writes : 0.0, total.maxWaitNs / 1000.0, total.torn,
+           (unsigned long)total.retries);
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0.3;
+    int maxReaders = argc > 2 ? atoi(argv[2]) : 64;
+    if (seconds <= 0 || maxReaders < 1)
+    {
+        printf("usage: %s [seconds per run] [max readers]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-16s %7s %14s %10s %14s %14s %6s %10s\n", "lock", "readers", "Mreads/s", "writes", "avg wait us", "max wait us",
+           "torn", "retries");
+    for (int readers = 1; readers <= maxReaders; readers *= 2)
+    {
+        PthreadRWLock pthreadLock(false);
+        run("pthread", pthreadLock, readers, seconds);
+        PthreadRWLock pthreadWriter(true);
+        run("pthread-writer", pthreadWriter, readers, seconds);
+        ScalableRWLock scalable(true);
+        run("scalable", scalable, readers, seconds);
+        ScalableRWLock scalableReader(false);
+        run("scalable-reader", scalableReader, readers, seconds);
+        ResourceSeqLock seqlock;
+        run("seqlock", seqlock, readers, seconds);
+    }
+
+    return 0;
+}
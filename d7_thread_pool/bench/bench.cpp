@@ -0,0 +1,562 @@
+/**
+ * g++ -std=c++17 -O2 -DLOG_LEVEL=LOG_LEVEL_WARN -o bench bench.cpp ../pool1/threadpool.cpp ../pool1/taskalloc.cpp ../pool2/ThreadPool.cpp -lpthread
+ * 或者在仓库根目录用CMake构建（目标bench，同时构建两个线程池的示例和d6_thread_sync的程序）：
+ *     cmake -S . -B build && cmake --build build -j && build/d7_thread_pool/bench/bench > result.json
+ *
+ * 线程池基准测试，结果以JSON输出到标准输出，进度输出到标准错误：
+ *     ./bench > result.json
+ *     ./bench --pools pool1,pool2-ws --workloads empty,spin10us --threads 1,4,8 --scale 0.5 --repeat 3
+ *
+ * 线程池（--pools）：
+ * 1、pool1：threadpool_t，常驻线程数等于线程数，不轮询
+ * 2、pool1-spin：同上，空闲线程先轮询50us再睡眠
+ * 3、pool2：ThreadPool，加锁的共享队列；队列的锁可以在编译时替换，比较不同的锁：
+ *    -DTASK_QUEUE_LOCK=AdaptiveMutex（McsLock、TicketLock，见../common/Locks.h）
+ * 4、pool2-ring：ThreadPool，无锁有界环形队列
+ * 5、pool2-ws：ThreadPool，工作窃取
+ *
+ * 负载（--workloads）：
+ * 1、empty：单个生产者提交空任务，测调度本身的开销
+ * 2、spin1us/spin10us/spin1ms：单个生产者提交忙等1us/10us/1ms的任务
+ * 3、fanout：根任务在工作线程里提交64个子任务，最后一个完成的子任务提交下一轮的根任务（fan-out/fan-in）
+ * 4、storm：每个线程两个生产者同时提交空任务，测提交路径的竞争
+ * 5、bursty：每次突发提交200个10us的任务，间隔2ms，工作线程反复睡眠和被唤醒
+ *
+ * 每组（线程池、负载、线程数、第几次）输出：任务数、耗时、吞吐量（任务/秒）、
+ * 入队到开始执行的延迟百分位（纳秒）、进程CPU时间和平均占用的核数。
+ * 每次都新建线程池并预先创建好工作线程，计时从提交第一个任务开始，到最后一个任务完成为止，
+ * 任务数只取决于--scale，不同机器、不同线程池之间可以直接比较。
+*/
+#include "../pool1/threadpool.h"
+#include "../pool2/ThreadPool.h"
+#include "../common/EventCount.h"
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+static inline uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//忙等ns纳秒，模拟计算型任务
+static inline void spinFor(uint64_t ns)
+{
+    if (ns == 0)
+    {
+        return;
+    }
+    uint64_t end = nowNs() + ns;
+    while (nowNs() < end)
+    {
+    }
+}
+
+struct BenchRun;
+
+//一个任务的记录，提交前写入队时间，开始执行时写开始时间
+struct BenchTask
+{
+    uint64_t enqueueNs;
+    uint64_t startNs;
+    BenchRun* run;
+    int index;
+};
+
+//被测线程池的统一接口
+class BenchPool
+{
+public:
+    virtual ~BenchPool() {}
+    virtual void submit(BenchTask* task) = 0;
+};
+
+//一次运行：全部任务的记录和剩余任务数
+struct BenchRun
+{
+    BenchPool* pool;
+    std::vector<BenchTask> tasks;
+    //任务体，spinNs是计算量
+    void (*body)(BenchTask* task);
+    uint64_t spinNs;
+    //fan-out/fan-in：每轮的子任务数和剩余子任务数
+    int fanout;
+    std::vector<std::atomic<int> > roundLeft;
+    //还没完成的任务数，减到0时唤醒主线程
+    std::atomic<uint32_t> remaining;
+
+    explicit BenchRun(size_t n) : pool(nullptr), tasks(n), body(nullptr), spinNs(0), fanout(0), remaining((uint32_t)n)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            tasks[i].enqueueNs = 0;
+            tasks[i].startNs = 0;
+            tasks[i].run = this;
+            tasks[i].index = (int)i;
+        }
+    }
+
+    inline void submit(BenchTask* task)
+    {
+        task->enqueueNs = nowNs();
+        pool->submit(task);
+    }
+
+    inline void arrive()
+    {
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            futexWake(&remaining, 1);
+        }
+    }
+
+    void waitAll()
+    {
+        uint32_t v;
+        while ((v = remaining.load(std::memory_order_acquire)) != 0)
+        {
+            futexWait(&remaining, v, NULL);
+        }
+    }
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32 bits");
+
+//所有线程池的任务入口
+static inline void runBenchTask(BenchTask* task)
+{
+    task->startNs = nowNs();
+    BenchRun* run = task->run;
+    run->body(task);
+    run->arrive();
+}
+
+static void spinBody(BenchTask* task)
+{
+    spinFor(task->run->spinNs);
+}
+
+//fan-out/fan-in：每轮占fanout+1个记录，第一个是根任务
+static void fanoutBody(BenchTask* task)
+{
+    BenchRun* run = task->run;
+    int stride = run->fanout + 1;
+    int round = task->index / stride;
+    if (task->index % stride == 0)
+    {
+        run->roundLeft[round].store(run->fanout, std::memory_order_relaxed);
+        for (int i = 1; i <= run->fanout; i++)
+        {
+            run->submit(&run->tasks[task->index + i]);
+        }
+        return;
+    }
+    spinFor(run->spinNs);
+    //最后一个完成的子任务提交下一轮
+    if (run->roundLeft[round].fetch_sub(1, std::memory_order_acq_rel) == 1 &&
+        (size_t)(round + 1) * stride < run->tasks.size())
+    {
+        run->submit(&run->tasks[(round + 1) * stride]);
+    }
+}
+
+static void* pool1Entry(void* arg)
+{
+    runBenchTask((BenchTask*)arg);
+    return NULL;
+}
+
+static void pool2Entry(void* arg)
+{
+    runBenchTask((BenchTask*)arg);
+}
+
+class Pool1Bench : public BenchPool
+{
+public:
+    Pool1Bench(int threads, int spinUs)
+    {
+        threadpool_options_t opts;
+        threadpool_options_default(&opts, threads);
+        opts.min_threads = threads;
+        opts.spin_us = spinUs;
+        threadpool_init_options(&m_pool, &opts);
+    }
+
+    ~Pool1Bench()
+    {
+        threadpool_destroy(&m_pool);
+    }
+
+    void submit(BenchTask* task) override
+    {
+        threadpool_add_task(&m_pool, pool1Entry, task);
+    }
+
+private:
+    threadpool_t m_pool;
+};
+
+class Pool2Bench : public BenchPool
+{
+public:
+    Pool2Bench(int threads, bool workStealing, size_t queueCapacity) :
+    m_pool(threads, threads, workStealing, queueCapacity)
+    {
+    }
+
+    void submit(BenchTask* task) override
+    {
+        m_pool.addTask(pool2Entry, task);
+    }
+
+private:
+    ThreadPool m_pool;
+};
+
+static const char* const PoolNames[] = { "pool1", "pool1-spin", "pool2", "pool2-ring", "pool2-ws" };
+
+static BenchPool* createPool(const std::string& name, int threads)
+{
+    if (name == "pool1")
+    {
+        return new Pool1Bench(threads, 0);
+    }
+    if (name == "pool1-spin")
+    {
+        return new Pool1Bench(threads, 50);
+    }
+    if (name == "pool2")
+    {
+        return new Pool2Bench(threads, false, 0);
+    }
+    if (name == "pool2-ring")
+    {
+        return new Pool2Bench(threads, false, 65536);
+    }
+    if (name == "pool2-ws")
+    {
+        return new Pool2Bench(threads, true, 0);
+    }
+    return nullptr;
+}
+
+static const char* const WorkloadNames[] = { "empty", "spin1us", "spin10us", "spin1ms", "fanout", "storm", "bursty" };
+
+//一组运行的结果
+struct BenchResult
+{
+    size_t tasks;
+    double seconds;
+    double userSeconds;
+    double sysSeconds;
+    uint64_t p50, p90, p99, p999, max;
+    double meanNs;
+};
+
+static double cpuSeconds(const struct timeval& tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static BenchResult runWorkload(const std::string& pool, const std::string& workload, int threads, double scale)
+{
+    size_t n = 0;
+    uint64_t spinNs = 0;
+    int producers = 1;
+    int fanout = 0;
+    if (workload == "empty")
+    {
+        n = 200000;
+    }
+    else if (workload == "spin1us")
+    {
+        n = 100000;
+        spinNs = 1000;
+    }
+    else if (workload == "spin10us")
+    {
+        n = 20000;
+        spinNs = 10000;
+    }
+    else if (workload == "spin1ms")
+    {
+        n = 400;
+        spinNs = 1000000;
+    }
+    else if (workload == "fanout")
+    {
+        fanout = 64;
+        n = 200;
+        spinNs = 1000;
+    }
+    else if (workload == "storm")
+    {
+        n = 200000;
+        producers = threads * 2;
+    }
+    else if (workload == "bursty")
+    {
+        n = 50;
+        spinNs = 10000;
+    }
+    n = std::max((size_t)1, (size_t)(n * scale));
+    //fanout和bursty的n是轮数
+    const size_t burst = 200;
+    size_t total = fanout > 0 ? n * (fanout + 1) : (workload == "bursty" ? n * burst : n);
+
+    BenchRun run(total);
+    run.body = fanout > 0 ? fanoutBody : spinBody;
+    run.spinNs = spinNs;
+    run.fanout = fanout;
+    if (fanout > 0)
+    {
+        run.roundLeft = std::vector<std::atomic<int> >(n);
+    }
+    BenchPool* bench = createPool(pool, threads);
+    run.pool = bench;
+    //等常驻线程都进入等待状态
+    usleep(20000);
+
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    uint64_t begin = nowNs();
+    if (fanout > 0)
+    {
+        run.submit(&run.tasks[0]);
+    }
+    else if (workload == "bursty")
+    {
+        for (size_t b = 0; b < n; b++)
+        {
+            for (size_t i = 0; i < burst; i++)
+            {
+                run.submit(&run.tasks[b * burst + i]);
+            }
+            usleep(2000);
+        }
+    }
+    else if (producers > 1)
+    {
+        //生产者先全部就绪，再同时开始提交
+        std::atomic<int> ready(0);
+        std::vector<std::thread> workers;
+        for (int p = 0; p < producers; p++)
+        {
+            workers.emplace_back([&run, &ready, p, producers, total]()
+            {
+                ready.fetch_add(1);
+                while (ready.load() < producers)
+                {
+                    sched_yield();
+                }
+                for (size_t i = p; i < total; i += producers)
+                {
+                    run.submit(&run.tasks[i]);
+                }
+            });
+        }
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i].join();
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < total; i++)
+        {
+            run.submit(&run.tasks[i]);
+        }
+    }
+    run.waitAll();
+    uint64_t end = nowNs();
+    getrusage(RUSAGE_SELF, &after);
+    delete bench;
+
+    BenchResult r;
+    r.tasks = total;
+    r.seconds = (end - begin) / 1e9;
+    r.userSeconds = cpuSeconds(after.ru_utime) - cpuSeconds(before.ru_utime);
+    r.sysSeconds = cpuSeconds(after.ru_stime) - cpuSeconds(before.ru_stime);
+    //producer storm的生产者线程在计时之内创建，也算在CPU时间里
+    std::vector<uint64_t> latency(total);
+    double sum = 0;
+    for (size_t i = 0; i < total; i++)
+    {
+        latency[i] = run.tasks[i].startNs - run.tasks[i].enqueueNs;
+        sum += latency[i];
+    }
+    std::sort(latency.begin(), latency.end());
+    auto at = [&latency](double p) { return latency[std::min(latency.size() - 1, (size_t)(p / 100.0 * latency.size()))]; };
+    r.p50 = at(50);
+    r.p90 = at(90);
+    r.p99 = at(99);
+    r.p999 = at(99.9);
+    r.max = latency.back();
+    r.meanNs = sum / total;
+    return r;
+}
+
+//逗号分隔的列表
+static std::vector<std::string> splitList(const char* s)
+{
+    std::vector<std::string> out;
+    std::string cur;
+    for (; *s; s++)
+    {
+        if (*s == ',')
+        {
+            if (!cur.empty())
+            {
+                out.push_back(cur);
+            }
+            cur.clear();
+        }
+        else
+        {
+            cur += *s;
+        }
+    }
+    if (!cur.empty())
+    {
+        out.push_back(cur);
+    }
+    return out;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [--pools a,b] [--workloads a,b] [--threads 1,2,4] [--scale f] [--repeat n]\n", prog);
+    fprintf(stderr, "pools:");
+    for (size_t i = 0; i < sizeof(PoolNames) / sizeof(PoolNames[0]); i++)
+    {
+        fprintf(stderr, " %s", PoolNames[i]);
+    }
+    fprintf(stderr, "\nworkloads:");
+    for (size_t i = 0; i < sizeof(WorkloadNames) / sizeof(WorkloadNames[0]); i++)
+    {
+        fprintf(stderr, " %s", WorkloadNames[i]);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> pools(PoolNames, PoolNames + sizeof(PoolNames) / sizeof(PoolNames[0]));
+    std::vector<std::string> workloads(WorkloadNames, WorkloadNames + sizeof(WorkloadNames) / sizeof(WorkloadNames[0]));
+    std::vector<int> threads;
+    double scale = 1.0;
+    int repeat = 1;
+
+    //默认线程数：1、2、4……直到CPU数
+    int cpus = (int)std::thread::hardware_concurrency();
+    cpus = cpus > 0 ? cpus : 1;
+    for (int t = 1; t < cpus; t *= 2)
+    {
+        threads.push_back(t);
+    }
+    threads.push_back(cpus);
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (value == nullptr)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(arg, "--pools") == 0)
+        {
+            pools = splitList(value);
+        }
+        else if (strcmp(arg, "--workloads") == 0)
+        {
+            workloads = splitList(value);
+        }
+        else if (strcmp(arg, "--threads") == 0)
+        {
+            threads.clear();
+            std::vector<std::string> list = splitList(value);
+            for (size_t k = 0; k < list.size(); k++)
+            {
+                threads.push_back(std::max(1, atoi(list[k].c_str())));
+            }
+        }
+        else if (strcmp(arg, "--scale") == 0)
+        {
+            scale = atof(value);
+        }
+        else if (strcmp(arg, "--repeat") == 0)
+        {
+            repeat = std::max(1, atoi(value));
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+
+    //检查名字，避免跑到一半才发现写错
+    for (size_t i = 0; i < pools.size(); i++)
+    {
+        if (std::find(PoolNames, PoolNames + sizeof(PoolNames) / sizeof(PoolNames[0]), pools[i]) ==
+            PoolNames + sizeof(PoolNames) / sizeof(PoolNames[0]))
+        {
+            fprintf(stderr, "unknown pool: %s\n", pools[i].c_str());
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < workloads.size(); i++)
+    {
+        if (std::find(WorkloadNames, WorkloadNames + sizeof(WorkloadNames) / sizeof(WorkloadNames[0]), workloads[i]) ==
+            WorkloadNames + sizeof(WorkloadNames) / sizeof(WorkloadNames[0]))
+        {
+            fprintf(stderr, "unknown workload: %s\n", workloads[i].c_str());
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    printf("{\n  \"cpus\": %d,\n  \"scale\": %g,\n  \"results\": [", cpus, scale);
+    bool first = true;
+    for (size_t w = 0; w < workloads.size(); w++)
+    {
+        for (size_t p = 0; p < pools.size(); p++)
+        {
+            for (size_t t = 0; t < threads.size(); t++)
+            {
+                for (int r = 0; r < repeat; r++)
+                {
+                    fprintf(stderr, "%s %s threads=%d run=%d\n", workloads[w].c_str(), pools[p].c_str(), threads[t], r);
+                    BenchResult res = runWorkload(pools[p], workloads[w], threads[t], scale);
+                    printf("%s\n    {\"pool\": \"%s\", \"workload\": \"%s\", \"threads\": %d, \"run\": %d, "
+                           "\"tasks\": %zu, \"seconds\": %.6f, \"throughput\": %.1f, "
+                           "\"latency_ns\": {\"mean\": %.0f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}, "
+                           "\"cpu\": {\"user_s\": %.4f, \"sys_s\": %.4f, \"cores\": %.2f}}",
+                           first ? "" : ",", pools[p].c_str(), workloads[w].c_str(), threads[t], r,
+                           res.tasks, res.seconds, res.tasks / res.seconds,
+                           res.meanNs, (unsigned long long)res.p50, (unsigned long long)res.p90,
+                           (unsigned long long)res.p99, (unsigned long long)res.p999, (unsigned long long)res.max,
+                           res.userSeconds, res.sysSeconds, (res.userSeconds + res.sysSeconds) / res.seconds);
+                    fflush(stdout);
+                    first = false;
+                }
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,415 @@
+#ifndef _ASYNC_LOG_H_
+#define _ASYNC_LOG_H_
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * 异步日志
+ *
+ * 直接用std::cout打日志，每条日志都要抢iostream的全局锁，再做一次write系统调用，
+ * 放在线程池的工作循环里会严重拖慢任务执行。这里的做法：
+ * 1、每个线程一个单生产者单消费者的环形缓冲区，写日志只是把一条定长的二进制记录拷进去，无锁
+ * 2、记录里只保存格式串指针和参数的原始值，不在写日志的线程上格式化
+ * 3、后台线程定期收集所有缓冲区的记录，按时间排序后格式化，整批一次write
+ * 4、缓冲区满时丢弃记录并计数，写日志的线程永远不会阻塞
+ * 5、日志级别在编译期过滤，低于LOG_LEVEL的日志宏展开为空语句，参数也不会求值
+ *
+ * 格式串用{}作为参数占位符，格式串和字符串参数必须是字符串常量，因为记录里只保存指针：
+ * LOG_DEBUG("thread tid:{} is waiting", pthread_self());
+ *
+ * 编译时加 -DLOG_LEVEL=LOG_LEVEL_INFO 可以去掉所有调试日志。
+*/
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF   4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+//日志参数，保存原始值，由后台线程格式化
+struct LogArg
+{
+    enum Type { Int, Uint, Double, Str, Ptr };
+    Type type;
+    union
+    {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const char* s;
+        const void* p;
+    };
+};
+
+//一条定长的日志记录
+struct LogRecord
+{
+    static const int MaxArgs = 6;
+
+    uint64_t timeNs;        //CLOCK_REALTIME时间
+    uint64_t thread;        //写日志的线程
+    const char* fmt;
+    int level;
+    int argc;
+    LogArg args[MaxArgs];
+};
+
+//单生产者单消费者环形缓冲区，每个写日志的线程一个
+struct LogBuffer
+{
+    static const size_t Capacity = 1024;
+
+    //生产者写m_tail，消费者写m_head，分开放在不同的缓存行
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    std::atomic<uint64_t> dropped;
+    //是否被某个线程占用，线程退出后缓冲区留给新线程复用
+    std::atomic<bool> owned;
+    LogBuffer* next;
+    LogRecord records[Capacity];
+
+    LogBuffer() : head(0), tail(0), dropped(0), owned(true), next(nullptr) {}
+};
+
+class AsyncLog
+{
+public:
+    //全局日志对象，第一次写日志时创建后台线程。对象故意不释放，
+    //避免进程退出时还在运行的线程访问已经析构的日志对象
+    static AsyncLog& instance()
+    {
+        static AsyncLog* log = create();
+        return *log;
+    }
+
+    //设置输出的文件描述符，默认标准输出
+    inline void setOutput(int fd)
+    {
+        m_fd.store(fd);
+    }
+
+    //写一条日志，只拷贝参数，不格式化
+    template <typename... Args>
+    void log(int level, const char* fmt, const Args&... args)
+    {
+        static_assert(sizeof...(Args) <= LogRecord::MaxArgs, "too many log arguments");
+        LogBuffer* buf = localBuffer();
+        size_t tail = buf->tail.load(std::memory_order_relaxed);
+        if (tail - buf->head.load(std::memory_order_acquire) >= LogBuffer::Capacity)
+        {
+            buf->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        LogRecord& r = buf->records[tail % LogBuffer::Capacity];
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        r.timeNs = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        r.thread = (uint64_t)pthread_self();
+        r.fmt = fmt;
+        r.level = level;
+        r.argc = 0;
+        int dummy[] = { 0, (r.args[r.argc++] = makeArg(args), 0)... };
+        (void)dummy;
+        buf->tail.store(tail + 1, std::memory_order_release);
+    }
+
+    //立即把所有缓冲区中的日志写出去
+    void flush()
+    {
+        pthread_mutex_lock(&m_drainLock);
+        drain();
+        pthread_mutex_unlock(&m_drainLock);
+    }
+
+private:
+    AsyncLog() :
+    m_buffers(nullptr),
+    m_fd(STDOUT_FILENO),
+    m_running(true)
+    {
+        pthread_mutex_init(&m_drainLock, nullptr);
+    }
+
+    static AsyncLog* create()
+    {
+        AsyncLog* log = new AsyncLog();
+        pthread_create(&log->m_thread, nullptr, flusher, log);
+        atexit(stopAtExit);
+        return log;
+    }
+
+    //进程退出时停止后台线程并写出剩余的日志
+    static void stopAtExit()
+    {
+        AsyncLog& log = instance();
+        log.m_running.store(false);
+        pthread_join(log.m_thread, nullptr);
+        log.flush();
+    }
+
+    //线程退出时归还缓冲区
+    struct LocalHandle
+    {
+        LogBuffer* buf = nullptr;
+        ~LocalHandle()
+        {
+            if (buf != nullptr)
+            {
+                buf->owned.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    inline LogBuffer* localBuffer()
+    {
+        static thread_local LocalHandle handle;
+        if (handle.buf == nullptr)
+        {
+            handle.buf = acquireBuffer();
+        }
+        return handle.buf;
+    }
+
+    //优先复用已退出线程的缓冲区，没有再新建一个挂到链表头
+    LogBuffer* acquireBuffer()
+    {
+        for (LogBuffer* b = m_buffers.load(std::memory_order_acquire); b != nullptr; b = b->next)
+        {
+            bool expected = false;
+            if (!b->owned.load(std::memory_order_relaxed)
+                && b->owned.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            {
+                return b;
+            }
+        }
+
+        LogBuffer* b = new LogBuffer();
+        LogBuffer* head = m_buffers.load(std::memory_order_relaxed);
+        do
+        {
+            b->next = head;
+        } while (!m_buffers.compare_exchange_weak(head, b, std::memory_order_release, std::memory_order_relaxed));
+        return b;
+    }
+
+    template <typename T>
+    static LogArg makeArg(const T& v)
+    {
+        LogArg a;
+        if (std::is_floating_point<T>::value)
+        {
+            a.type = LogArg::Double;
+            a.d = (double)v;
+        }
+        else if (std::is_signed<T>::value)
+        {
+            a.type = LogArg::Int;
+            a.i = (int64_t)v;
+        }
+        else
+        {
+            a.type = LogArg::Uint;
+            a.u = (uint64_t)v;
+        }
+        return a;
+    }
+
+    static LogArg makeArg(const char* s)
+    {
+        LogArg a;
+        a.type = LogArg::Str;
+        a.s = s;
+        return a;
+    }
+
+    template <typename T>
+    static LogArg makeArg(T* p)
+    {
+        LogArg a;
+        a.type = LogArg::Ptr;
+        a.p = p;
+        return a;
+    }
+
+    static void* flusher(void* arg)
+    {
+        AsyncLog* log = static_cast<AsyncLog*>(arg);
+        while (log->m_running.load())
+        {
+            pthread_mutex_lock(&log->m_drainLock);
+            size_t n = log->drain();
+            pthread_mutex_unlock(&log->m_drainLock);
+            if (n == 0)
+            {
+                //没有日志时降低收集频率
+                usleep(FlushIntervalUs);
+            }
+        }
+        return nullptr;
+    }
+
+    //收集所有缓冲区的记录，排序、格式化后一次写出，调用前需持有m_drainLock
+    size_t drain()
+    {
+        m_batch.clear();
+        for (LogBuffer* b = m_buffers.load(std::memory_order_acquire); b != nullptr; b = b->next)
+        {
+            size_t head = b->head.load(std::memory_order_relaxed);
+            size_t tail = b->tail.load(std::memory_order_acquire);
+            for (; head != tail; head++)
+            {
+                m_batch.push_back(b->records[head % LogBuffer::Capacity]);
+            }
+            b->head.store(head, std::memory_order_release);
+
+            uint64_t dropped = b->dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0)
+            {
+                LogRecord r;
+                r.timeNs = m_batch.empty() ? 0 : m_batch.back().timeNs;
+                r.thread = 0;
+                r.fmt = "log buffer full, dropped {} records";
+                r.level = LOG_LEVEL_WARN;
+                r.argc = 1;
+                r.args[0] = makeArg(dropped);
+                m_batch.push_back(r);
+            }
+        }
+        if (m_batch.empty())
+        {
+            return 0;
+        }
+
+        std::stable_sort(m_batch.begin(), m_batch.end(),
+            [](const LogRecord& a, const LogRecord& b) { return a.timeNs < b.timeNs; });
+
+        m_text.clear();
+        for (size_t i = 0; i < m_batch.size(); i++)
+        {
+            format(m_batch[i]);
+        }
+
+        int fd = m_fd.load();
+        const char* p = m_text.data();
+        size_t left = m_text.size();
+        while (left > 0)
+        {
+            ssize_t w = write(fd, p, left);
+            if (w <= 0)
+            {
+                break;
+            }
+            p += w;
+            left -= w;
+        }
+        return m_batch.size();
+    }
+
+    //格式：时:分:秒.微秒 级别 线程 内容
+    void format(const LogRecord& r)
+    {
+        static const char* levels[] = { "D", "I", "W", "E" };
+        char buf[64];
+        time_t sec = (time_t)(r.timeNs / 1000000000ull);
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        int n = snprintf(buf, sizeof(buf), "%02d:%02d:%02d.%06d %s %lu ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+                         (int)(r.timeNs % 1000000000ull / 1000), levels[r.level], (unsigned long)r.thread);
+        m_text.insert(m_text.end(), buf, buf + n);
+
+        int argi = 0;
+        for (const char* f = r.fmt; *f != '\0'; f++)
+        {
+            if (f[0] == '{' && f[1] == '}' && argi < r.argc)
+            {
+                appendArg(r.args[argi++]);
+                f++;
+            }
+            else
+            {
+                m_text.push_back(*f);
+            }
+        }
+        m_text.push_back('\n');
+    }
+
+    void appendArg(const LogArg& a)
+    {
+        char buf[32];
+        int n = 0;
+        switch (a.type)
+        {
+        case LogArg::Int:
+            n = snprintf(buf, sizeof(buf), "%lld", (long long)a.i);
+            break;
+        case LogArg::Uint:
+            n = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)a.u);
+            break;
+        case LogArg::Double:
+            n = snprintf(buf, sizeof(buf), "%g", a.d);
+            break;
+        case LogArg::Ptr:
+            n = snprintf(buf, sizeof(buf), "%p", a.p);
+            break;
+        case LogArg::Str:
+            m_text.insert(m_text.end(), a.s, a.s + strlen(a.s));
+            return;
+        }
+        m_text.insert(m_text.end(), buf, buf + n);
+    }
+
+private:
+    //没有日志时后台线程的收集间隔
+    static const int FlushIntervalUs = 1000;
+
+    //所有缓冲区组成的链表，只增加不删除
+    std::atomic<LogBuffer*> m_buffers;
+    std::atomic<int> m_fd;
+    std::atomic<bool> m_running;
+    pthread_t m_thread;
+    //后台线程和flush互斥，保证每个缓冲区只有一个消费者
+    pthread_mutex_t m_drainLock;
+    std::vector<LogRecord> m_batch;
+    std::vector<char> m_text;
+};
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) AsyncLog::instance().log(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) AsyncLog::instance().log(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) AsyncLog::instance().log(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) AsyncLog::instance().log(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void)0)
+#endif
+
+#endif // _ASYNC_LOG_H_
@@ -0,0 +1,583 @@
+#ifndef _CHANNEL_H_
+#define _CHANNEL_H_
+
+#include "EventCount.h"
+#include <atomic>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * 有界通道：线程之间传递小消息，代替“数组+互斥锁+两个条件变量”的生产者消费者缓冲区
+ *
+ *     Channel<Msg, ChannelSPSC> ch(1024);   //一个生产者一个消费者
+ *     Channel<Msg> ch(1024);                //多个生产者多个消费者
+ *     生产者：ch.push(msg);  ch.pushN(msgs, n);  ch.close();
+ *     消费者：while (ch.pop(msg)) {...}  或者  while ((n = ch.popN(buf, max)) > 0) {...}
+ *
+ * 1、SPSC：读写下标各占一个缓存行，只有一个线程写，没有原子读改写；生产者缓存上次读到的消费下标，
+ *    只有缓存的值显示队列满时才去读对方的缓存行，消费者同理，大部分操作不会在核之间传递缓存行
+ * 2、MPMC：每个槽位带序号（和pool2/MPMCQueue.h相同的方案），一次CAS抢占位置
+ * 3、批量：pushN/popN先检查连续的一段槽位，再一次发布下标（MPMC是一次CAS），
+ *    一批消息只有一次原子读改写和一次通知
+ * 4、阻塞：push/pop先试几次，不行再在事件计数（EventCount.h）上睡眠；
+ *    对方没有睡眠时通知只是一次内存屏障加一次读，不进内核，只有对方真的睡着了才调用futex
+ * 5、close之后push返回false，pop取完剩下的消息后返回false，所有睡眠的线程都被唤醒；
+ *    push返回true的消息一定会被取到：MPMC的关闭标志是入队下标的最高位，抢占槽位的CAS和关闭互斥，
+ *    关闭之后入队下标不再变化，消费者取到这个下标为止；SPSC没有原子读改写，close必须由生产者调用
+ *    （或者发生在生产者最后一次push之后），否则和close同时进行的push可能返回true但消息取不到
+ *
+ * 容量向上取整为2的幂，支持只能移动的类型。每个线程同一时刻只能在一个通道上阻塞。
+*/
+
+//通道类型
+enum ChannelKind
+{
+    ChannelSPSC,        //单生产者单消费者
+    ChannelMPMC         //多生产者多消费者
+};
+
+//忙等待时降低功耗
+static inline void channelRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+static inline size_t channelCapacity(size_t capacity)
+{
+    size_t cap = 2;
+    while (cap < capacity)
+    {
+        cap <<= 1;
+    }
+    return cap;
+}
+
+//单生产者单消费者环形队列
+template <typename T>
+class SPSCRing
+{
+public:
+    explicit SPSCRing(size_t capacity) : m_mask(channelCapacity(capacity) - 1)
+    {
+        m_slots = static_cast<Slot*>(::operator new(sizeof(Slot) * (m_mask + 1)));
+        m_write.store(0, std::memory_order_relaxed);
+        m_read.store(0, std::memory_order_relaxed);
+        m_closed.store(false, std::memory_order_relaxed);
+        m_cachedRead = 0;
+        m_cachedWrite = 0;
+    }
+
+    ~SPSCRing()
+    {
+        size_t write = m_write.load(std::memory_order_relaxed);
+        for (size_t i = m_read.load(std::memory_order_relaxed); i != write; i++)
+        {
+            item(i)->~T();
+        }
+        ::operator delete(m_slots);
+    }
+
+    SPSCRing(const SPSCRing&) = delete;
+    SPSCRing& operator=(const SPSCRing&) = delete;
+
+    //入队，队列满时返回false
+    template <typename U>
+    bool tryPush(U&& value)
+    {
+        size_t write = m_write.load(std::memory_order_relaxed);
+        if (write - m_cachedRead > m_mask)
+        {
+            //按缓存的消费下标已经满了，才去读消费者的缓存行
+            m_cachedRead = m_read.load(std::memory_order_acquire);
+            if (write - m_cachedRead > m_mask)
+            {
+                return false;
+            }
+        }
+        new (item(write)) T(std::forward<U>(value));
+        m_write.store(write + 1, std::memory_order_release);
+        return true;
+    }
+
+    //批量入队，元素从items移走，返回入队的个数
+    size_t tryPushN(T* items, size_t n)
+    {
+        size_t write = m_write.load(std::memory_order_relaxed);
+        size_t room = m_mask + 1 - (write - m_cachedRead);
+        if (room < n)
+        {
+            m_cachedRead = m_read.load(std::memory_order_acquire);
+            room = m_mask + 1 - (write - m_cachedRead);
+        }
+        n = n < room ? n : room;
+        for (size_t i = 0; i < n; i++)
+        {
+            new (item(write + i)) T(std::move(items[i]));
+        }
+        if (n > 0)
+        {
+            m_write.store(write + n, std::memory_order_release);
+        }
+        return n;
+    }
+
+    //出队，队列空时返回false
+    bool tryPop(T& value)
+    {
+        size_t read = m_read.load(std::memory_order_relaxed);
+        if (read == m_cachedWrite)
+        {
+            m_cachedWrite = m_write.load(std::memory_order_acquire);
+            if (read == m_cachedWrite)
+            {
+                return false;
+            }
+        }
+        T* data = item(read);
+        value = std::move(*data);
+        data->~T();
+        m_read.store(read + 1, std::memory_order_release);
+        return true;
+    }
+
+    //批量出队，返回取出的个数
+    size_t tryPopN(T* out, size_t n)
+    {
+        size_t read = m_read.load(std::memory_order_relaxed);
+        if (m_cachedWrite - read < n)
+        {
+            m_cachedWrite = m_write.load(std::memory_order_acquire);
+        }
+        size_t ready = m_cachedWrite - read;
+        n = n < ready ? n : ready;
+        for (size_t i = 0; i < n; i++)
+        {
+            T* data = item(read + i);
+            out[i] = std::move(*data);
+            data->~T();
+        }
+        if (n > 0)
+        {
+            m_read.store(read + n, std::memory_order_release);
+        }
+        return n;
+    }
+
+    //近似的元素个数
+    inline size_t size() const
+    {
+        size_t write = m_write.load(std::memory_order_relaxed);
+        size_t read = m_read.load(std::memory_order_relaxed);
+        return write > read ? write - read : 0;
+    }
+
+    //关闭，由生产者调用：之前的入队都先于关闭标志可见
+    inline void close()
+    {
+        m_closed.store(true, std::memory_order_release);
+    }
+
+    inline bool closed() const
+    {
+        return m_closed.load(std::memory_order_acquire);
+    }
+
+    //已经关闭并且取完，只由消费者调用
+    inline bool drained() const
+    {
+        return closed() && m_read.load(std::memory_order_relaxed) == m_write.load(std::memory_order_acquire);
+    }
+
+    inline size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+    inline T* item(size_t index)
+    {
+        return reinterpret_cast<T*>(&m_slots[index & m_mask]);
+    }
+
+    Slot* m_slots;
+    size_t m_mask;
+    //生产者的缓存行：写下标、缓存的读下标和关闭标志
+    alignas(64) std::atomic<size_t> m_write;
+    size_t m_cachedRead;
+    std::atomic<bool> m_closed;
+    //消费者的缓存行：读下标和缓存的写下标
+    alignas(64) std::atomic<size_t> m_read;
+    size_t m_cachedWrite;
+    char m_pad[64 - sizeof(size_t) * 2];
+};
+
+//多生产者多消费者环形队列，每个槽位带一个序号
+template <typename T>
+class MPMCRing
+{
+public:
+    explicit MPMCRing(size_t capacity) : m_mask(channelCapacity(capacity) - 1)
+    {
+        m_cells = new Cell[m_mask + 1];
+        for (size_t i = 0; i <= m_mask; i++)
+        {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+        m_enqueuePos.store(0, std::memory_order_relaxed);
+        m_dequeuePos.store(0, std::memory_order_relaxed);
+    }
+
+    ~MPMCRing()
+    {
+        size_t tail = m_enqueuePos.load(std::memory_order_relaxed) & ~ClosedBit;
+        for (size_t i = m_dequeuePos.load(std::memory_order_relaxed); i != tail; i++)
+        {
+            reinterpret_cast<T*>(m_cells[i & m_mask].storage)->~T();
+        }
+        delete[] m_cells;
+    }
+
+    MPMCRing(const MPMCRing&) = delete;
+    MPMCRing& operator=(const MPMCRing&) = delete;
+
+    //入队，队列满时返回false
+    template <typename U>
+    bool tryPush(U&& value)
+    {
+        size_t pos;
+        if (claim(m_enqueuePos, 0, 1, pos) == 0)
+        {
+            return false;
+        }
+        Cell* cell = &m_cells[pos & m_mask];
+        new (cell->storage) T(std::forward<U>(value));
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    //批量入队，元素从items移走，返回入队的个数
+    size_t tryPushN(T* items, size_t n)
+    {
+        size_t pos;
+        n = claim(m_enqueuePos, 0, n, pos);
+        for (size_t i = 0; i < n; i++)
+        {
+            Cell* cell = &m_cells[(pos + i) & m_mask];
+            new (cell->storage) T(std::move(items[i]));
+            cell->seq.store(pos + i + 1, std::memory_order_release);
+        }
+        return n;
+    }
+
+    //出队，队列空时返回false
+    bool tryPop(T& value)
+    {
+        size_t pos;
+        if (claim(m_dequeuePos, 1, 1, pos) == 0)
+        {
+            return false;
+        }
+        take(pos, value);
+        return true;
+    }
+
+    //批量出队，返回取出的个数
+    size_t tryPopN(T* out, size_t n)
+    {
+        size_t pos;
+        n = claim(m_dequeuePos, 1, n, pos);
+        for (size_t i = 0; i < n; i++)
+        {
+            take(pos + i, out[i]);
+        }
+        return n;
+    }
+
+    //近似的元素个数
+    inline size_t size() const
+    {
+        size_t tail = m_enqueuePos.load(std::memory_order_relaxed) & ~ClosedBit;
+        size_t head = m_dequeuePos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    inline size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+    //关闭：入队下标置上最高位，之后抢占槽位的CAS都会失败，已经抢到的槽位照常写入
+    inline void close()
+    {
+        m_enqueuePos.fetch_or(ClosedBit, std::memory_order_acq_rel);
+    }
+
+    inline bool closed() const
+    {
+        return (m_enqueuePos.load(std::memory_order_acquire) & ClosedBit) != 0;
+    }
+
+    //已经关闭并且关闭前抢到的槽位都已经被消费者抢走
+    inline bool drained() const
+    {
+        size_t tail = m_enqueuePos.load(std::memory_order_acquire);
+        return (tail & ClosedBit) != 0 && m_dequeuePos.load(std::memory_order_acquire) == (tail & ~ClosedBit);
+    }
+
+private:
+    //入队下标的最高位是关闭标志，下标本身用不到这一位
+    static const size_t ClosedBit = (size_t)1 << (sizeof(size_t) * 8 - 1);
+
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    /**
+     * 从位置cursor开始抢占最多n个连续槽位，返回抢到的个数，起始位置写入pos
+     * 生产者找序号等于位置的空闲槽位（lag为0），消费者找序号等于位置+1的有数据槽位（lag为1）；
+     * 检查过的槽位在CAS成功之前别人也只能从同一个位置开始抢，所以一次CAS就独占了整段；
+     * 入队下标带上关闭标志后CAS一定失败，重新读到的位置带着标志，返回0
+    */
+    size_t claim(std::atomic<size_t>& cursor, size_t lag, size_t n, size_t& pos)
+    {
+        pos = cursor.load(std::memory_order_relaxed);
+        while (n > 0)
+        {
+            if ((pos & ClosedBit) != 0)
+            {
+                return 0;
+            }
+            size_t k = 0;
+            while (k < n && k <= m_mask)
+            {
+                size_t seq = m_cells[(pos + k) & m_mask].seq.load(std::memory_order_acquire);
+                if (seq != pos + k + lag)
+                {
+                    break;
+                }
+                k++;
+            }
+            if (k == 0)
+            {
+                size_t seq = m_cells[pos & m_mask].seq.load(std::memory_order_acquire);
+                if ((intptr_t)(seq - (pos + lag)) < 0)
+                {
+                    //生产者：槽位还没被取走，队列满；消费者：还没写入，队列空
+                    return 0;
+                }
+                //被别人抢先了，重新读取位置
+                pos = cursor.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (cursor.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed))
+            {
+                return k;
+            }
+        }
+        return 0;
+    }
+
+    void take(size_t pos, T& value)
+    {
+        Cell* cell = &m_cells[pos & m_mask];
+        T* data = reinterpret_cast<T*>(cell->storage);
+        value = std::move(*data);
+        data->~T();
+        //序号加上容量，留给下一圈的生产者
+        cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+    }
+
+    alignas(64) Cell* m_cells;
+    size_t m_mask;
+    //生产者和消费者各自独占一个缓存行
+    alignas(64) std::atomic<size_t> m_enqueuePos;
+    alignas(64) std::atomic<size_t> m_dequeuePos;
+};
+
+template <typename T, ChannelKind Kind = ChannelMPMC>
+class Channel
+{
+public:
+    typedef typename std::conditional<Kind == ChannelSPSC, SPSCRing<T>, MPMCRing<T> >::type Ring;
+
+    explicit Channel(size_t capacity) : m_ring(capacity) {}
+
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    //不阻塞的入队，队列满或者已关闭返回false
+    template <typename U>
+    bool tryPush(U&& value)
+    {
+        if (closed() || !m_ring.tryPush(std::forward<U>(value)))
+        {
+            return false;
+        }
+        m_notEmpty.notifyOne();
+        return true;
+    }
+
+    //不阻塞的出队，队列空返回false
+    bool tryPop(T& value)
+    {
+        if (!m_ring.tryPop(value))
+        {
+            return false;
+        }
+        m_notFull.notifyOne();
+        return true;
+    }
+
+    //不阻塞的批量入队，返回入队的个数
+    size_t tryPushN(T* items, size_t n)
+    {
+        if (closed())
+        {
+            return 0;
+        }
+        size_t k = m_ring.tryPushN(items, n);
+        if (k > 0)
+        {
+            m_notEmpty.notify((int)k);
+        }
+        return k;
+    }
+
+    //不阻塞的批量出队，返回取出的个数
+    size_t tryPopN(T* out, size_t n)
+    {
+        size_t k = m_ring.tryPopN(out, n);
+        if (k > 0)
+        {
+            m_notFull.notify((int)k);
+        }
+        return k;
+    }
+
+    //入队，队列满时阻塞，已关闭返回false
+    template <typename U>
+    bool push(U&& value)
+    {
+        return await(m_notFull, [&]() { return tryPush(std::forward<U>(value)) ? 1 : closed() ? -1 : 0; }) > 0;
+    }
+
+    //出队，队列空时阻塞，已关闭并且取完返回false
+    bool pop(T& value)
+    {
+        return await(m_notEmpty, [&]() { return tryPop(value) ? 1 : closed() ? emptyAfterClose() : 0; }) > 0;
+    }
+
+    //全部入队才返回，队列满时阻塞；已关闭时返回已经入队的个数
+    size_t pushN(T* items, size_t n)
+    {
+        size_t done = 0;
+        while (done < n)
+        {
+            int r = await(m_notFull, [&]()
+            {
+                size_t k = tryPushN(items + done, n - done);
+                done += k;
+                return k > 0 ? 1 : closed() ? -1 : 0;
+            });
+            if (r < 0)
+            {
+                break;
+            }
+        }
+        return done;
+    }
+
+    //至少取出一个才返回，最多n个，队列空时阻塞；已关闭并且取完返回0
+    size_t popN(T* out, size_t n)
+    {
+        size_t k = 0;
+        await(m_notEmpty, [&]()
+        {
+            k = tryPopN(out, n);
+            return k > 0 ? 1 : closed() ? emptyAfterClose() : 0;
+        });
+        return k;
+    }
+
+    //关闭通道：之后不能再入队，消费者取完剩下的消息后返回；SPSC只能由生产者关闭
+    void close()
+    {
+        m_ring.close();
+        m_notEmpty.notifyAll();
+        m_notFull.notifyAll();
+    }
+
+    inline bool closed() const
+    {
+        return m_ring.closed();
+    }
+
+    //近似的元素个数
+    inline size_t size() const
+    {
+        return m_ring.size();
+    }
+
+    inline size_t capacity() const
+    {
+        return m_ring.capacity();
+    }
+
+private:
+    //睡眠前先试的次数，对方很快就会腾出位置或者放入消息时不用睡眠
+    static const int SpinCount = 128;
+
+    /**
+     * 反复尝试attempt直到它返回非0：大于0成功，小于0放弃
+     * 先忙等几次，再登记为等待者后重试一次，仍然不行才睡眠；
+     * 登记之后的重试和对方操作之后的通知配对，不会丢失唤醒
+    */
+    template <typename Attempt>
+    static int await(EventCount& ec, Attempt attempt)
+    {
+        int r;
+        for (int i = 0; i < SpinCount; i++)
+        {
+            if ((r = attempt()) != 0)
+            {
+                return r;
+            }
+            channelRelax();
+        }
+        while (true)
+        {
+            ec.prepareWait();
+            if ((r = attempt()) != 0)
+            {
+                ec.cancelWait();
+                return r;
+            }
+            ec.wait();
+        }
+    }
+
+    //关闭之后还要再取一次：关闭前抢到槽位的生产者可能还没写完，等它写完再取
+    int emptyAfterClose()
+    {
+        return m_ring.drained() ? -1 : 0;
+    }
+
+private:
+    Ring m_ring;
+    //消费者在m_notEmpty上等待，生产者在m_notFull上等待
+    EventCount m_notEmpty;
+    EventCount m_notFull;
+};
+
+#endif // _CHANNEL_H_
@@ -0,0 +1,280 @@
+#ifndef _EVENT_COUNT_H_
+#define _EVENT_COUNT_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+//在一个32位原子变量上等待，值不等于expected时立即返回，timeout为NULL表示一直等待
+static inline void futexWait(void* addr, uint32_t expected, const struct timespec* timeout)
+{
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+}
+
+//唤醒在addr上等待的最多n个线程；只用地址，不访问内存，对象已经释放也是安全的
+static inline void futexWake(void* addr, int n)
+{
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE_PRIVATE, n, nullptr, nullptr, 0);
+}
+
+/**
+ * 基于futex的事件计数（eventcount），代替“互斥锁+条件变量”让空闲线程睡眠
+ *
+ * 等待方：
+ *     ec.prepareWait();
+ *     if (条件已经满足) { ec.cancelWait(); } else { ec.wait(timeoutNs); }
+ * 通知方：先发布数据（修改条件），再调用notifyOne/notify/notifyAll
+ *
+ * 1、没有线程等待时，通知只是一次内存屏障加一次读，不加锁也不进内核，
+ *    线程池繁忙时提交任务不再有futex系统调用
+ * 2、每个等待线程睡在自己的futex字上，notifyOne只唤醒一个确定的线程，
+ *    不会像条件变量的broadcast那样惊群，也不会唤醒之后再去抢互斥锁
+ * 3、优先唤醒最后睡下的线程，它的缓存还是热的，睡得久的线程可以空闲超时退出
+ * 4、等待线程还没有真正进入futex时被通知，通知方也不进内核
+ * 5、wait支持超时，使用CLOCK_MONOTONIC，不受系统时间调整影响
+ *
+ * prepareWait之后、检查条件之前有一次全屏障，和通知方发布数据之后的全屏障配对，
+ * 条件用什么内存序读写都不会丢失唤醒。
+ * 每个线程同一时刻只能在一个事件计数上等待。
+*/
+class EventCount
+{
+public:
+    EventCount() : m_waiters(0), m_head(nullptr), m_lock(false) {}
+
+    EventCount(const EventCount&) = delete;
+    EventCount& operator=(const EventCount&) = delete;
+
+    //登记为等待者，之后必须调用wait或cancelWait
+    void prepareWait()
+    {
+        Waiter* w = self();
+        w->state.store(Waiting, std::memory_order_relaxed);
+        lock();
+        //插入链表头，通知时从链表头取，后睡下的先被唤醒
+        w->prev = nullptr;
+        w->next = m_head;
+        if (m_head != nullptr)
+        {
+            m_head->prev = w;
+        }
+        m_head = w;
+        w->queued = true;
+        m_waiters.store(m_waiters.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        unlock();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    //条件已经满足，不再等待
+    void cancelWait()
+    {
+        Waiter* w = self();
+        if (dequeue(w))
+        {
+            return;
+        }
+        //已经被通知方选中，这次唤醒本来是给某个等待者的，转给下一个
+        awaitNotified(w);
+        notifyOne();
+    }
+
+    //睡眠直到被通知或超时，timeoutNs小于0表示一直等待，被通知返回true，超时返回false
+    bool wait(int64_t timeoutNs = -1)
+    {
+        Waiter* w = self();
+        int64_t deadline = timeoutNs >= 0 ? nowNs() + timeoutNs : -1;
+        uint32_t expected = Waiting;
+        if (w->state.compare_exchange_strong(expected, Sleeping, std::memory_order_acq_rel))
+        {
+            while (w->state.load(std::memory_order_acquire) == Sleeping)
+            {
+                struct timespec ts;
+                struct timespec* pts = nullptr;
+                if (deadline >= 0)
+                {
+                    int64_t left = deadline - nowNs();
+                    if (left <= 0)
+                    {
+                        break;
+                    }
+                    ts.tv_sec = left / 1000000000;
+                    ts.tv_nsec = left % 1000000000;
+                    pts = &ts;
+                }
+                //值已经不是Sleeping时立即返回，被信号打断或假唤醒就重新检查
+                futexWait(&w->state, Sleeping, pts);
+            }
+        }
+
+        if (w->state.load(std::memory_order_acquire) == Notified)
+        {
+            return true;
+        }
+        //超时，还在链表里就自己摘下来
+        if (dequeue(w))
+        {
+            return false;
+        }
+        //超时的同时被通知方选中了，等它写完状态
+        awaitNotified(w);
+        return true;
+    }
+
+    //唤醒一个等待者，没有等待者时返回false
+    bool notifyOne()
+    {
+        return notify(1) > 0;
+    }
+
+    //唤醒最多n个等待者，返回实际唤醒的个数
+    int notify(int n)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (n <= 0 || m_waiters.load(std::memory_order_relaxed) == 0)
+        {
+            return 0;
+        }
+
+        //在锁内把选中的等待者摘成一条链，锁外逐个唤醒
+        Waiter* picked = nullptr;
+        int count = 0;
+        lock();
+        while (count < n && m_head != nullptr)
+        {
+            Waiter* w = m_head;
+            m_head = w->next;
+            if (m_head != nullptr)
+            {
+                m_head->prev = nullptr;
+            }
+            w->queued = false;
+            w->next = picked;
+            picked = w;
+            count++;
+        }
+        m_waiters.store(m_waiters.load(std::memory_order_relaxed) - count, std::memory_order_relaxed);
+        unlock();
+
+        while (picked != nullptr)
+        {
+            //先取next，写完状态后等待者可能立即返回并重新登记
+            Waiter* w = picked;
+            picked = w->next;
+            if (w->state.exchange(Notified, std::memory_order_acq_rel) == Sleeping)
+            {
+                futexWake(&w->state, 1);
+            }
+        }
+        return count;
+    }
+
+    //唤醒所有等待者
+    int notifyAll()
+    {
+        return notify(0x7fffffff);
+    }
+
+    //当前登记的等待者数，只是一个近似值
+    inline int waiters() const
+    {
+        return m_waiters.load(std::memory_order_relaxed);
+    }
+
+private:
+    enum
+    {
+        Notified = 0,       //已被通知，或者不在等待
+        Waiting = 1,        //已登记，还没有进入futex
+        Sleeping = 2        //在futex上睡眠，通知方需要进内核唤醒
+    };
+
+    //每个线程一个等待节点，线程同一时刻只会在一个事件计数上等待
+    struct Waiter
+    {
+        std::atomic<uint32_t> state;
+        Waiter* prev;
+        Waiter* next;
+        bool queued;
+    };
+
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32 bits");
+
+    static Waiter* self()
+    {
+        static thread_local Waiter waiter = { {Notified}, nullptr, nullptr, false };
+        return &waiter;
+    }
+
+    static inline int64_t nowNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    //还在链表里就摘下来并返回true，已经被通知方摘走返回false
+    bool dequeue(Waiter* w)
+    {
+        lock();
+        if (!w->queued)
+        {
+            unlock();
+            return false;
+        }
+        if (w->prev != nullptr)
+        {
+            w->prev->next = w->next;
+        }
+        else
+        {
+            m_head = w->next;
+        }
+        if (w->next != nullptr)
+        {
+            w->next->prev = w->prev;
+        }
+        w->queued = false;
+        m_waiters.store(m_waiters.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        unlock();
+        return true;
+    }
+
+    //通知方在锁内摘走节点后才写状态，中间只有几条指令
+    static void awaitNotified(Waiter* w)
+    {
+        while (w->state.load(std::memory_order_acquire) != Notified)
+        {
+            sched_yield();
+        }
+    }
+
+    //保护等待链表的自旋锁，只有等待者登记/撤销和有等待者时的通知会用到
+    void lock()
+    {
+        while (m_lock.exchange(true, std::memory_order_acquire))
+        {
+            while (m_lock.load(std::memory_order_relaxed))
+            {
+                sched_yield();
+            }
+        }
+    }
+
+    void unlock()
+    {
+        m_lock.store(false, std::memory_order_release);
+    }
+
+private:
+    //等待者个数，锁内修改，通知方不加锁读取
+    std::atomic<int> m_waiters;
+    //等待链表，链表头是最后登记的等待者
+    Waiter* m_head;
+    std::atomic<bool> m_lock;
+};
+
+#endif // _EVENT_COUNT_H_
@@ -0,0 +1,361 @@
+#ifndef _LOCKS_H_
+#define _LOCKS_H_
+
+#include "EventCount.h"
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <stdint.h>
+
+/**
+ * 互斥锁库：临界区只有几十纳秒时，进内核睡眠的开销比临界区本身大得多
+ *
+ * 都满足Lockable（lock/unlock/try_lock），可以直接用std::unique_lock/std::lock_guard，
+ * 也可以作为模板参数传给pool2的任务队列（TaskQueue.h的TASK_QUEUE_LOCK）：
+ *      PosixMutex      pthread_mutex_t的包装，默认选择
+ *      AdaptiveMutex   先自旋（指数退避）再futex睡眠，自旋的次数按最近的经验自适应
+ *      McsLock         MCS队列锁，每个等待者在自己的节点上自旋，严格先来先得，高竞争时缓存行不乱跳
+ *      TicketLock      排队锁，先来先得，按前面排队的人数比例退避
+ *
+ * 选择：
+ * 1、临界区短、线程数不超过核数：AdaptiveMutex，没有竞争时加解锁各一次原子操作
+ * 2、竞争激烈、要求公平：McsLock，交接锁时只写下一个等待者的缓存行
+ * 3、竞争不激烈、要求公平：TicketLock，结构最简单，两个计数器
+ * 4、线程数超过核数：McsLock和TicketLock严格按顺序交接，排在前面的线程被换出CPU时后面的都要等，
+ *    等待时间长了会让出CPU，但仍然不如AdaptiveMutex/PosixMutex，它们等不到就睡眠
+ *
+ * 都不可以重入。
+*/
+
+//忙等待时降低功耗，并把流水线资源让给同一物理核上的另一个超线程
+static inline void lockRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+//pthread_mutex_t的包装
+class PosixMutex
+{
+public:
+    PosixMutex()
+    {
+        pthread_mutex_init(&m_mutex, nullptr);
+    }
+
+    ~PosixMutex()
+    {
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    PosixMutex(const PosixMutex&) = delete;
+    PosixMutex& operator=(const PosixMutex&) = delete;
+
+    inline void lock()
+    {
+        pthread_mutex_lock(&m_mutex);
+    }
+
+    inline bool try_lock()
+    {
+        return pthread_mutex_trylock(&m_mutex) == 0;
+    }
+
+    inline void unlock()
+    {
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+private:
+    pthread_mutex_t m_mutex;
+};
+
+/**
+ * 自适应互斥锁：状态0空闲，1加锁，2加锁并且可能有线程在futex上睡眠（Drepper的三态futex锁）
+ * 1、加锁先CAS一次，失败后自旋，每次等待的pause数翻倍，锁一空出来就再CAS
+ * 2、自旋的上限是最近几次“自旋多久拿到锁”的滑动平均的两倍，临界区短时自旋就够了，
+ *    临界区长或者持有者被换出CPU时很快就去睡眠，不白白占着CPU
+ * 3、解锁只有状态为2时才进内核唤醒一个线程，没有睡眠的线程时解锁只是一次原子交换
+*/
+class AdaptiveMutex
+{
+public:
+    AdaptiveMutex() : m_state(0), m_spinLimit(MaxSpin / 4) {}
+
+    AdaptiveMutex(const AdaptiveMutex&) = delete;
+    AdaptiveMutex& operator=(const AdaptiveMutex&) = delete;
+
+    inline void lock()
+    {
+        uint32_t expected = 0;
+        if (!m_state.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+        {
+            lockSlow();
+        }
+    }
+
+    inline bool try_lock()
+    {
+        uint32_t expected = 0;
+        return m_state.compare_exchange_strong(expected, 1, std::memory_order_acquire);
+    }
+
+    inline void unlock()
+    {
+        if (m_state.exchange(0, std::memory_order_release) == 2)
+        {
+            futexWake(&m_state, 1);
+        }
+    }
+
+private:
+    //自旋上限（pause次数），超过后一定去睡眠
+    static const int MaxSpin = 4096;
+    //一次退避最多pause的次数
+    static const int MaxBackoff = 64;
+
+    void lockSlow()
+    {
+        int limit = m_spinLimit.load(std::memory_order_relaxed) * 2;
+        limit = limit < MaxSpin ? limit : MaxSpin;
+        int spun = 0;
+        int backoff = 1;
+        while (spun < limit)
+        {
+            for (int i = 0; i < backoff; i++)
+            {
+                lockRelax();
+            }
+            spun += backoff;
+            backoff = backoff < MaxBackoff ? backoff * 2 : MaxBackoff;
+            //只读不写，锁空出来才CAS，等待者不会把持有者的缓存行抢来抢去
+            uint32_t expected = 0;
+            if (m_state.load(std::memory_order_relaxed) == 0 &&
+                m_state.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+            {
+                //自旋拿到了锁，按这次的自旋量调整上限
+                int cur = m_spinLimit.load(std::memory_order_relaxed);
+                m_spinLimit.store(cur + (spun - cur) / 8, std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        //自旋没等到，上限往下调，然后睡眠；被唤醒后以状态2加锁，解锁时会唤醒下一个
+        int cur = m_spinLimit.load(std::memory_order_relaxed);
+        m_spinLimit.store(cur - cur / 8, std::memory_order_relaxed);
+        while (m_state.exchange(2, std::memory_order_acquire) != 0)
+        {
+            futexWait(&m_state, 2, nullptr);
+        }
+    }
+
+private:
+    std::atomic<uint32_t> m_state;
+    //自旋次数的滑动平均
+    std::atomic<int> m_spinLimit;
+};
+
+/**
+ * MCS队列锁：等待者排成链表，每个等待者在自己节点的标志上自旋，持有者解锁时只改下一个节点的标志
+ * 1、加锁用一次exchange把自己的节点挂到队尾，有前驱就把自己链到前驱后面，然后等前驱把锁交过来
+ * 2、解锁时没有后继就CAS把队尾清空，有后继（或者后继正在链进来）就把它的标志清零
+ * 3、节点从线程自己的空闲链表取，解锁后立即还回去，同一线程同时持有多把锁也没问题，
+ *    线程退出时释放；持有者的节点记在锁里，unlock不需要参数
+*/
+class McsLock
+{
+public:
+    McsLock() : m_tail(nullptr), m_owner(nullptr) {}
+
+    McsLock(const McsLock&) = delete;
+    McsLock& operator=(const McsLock&) = delete;
+
+    void lock()
+    {
+        Node* node = NodeCache::get();
+        node->next.store(nullptr, std::memory_order_relaxed);
+        node->locked.store(true, std::memory_order_relaxed);
+        Node* pred = m_tail.exchange(node, std::memory_order_acq_rel);
+        if (pred != nullptr)
+        {
+            pred->next.store(node, std::memory_order_release);
+            int spins = 0;
+            while (node->locked.load(std::memory_order_acquire))
+            {
+                pause(spins);
+            }
+        }
+        m_owner = node;
+    }
+
+    bool try_lock()
+    {
+        Node* node = NodeCache::get();
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node* expected = nullptr;
+        if (!m_tail.compare_exchange_strong(expected, node, std::memory_order_acq_rel))
+        {
+            NodeCache::put(node);
+            return false;
+        }
+        m_owner = node;
+        return true;
+    }
+
+    void unlock()
+    {
+        Node* node = m_owner;
+        Node* next = node->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+        {
+            Node* expected = node;
+            if (m_tail.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel))
+            {
+                NodeCache::put(node);
+                return;
+            }
+            //后继已经挂到队尾，等它把自己链到我后面
+            int spins = 0;
+            while ((next = node->next.load(std::memory_order_acquire)) == nullptr)
+            {
+                pause(spins);
+            }
+        }
+        next->locked.store(false, std::memory_order_release);
+        NodeCache::put(node);
+    }
+
+private:
+    struct alignas(64) Node
+    {
+        std::atomic<Node*> next;
+        std::atomic<bool> locked;
+        Node* free;
+    };
+
+    //每个线程的空闲节点链表
+    struct NodeCache
+    {
+        Node* head = nullptr;
+
+        ~NodeCache()
+        {
+            while (head != nullptr)
+            {
+                Node* next = head->free;
+                delete head;
+                head = next;
+            }
+        }
+
+        static NodeCache& local()
+        {
+            static thread_local NodeCache cache;
+            return cache;
+        }
+
+        static Node* get()
+        {
+            NodeCache& cache = local();
+            Node* node = cache.head;
+            if (node == nullptr)
+            {
+                return new Node;
+            }
+            cache.head = node->free;
+            return node;
+        }
+
+        static void put(Node* node)
+        {
+            NodeCache& cache = local();
+            node->free = cache.head;
+            cache.head = node;
+        }
+    };
+
+    //前面的线程迟迟不交出锁，多半是被换出了CPU，让出CPU给它
+    static inline void pause(int& spins)
+    {
+        if (++spins < 1024)
+        {
+            lockRelax();
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+
+private:
+    std::atomic<Node*> m_tail;
+    //持有者的节点，只有持有者读写
+    Node* m_owner;
+};
+
+/**
+ * 排队锁：加锁时领一个号，等叫到自己的号；解锁时叫下一个号
+ * 等待时按前面还有几个人退避，离得远的少读几次共享的缓存行
+*/
+class TicketLock
+{
+public:
+    TicketLock() : m_next(0), m_serving(0) {}
+
+    TicketLock(const TicketLock&) = delete;
+    TicketLock& operator=(const TicketLock&) = delete;
+
+    void lock()
+    {
+        uint32_t ticket = m_next.fetch_add(1, std::memory_order_relaxed);
+        uint32_t spins = 0;
+        while (true)
+        {
+            uint32_t serving = m_serving.load(std::memory_order_acquire);
+            if (serving == ticket)
+            {
+                return;
+            }
+            //忙等的pause总数超过YieldSpin后每次都让出CPU，轮到的线程可能正等着被调度
+            if (spins < YieldSpin)
+            {
+                uint32_t backoff = (ticket - serving) * BackoffBase;
+                for (uint32_t i = backoff; i > 0; i--)
+                {
+                    lockRelax();
+                }
+                spins += backoff;
+            }
+            else
+            {
+                sched_yield();
+            }
+        }
+    }
+
+    bool try_lock()
+    {
+        uint32_t serving = m_serving.load(std::memory_order_acquire);
+        uint32_t expected = serving;
+        return m_next.compare_exchange_strong(expected, serving + 1, std::memory_order_acquire);
+    }
+
+    void unlock()
+    {
+        //只有持有者修改m_serving
+        m_serving.store(m_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    //前面每多一个人，多等几次pause
+    static const uint32_t BackoffBase = 8;
+    static const uint32_t YieldSpin = 1024;
+
+    std::atomic<uint32_t> m_next;
+    std::atomic<uint32_t> m_serving;
+};
+
+#endif // _LOCKS_H_
@@ -0,0 +1,498 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <exception>
+#include <iterator>
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include <stddef.h>
+
+/**
+ * 建立在线程池之上的并行算法：parallelFor、parallelReduce、parallelTransformReduce、
+ * parallelInclusiveScan、parallelExclusiveScan、parallelSort
+ *
+ * 同时支持pool1的threadpool_t和pool2的ThreadPool，直接把线程池对象传进来：
+ *     parallelFor(pool, 0, n, [&](size_t i) { ... });
+ *
+ * 1、切分：区间递归二分，直到每块不超过粒度grain。grain为0时自动选择，切成512~1024块，
+ *    既能在各线程之间均衡，每块的调度开销（一次原子加）又远小于块本身的工作量
+ * 2、执行：只往线程池投递少量帮手任务，帮手和调用线程一起用原子计数器领取块，
+ *    调用线程自己也干活，线程池很忙或者在工作线程里嵌套调用时也不会死锁，最坏情况下由调用线程全部做完
+ * 3、确定性：块的划分只取决于元素个数和grain，和线程数、调度顺序无关，
+ *    每块从左到右归约，块之间按固定的二叉树归约，浮点数求和每次运行结果都一样
+ * 4、异常：任意一块抛出异常时，其余块照常完成，调用线程重新抛出第一个异常
+ *
+ * 所有算法都阻塞到结果完成才返回。
+*/
+
+//自动粒度时最少切成的块数，实际块数在[ParallelAutoLeaves, 2*ParallelAutoLeaves)之间
+static const size_t ParallelAutoLeaves = 512;
+
+//一次并行执行：count个互相独立的块，帮手任务和调用线程一起领取
+class ParallelJob
+{
+public:
+    ParallelJob(size_t count, void (*call)(void*, size_t), void* ctx) :
+    m_count(count),
+    m_call(call),
+    m_ctx(ctx),
+    m_next(0),
+    m_done(0),
+    m_waiting(false)
+    {
+        pthread_mutex_init(&m_mutex, nullptr);
+        pthread_cond_init(&m_cond, nullptr);
+    }
+
+    ~ParallelJob()
+    {
+        pthread_mutex_destroy(&m_mutex);
+        pthread_cond_destroy(&m_cond);
+    }
+
+    //领取并执行块，直到全部领完；领不到块的帮手不会访问m_ctx，调用线程返回后它可能已经失效
+    void help()
+    {
+        size_t i;
+        while ((i = m_next.fetch_add(1, std::memory_order_relaxed)) < m_count)
+        {
+            try
+            {
+                m_call(m_ctx, i);
+            }
+            catch (...)
+            {
+                pthread_mutex_lock(&m_mutex);
+                if (!m_error)
+                {
+                    m_error = std::current_exception();
+                }
+                pthread_mutex_unlock(&m_mutex);
+            }
+            if (m_done.fetch_add(1, std::memory_order_acq_rel) + 1 == m_count)
+            {
+                pthread_mutex_lock(&m_mutex);
+                if (m_waiting)
+                {
+                    pthread_cond_signal(&m_cond);
+                }
+                pthread_mutex_unlock(&m_mutex);
+            }
+        }
+    }
+
+    //调用线程领完块后等待其他线程手里的块，先短暂让出CPU，块比较大时再睡眠
+    void wait()
+    {
+        for (int i = 0; i < 64 && m_done.load(std::memory_order_acquire) < m_count; i++)
+        {
+            sched_yield();
+        }
+        if (m_done.load(std::memory_order_acquire) < m_count)
+        {
+            pthread_mutex_lock(&m_mutex);
+            m_waiting = true;
+            while (m_done.load(std::memory_order_acquire) < m_count)
+            {
+                pthread_cond_wait(&m_cond, &m_mutex);
+            }
+            pthread_mutex_unlock(&m_mutex);
+        }
+        if (m_error)
+        {
+            std::rethrow_exception(m_error);
+        }
+    }
+
+private:
+    const size_t m_count;
+    void (*m_call)(void*, size_t);
+    void* m_ctx;
+    //下一个待领取的块
+    std::atomic<size_t> m_next;
+    //已完成的块
+    std::atomic<size_t> m_done;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+    bool m_waiting;
+    std::exception_ptr m_error;
+};
+
+//pool1的任务入口，参数是堆上的shared_ptr
+static inline void* parallelTrampoline(void* arg)
+{
+    std::shared_ptr<ParallelJob>* job = (std::shared_ptr<ParallelJob>*)arg;
+    (*job)->help();
+    delete job;
+    return nullptr;
+}
+
+//帮手任务
+struct ParallelHelper
+{
+    std::shared_ptr<ParallelJob> job;
+
+    void operator()()
+    {
+        job->help();
+    }
+};
+
+//投递一个帮手任务：pool2的ThreadPool直接提交可调用对象
+template <typename Pool>
+inline auto parallelPost(Pool& pool, const std::shared_ptr<ParallelJob>& job, int)
+    -> decltype(pool.addTask(ParallelHelper{job}), void())
+{
+    pool.addTask(ParallelHelper{job});
+}
+
+//pool1的threadpool_t通过回调函数+参数提交，threadpool_add_task由实参类型查找
+template <typename Pool>
+inline auto parallelPost(Pool& pool, const std::shared_ptr<ParallelJob>& job, long)
+    -> decltype(threadpool_add_task(&pool, parallelTrampoline, nullptr), void())
+{
+    threadpool_add_task(&pool, parallelTrampoline, new std::shared_ptr<ParallelJob>(job));
+}
+
+//并行执行fn(0)...fn(count-1)，调用线程参与执行，全部完成后返回
+template <typename Pool, typename F>
+void parallelInvoke(Pool& pool, size_t count, F&& fn)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    if (count == 1)
+    {
+        fn((size_t)0);
+        return;
+    }
+
+    typedef typename std::remove_reference<F>::type Fn;
+    auto call = [](void* ctx, size_t i) { (*(Fn*)ctx)(i); };
+    std::shared_ptr<ParallelJob> job = std::make_shared<ParallelJob>(count, call, (void*)&fn);
+
+    //帮手数不超过CPU数，调用线程自己算一个
+    size_t helpers = std::thread::hardware_concurrency();
+    helpers = helpers > 1 ? helpers - 1 : 1;
+    helpers = std::min(helpers, count - 1);
+    for (size_t i = 0; i < helpers; i++)
+    {
+        parallelPost(pool, job, 0);
+    }
+    job->help();
+    job->wait();
+}
+
+//把[0, n)递归二分到每块不超过grain，bounds依次记录每块的右端点
+static inline void parallelSplit(size_t lo, size_t hi, size_t grain, std::vector<size_t>& bounds)
+{
+    if (hi - lo <= grain)
+    {
+        bounds.push_back(hi);
+        return;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    parallelSplit(lo, mid, grain, bounds);
+    parallelSplit(mid, hi, grain, bounds);
+}
+
+//块的划分，第i块是[bounds[i-1], bounds[i])，bounds[-1]为0
+static inline std::vector<size_t> parallelPartition(size_t n, size_t grain)
+{
+    if (grain == 0)
+    {
+        grain = (n + ParallelAutoLeaves - 1) / ParallelAutoLeaves;
+    }
+    grain = std::max<size_t>(grain, 1);
+    std::vector<size_t> bounds;
+    bounds.reserve(2 * (n / grain + 1));
+    parallelSplit(0, n, grain, bounds);
+    return bounds;
+}
+
+//按固定的二叉树归约各块的结果，和执行顺序无关
+template <typename T, typename Op>
+T parallelCombine(std::vector<T>& partial, Op& op)
+{
+    for (size_t step = 1; step < partial.size(); step *= 2)
+    {
+        for (size_t i = 0; i + step < partial.size(); i += 2 * step)
+        {
+            partial[i] = op(std::move(partial[i]), std::move(partial[i + step]));
+        }
+    }
+    return std::move(partial[0]);
+}
+
+//并行执行body(i)，i属于[begin, end)
+template <typename Pool, typename Index, typename Body>
+void parallelFor(Pool& pool, Index begin, Index end, Body body, size_t grain = 0)
+{
+    if (!(begin < end))
+    {
+        return;
+    }
+    size_t n = (size_t)(end - begin);
+    std::vector<size_t> bounds = parallelPartition(n, grain);
+    parallelInvoke(pool, bounds.size(), [&](size_t leaf) {
+        Index lo = begin + (Index)(leaf == 0 ? 0 : bounds[leaf - 1]);
+        Index hi = begin + (Index)bounds[leaf];
+        for (Index i = lo; i < hi; ++i)
+        {
+            body(i);
+        }
+    });
+}
+
+//并行归约：init op transform(first[0]) op transform(first[1]) ...，op需满足结合律
+template <typename Pool, typename It, typename T, typename Op, typename Transform>
+T parallelTransformReduce(Pool& pool, It first, It last, T init, Op op, Transform transform, size_t grain = 0)
+{
+    size_t n = (size_t)std::distance(first, last);
+    if (n == 0)
+    {
+        return init;
+    }
+    std::vector<size_t> bounds = parallelPartition(n, grain);
+    std::vector<T> partial(bounds.size(), init);
+    parallelInvoke(pool, bounds.size(), [&](size_t leaf) {
+        size_t lo = leaf == 0 ? 0 : bounds[leaf - 1];
+        It it = first + lo;
+        //每块从第一个元素开始归约，不需要op的单位元
+        T acc = transform(*it);
+        for (size_t i = lo + 1; i < bounds[leaf]; i++)
+        {
+            ++it;
+            acc = op(std::move(acc), transform(*it));
+        }
+        partial[leaf] = std::move(acc);
+    });
+    return op(std::move(init), parallelCombine(partial, op));
+}
+
+//并行归约：init op first[0] op first[1] ...
+template <typename Pool, typename It, typename T, typename Op>
+T parallelReduce(Pool& pool, It first, It last, T init, Op op, size_t grain = 0)
+{
+    typedef typename std::iterator_traits<It>::reference Ref;
+    return parallelTransformReduce(pool, first, last, std::move(init), op, [](Ref v) -> Ref { return v; }, grain);
+}
+
+//并行扫描的实现：第一遍各块求和，调用线程求块的前缀，第二遍各块带着前缀写出结果
+template <typename Pool, typename It, typename Out, typename T, typename Op>
+void parallelScanImpl(Pool& pool, It first, It last, Out out, const T* init, bool inclusive, Op op, size_t grain)
+{
+    size_t n = (size_t)std::distance(first, last);
+    if (n == 0)
+    {
+        return;
+    }
+    std::vector<size_t> bounds = parallelPartition(n, grain);
+    size_t leaves = bounds.size();
+
+    std::vector<T> sums;
+    sums.reserve(leaves);
+    for (size_t i = 0; i < leaves; i++)
+    {
+        sums.push_back(T(first[i == 0 ? 0 : bounds[i - 1]]));
+    }
+    parallelInvoke(pool, leaves, [&](size_t leaf) {
+        size_t lo = leaf == 0 ? 0 : bounds[leaf - 1];
+        T acc = std::move(sums[leaf]);
+        for (size_t i = lo + 1; i < bounds[leaf]; i++)
+        {
+            acc = op(std::move(acc), first[i]);
+        }
+        sums[leaf] = std::move(acc);
+    });
+
+    //sums[i]变成第i块之前所有元素的和，第0块没有前缀时用flags标记
+    std::vector<char> hasPrefix(leaves, 0);
+    if (init != nullptr)
+    {
+        T carry = *init;
+        for (size_t i = 0; i < leaves; i++)
+        {
+            T next = op(carry, sums[i]);
+            sums[i] = std::move(carry);
+            carry = std::move(next);
+            hasPrefix[i] = 1;
+        }
+    }
+    else
+    {
+        for (size_t i = 1; i < leaves; i++)
+        {
+            sums[i] = op(sums[i - 1], sums[i]);
+        }
+        for (size_t i = leaves - 1; i > 0; i--)
+        {
+            sums[i] = std::move(sums[i - 1]);
+            hasPrefix[i] = 1;
+        }
+    }
+
+    parallelInvoke(pool, leaves, [&](size_t leaf) {
+        size_t lo = leaf == 0 ? 0 : bounds[leaf - 1];
+        size_t i = lo;
+        if (!hasPrefix[leaf])
+        {
+            //没有前缀的块（包含扫描的第0块），第一个元素原样输出
+            T acc = T(first[i]);
+            out[i] = acc;
+            for (i++; i < bounds[leaf]; i++)
+            {
+                acc = op(std::move(acc), first[i]);
+                out[i] = acc;
+            }
+            return;
+        }
+        T acc = sums[leaf];
+        for (; i < bounds[leaf]; i++)
+        {
+            if (inclusive)
+            {
+                acc = op(std::move(acc), first[i]);
+                out[i] = acc;
+            }
+            else
+            {
+                //先读出输入再写输出，out和first可以是同一个数组
+                T value = T(first[i]);
+                out[i] = acc;
+                acc = op(std::move(acc), std::move(value));
+            }
+        }
+    });
+}
+
+//包含扫描：out[i] = first[0] op ... op first[i]，out可以等于first
+template <typename Pool, typename It, typename Out, typename Op>
+void parallelInclusiveScan(Pool& pool, It first, It last, Out out, Op op, size_t grain = 0)
+{
+    typedef typename std::iterator_traits<It>::value_type T;
+    parallelScanImpl(pool, first, last, out, (const T*)nullptr, true, op, grain);
+}
+
+//不包含扫描：out[i] = init op first[0] op ... op first[i-1]，out可以等于first
+template <typename Pool, typename It, typename Out, typename T, typename Op>
+void parallelExclusiveScan(Pool& pool, It first, It last, Out out, T init, Op op, size_t grain = 0)
+{
+    parallelScanImpl(pool, first, last, out, &init, false, op, grain);
+}
+
+//把有序的a、b合并到out的第part段（共parts段），每段用二分查找定位，可以互相独立地并行
+template <typename T, typename Compare>
+void parallelMergePart(const T* a, size_t na, const T* b, size_t nb, T* out, size_t part, size_t parts, Compare& comp)
+{
+    //在较长的一侧均匀取分割点，另一侧二分找对应位置，a中相等的元素排在b前面
+    size_t ai[2];
+    size_t bi[2];
+    for (int k = 0; k < 2; k++)
+    {
+        size_t p = part + k;
+        if (p == 0)
+        {
+            ai[k] = 0;
+            bi[k] = 0;
+        }
+        else if (p == parts)
+        {
+            ai[k] = na;
+            bi[k] = nb;
+        }
+        else if (na >= nb)
+        {
+            ai[k] = na * p / parts;
+            bi[k] = std::lower_bound(b, b + nb, a[ai[k]], comp) - b;
+        }
+        else
+        {
+            bi[k] = nb * p / parts;
+            ai[k] = std::upper_bound(a, a + na, b[bi[k]], comp) - a;
+        }
+    }
+    std::merge(std::make_move_iterator(a + ai[0]), std::make_move_iterator(a + ai[1]),
+               std::make_move_iterator(b + bi[0]), std::make_move_iterator(b + bi[1]),
+               out + ai[0] + bi[0], comp);
+}
+
+//并行排序：各块分别排序，再逐轮两两归并，每轮的每次归并再按二分查找切成多段并行，
+//最后几轮只剩少数几个很长的有序段时也能用上所有线程；T需要可默认构造，额外使用n个元素的缓冲区
+template <typename Pool, typename It, typename Compare>
+void parallelSort(Pool& pool, It first, It last, Compare comp, size_t grain = 0)
+{
+    typedef typename std::iterator_traits<It>::value_type T;
+    size_t n = (size_t)std::distance(first, last);
+    std::vector<size_t> bounds = parallelPartition(n, grain);
+    size_t leaves = bounds.size();
+    if (leaves <= 1)
+    {
+        std::sort(first, last, comp);
+        return;
+    }
+
+    std::vector<T> buffer(n);
+    parallelInvoke(pool, leaves, [&](size_t leaf) {
+        size_t lo = leaf == 0 ? 0 : bounds[leaf - 1];
+        std::move(first + lo, first + bounds[leaf], buffer.begin() + lo);
+        std::sort(buffer.begin() + lo, buffer.begin() + bounds[leaf], comp);
+    });
+
+    //runs记录每个有序段的起点，最后一个元素是n
+    std::vector<size_t> runs(1, 0);
+    runs.insert(runs.end(), bounds.begin(), bounds.end());
+    std::vector<T> scratch(n);
+    T* src = buffer.data();
+    T* dst = scratch.data();
+    while (runs.size() > 2)
+    {
+        size_t pairs = (runs.size() - 1) / 2;
+        bool odd = (runs.size() - 1) % 2 != 0;
+        //每轮总段数保持在块数附近
+        size_t parts = std::max<size_t>(1, leaves / std::max<size_t>(pairs, 1));
+        parallelInvoke(pool, pairs * parts + (odd ? 1 : 0), [&](size_t job) {
+            size_t pair = job / parts;
+            if (pair == pairs)
+            {
+                //落单的最后一段直接搬过去
+                size_t lo = runs[runs.size() - 2];
+                std::move(src + lo, src + n, dst + lo);
+                return;
+            }
+            size_t lo = runs[2 * pair];
+            size_t mid = runs[2 * pair + 1];
+            size_t hi = runs[2 * pair + 2];
+            parallelMergePart(src + lo, mid - lo, src + mid, hi - mid, dst + lo, job % parts, parts, comp);
+        });
+
+        std::vector<size_t> merged;
+        for (size_t i = 0; i < runs.size(); i += 2)
+        {
+            merged.push_back(runs[i]);
+        }
+        if (merged.back() != n)
+        {
+            merged.push_back(n);
+        }
+        runs.swap(merged);
+        std::swap(src, dst);
+    }
+
+    std::move(src, src + n, first);
+}
+
+template <typename Pool, typename It>
+void parallelSort(Pool& pool, It first, It last)
+{
+    parallelSort(pool, first, last, std::less<typename std::iterator_traits<It>::value_type>());
+}
+
+#endif // _PARALLEL_H_
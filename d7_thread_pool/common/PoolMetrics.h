@@ -0,0 +1,355 @@
+#ifndef _POOL_METRICS_H_
+#define _POOL_METRICS_H_
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * 线程池性能指标
+ *
+ * 1、每个工作线程一个独立的指标槽位，按缓存行对齐，只有该线程自己写，
+ *    计数器用 load + store 更新，不需要带lock前缀的原子指令
+ * 2、每个槽位用一个序号做顺序锁：写之前序号变奇数，写完变偶数，
+ *    读者看到序号为奇数或前后不一致就重试，保证读到的是某一时刻一致的快照
+ * 3、直方图采用HDR风格的对数分桶：每个2的幂区间再线性分成16个子桶，相对误差不超过1/16，
+ *    记录一次只是一个桶计数加一
+ *
+ * 入队到开始执行的等待时间、执行时间两个直方图需要取时钟，默认关闭，通过setTiming打开。
+*/
+
+//单调时钟，纳秒
+static inline uint64_t metricsNowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//直方图快照，可以合并多个线程的数据
+struct HistogramSnapshot
+{
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sumNs = 0;
+    uint64_t maxNs = 0;
+
+    void merge(const HistogramSnapshot& other);
+    //百分位数，p取值0~100，返回对应桶的上界（纳秒）
+    uint64_t percentile(double p) const;
+    double meanNs() const { return total ? (double)sumNs / total : 0; }
+};
+
+//单写者的对数分桶直方图
+class LatencyHistogram
+{
+public:
+    static const int SubBucketBits = 4;
+    static const int SubBuckets = 1 << SubBucketBits;
+    static const int NumBuckets = (64 - SubBucketBits + 1) * SubBuckets;
+
+    LatencyHistogram()
+    {
+        for (int i = 0; i < NumBuckets; i++)
+        {
+            m_counts[i].store(0, std::memory_order_relaxed);
+        }
+        m_sum.store(0, std::memory_order_relaxed);
+        m_max.store(0, std::memory_order_relaxed);
+    }
+
+    //值对应的桶下标：小于16直接对应，否则按最高位所在区间 + 次高4位确定子桶
+    static inline int bucketIndex(uint64_t v)
+    {
+        if (v < (uint64_t)SubBuckets)
+        {
+            return (int)v;
+        }
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - SubBucketBits;
+        int sub = (int)((v >> shift) & (SubBuckets - 1));
+        return (shift + 1) * SubBuckets + sub;
+    }
+
+    //桶能表示的最大值
+    static inline uint64_t bucketUpperBound(int index)
+    {
+        if (index < SubBuckets)
+        {
+            return index;
+        }
+        int shift = index / SubBuckets - 1;
+        uint64_t sub = index % SubBuckets;
+        return ((SubBuckets + sub + 1) << shift) - 1;
+    }
+
+    //只能由拥有者线程调用
+    inline void record(uint64_t ns)
+    {
+        std::atomic<uint64_t>& c = m_counts[bucketIndex(ns)];
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        m_sum.store(m_sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+        if (ns > m_max.load(std::memory_order_relaxed))
+        {
+            m_max.store(ns, std::memory_order_relaxed);
+        }
+    }
+
+    void copyTo(HistogramSnapshot& out) const
+    {
+        out.counts.assign(NumBuckets, 0);
+        out.total = 0;
+        for (int i = 0; i < NumBuckets; i++)
+        {
+            out.counts[i] = m_counts[i].load(std::memory_order_relaxed);
+            out.total += out.counts[i];
+        }
+        out.sumNs = m_sum.load(std::memory_order_relaxed);
+        out.maxNs = m_max.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> m_counts[NumBuckets];
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+};
+
+inline void HistogramSnapshot::merge(const HistogramSnapshot& other)
+{
+    if (counts.size() < other.counts.size())
+    {
+        counts.resize(other.counts.size(), 0);
+    }
+    for (size_t i = 0; i < other.counts.size(); i++)
+    {
+        counts[i] += other.counts[i];
+    }
+    total += other.total;
+    sumNs += other.sumNs;
+    if (other.maxNs > maxNs)
+    {
+        maxNs = other.maxNs;
+    }
+}
+
+inline uint64_t HistogramSnapshot::percentile(double p) const
+{
+    if (total == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100.0 * total);
+    if (rank >= total)
+    {
+        rank = total - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++)
+    {
+        seen += counts[i];
+        if (seen > rank)
+        {
+            uint64_t upper = LatencyHistogram::bucketUpperBound((int)i);
+            return upper < maxNs ? upper : maxNs;
+        }
+    }
+    return maxNs;
+}
+
+//一个工作线程的计数器快照
+struct WorkerMetricsSnapshot
+{
+    uint64_t tasks = 0;     //执行的任务数
+    uint64_t steals = 0;    //从其他线程窃取的任务数
+    uint64_t parks = 0;     //阻塞睡眠次数
+    uint64_t unparks = 0;   //被唤醒次数
+    uint64_t busyNs = 0;    //执行任务的总时间，打开计时后才统计
+};
+
+//一个工作线程的指标槽位，独占缓存行
+struct alignas(64) WorkerMetrics
+{
+    std::atomic<uint32_t> seq;
+    //槽位是否被某个线程占用
+    std::atomic<bool> inUse;
+    std::atomic<uint64_t> tasks;
+    std::atomic<uint64_t> steals;
+    std::atomic<uint64_t> parks;
+    std::atomic<uint64_t> unparks;
+    std::atomic<uint64_t> busyNs;
+    LatencyHistogram queueWait;
+    LatencyHistogram runTime;
+
+    WorkerMetrics() : seq(0), inUse(false), tasks(0), steals(0), parks(0), unparks(0), busyNs(0) {}
+
+    //以下函数只能由拥有该槽位的线程调用
+    inline void beginUpdate()
+    {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    inline void endUpdate()
+    {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    static inline void bump(std::atomic<uint64_t>& c, uint64_t n = 1)
+    {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    //执行完一个任务，enqueueNs/startNs/endNs为0表示没有计时
+    inline void onTask(uint64_t enqueueNs, uint64_t startNs, uint64_t endNs)
+    {
+        beginUpdate();
+        bump(tasks);
+        if (startNs != 0)
+        {
+            bump(busyNs, endNs - startNs);
+            runTime.record(endNs - startNs);
+            if (enqueueNs != 0 && startNs >= enqueueNs)
+            {
+                queueWait.record(startNs - enqueueNs);
+            }
+        }
+        endUpdate();
+    }
+
+    inline void onSteal()
+    {
+        beginUpdate();
+        bump(steals);
+        endUpdate();
+    }
+
+    inline void onPark()
+    {
+        beginUpdate();
+        bump(parks);
+        endUpdate();
+    }
+
+    inline void onUnpark()
+    {
+        beginUpdate();
+        bump(unparks);
+        endUpdate();
+    }
+};
+
+//整个线程池的指标快照
+struct PoolMetricsSnapshot
+{
+    std::vector<WorkerMetricsSnapshot> workers;
+    WorkerMetricsSnapshot total;
+    HistogramSnapshot queueWait;
+    HistogramSnapshot runTime;
+};
+
+class PoolMetrics
+{
+public:
+    explicit PoolMetrics(int workers) :
+    m_num(workers),
+    m_timing(false)
+    {
+        m_workers = new WorkerMetrics[workers];
+    }
+
+    ~PoolMetrics()
+    {
+        delete[] m_workers;
+    }
+
+    PoolMetrics(const PoolMetrics&) = delete;
+    PoolMetrics& operator=(const PoolMetrics&) = delete;
+
+    inline WorkerMetrics& worker(int index)
+    {
+        return m_workers[index];
+    }
+
+    //占用一个空闲槽位，用于动态创建的线程，没有空闲槽位返回-1
+    int acquireSlot()
+    {
+        for (int i = 0; i < m_num; i++)
+        {
+            bool expected = false;
+            if (m_workers[i].inUse.compare_exchange_strong(expected, true))
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    inline void releaseSlot(int index)
+    {
+        m_workers[index].inUse.store(false);
+    }
+
+    //是否统计等待时间和执行时间
+    inline void setTiming(bool enable)
+    {
+        m_timing.store(enable, std::memory_order_relaxed);
+    }
+
+    inline bool timing() const
+    {
+        return m_timing.load(std::memory_order_relaxed);
+    }
+
+    //打开计时时返回当前时间，否则返回0
+    inline uint64_t stamp() const
+    {
+        return timing() ? metricsNowNs() : 0;
+    }
+
+    //读取所有槽位，每个槽位内部是一致的
+    PoolMetricsSnapshot snapshot() const
+    {
+        PoolMetricsSnapshot out;
+        out.workers.resize(m_num);
+        for (int i = 0; i < m_num; i++)
+        {
+            const WorkerMetrics& w = m_workers[i];
+            WorkerMetricsSnapshot s;
+            HistogramSnapshot wait;
+            HistogramSnapshot run;
+            uint32_t before;
+            uint32_t after;
+            do
+            {
+                before = w.seq.load(std::memory_order_acquire);
+                s.tasks = w.tasks.load(std::memory_order_relaxed);
+                s.steals = w.steals.load(std::memory_order_relaxed);
+                s.parks = w.parks.load(std::memory_order_relaxed);
+                s.unparks = w.unparks.load(std::memory_order_relaxed);
+                s.busyNs = w.busyNs.load(std::memory_order_relaxed);
+                w.queueWait.copyTo(wait);
+                w.runTime.copyTo(run);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                after = w.seq.load(std::memory_order_relaxed);
+            } while ((before & 1) != 0 || before != after);
+
+            out.workers[i] = s;
+            out.total.tasks += s.tasks;
+            out.total.steals += s.steals;
+            out.total.parks += s.parks;
+            out.total.unparks += s.unparks;
+            out.total.busyNs += s.busyNs;
+            out.queueWait.merge(wait);
+            out.runTime.merge(run);
+        }
+        return out;
+    }
+
+private:
+    WorkerMetrics* m_workers;
+    int m_num;
+    std::atomic<bool> m_timing;
+};
+
+#endif // _POOL_METRICS_H_
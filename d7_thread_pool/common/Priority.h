@@ -0,0 +1,87 @@
+#ifndef _PRIORITY_H_
+#define _PRIORITY_H_
+
+#include <atomic>
+#include <stdint.h>
+
+//任务优先级，数值越小优先级越高
+enum TaskPriority
+{
+    PriorityHigh = 0,           //延迟敏感的请求
+    PriorityNormal = 1,
+    PriorityLow = 2,
+    PriorityBackground = 3,     //批量后台任务
+    PriorityLevels = 4
+};
+
+//把任意整数限制到合法的优先级
+static inline int clampPriority(int priority)
+{
+    return priority < PriorityHigh ? PriorityHigh : (priority >= PriorityLevels ? PriorityLevels - 1 : priority);
+}
+
+/**
+ * 多级优先级的出队选择
+ *
+ * 每个优先级一个队列，用一个位图记录哪些优先级非空，取最高的非空优先级只要一次ctz。
+ * 单纯按优先级出队，低优先级在高优先级持续繁忙时会饿死，所以做了老化：
+ * 非空的低优先级每被跳过一次计数加一，跳过AgingLimit次后下一次出队先服务它。
+ * 低优先级最多占用约1/AgingLimit的出队次数，高优先级的排队时间和低优先级积压多少无关。
+ *
+ * 计数器用relaxed原子变量，加锁队列在锁内调用，无锁队列并发调用时只是近似的老化。
+*/
+class PriorityPicker
+{
+public:
+    static const uint32_t AgingLimit = 16;
+
+    PriorityPicker()
+    {
+        for (int i = 0; i < PriorityLevels; i++)
+        {
+            m_skipped[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    //最高的非空优先级，位图为空时返回PriorityLevels
+    static inline int top(uint32_t bitmap)
+    {
+        return bitmap == 0 ? PriorityLevels : __builtin_ctz(bitmap);
+    }
+
+    //选出本次出队的优先级，bitmap不能为0
+    int pick(uint32_t bitmap)
+    {
+        int first = __builtin_ctz(bitmap);
+        int chosen = first;
+        //比最高优先级低的非空优先级，最多PriorityLevels-1个
+        uint32_t lower = bitmap & (bitmap - 1);
+        for (uint32_t m = lower; m != 0; m &= m - 1)
+        {
+            int level = __builtin_ctz(m);
+            if (m_skipped[level].load(std::memory_order_relaxed) >= AgingLimit)
+            {
+                chosen = level;
+                break;
+            }
+        }
+
+        //只有一个优先级非空时什么都不写，避免无锁队列的消费者互相争抢缓存行
+        if (m_skipped[chosen].load(std::memory_order_relaxed) != 0)
+        {
+            m_skipped[chosen].store(0, std::memory_order_relaxed);
+        }
+        for (uint32_t m = lower & ~(1u << chosen); m != 0; m &= m - 1)
+        {
+            std::atomic<uint32_t>& s = m_skipped[__builtin_ctz(m)];
+            s.store(s.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+        return chosen;
+    }
+
+private:
+    //每个优先级连续被跳过的次数
+    std::atomic<uint32_t> m_skipped[PriorityLevels];
+};
+
+#endif // _PRIORITY_H_
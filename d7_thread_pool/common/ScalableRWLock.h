@@ -0,0 +1,280 @@
+#ifndef _SCALABLE_RWLOCK_H_
+#define _SCALABLE_RWLOCK_H_
+
+#include "EventCount.h"
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * 读多写少的读写锁：读锁只写自己的缓存行，读线程再多也不会在一个计数上争抢
+ *
+ * pthread_rwlock_rdlock每次都要对锁里的读者计数做原子读改写，所有读线程争抢同一个缓存行，
+ * 核越多读吞吐反而越低。这里在pthread_rwlock_t外面加一层读者槽位（BRAVO的做法）：
+ * 1、每个线程第一次加读锁时分到一个槽位，槽位各占一个缓存行；读偏向打开时，读锁只是把自己的
+ *    槽位从0改成线程编号，再确认读偏向还开着，解锁时把槽位改回0，不碰pthread_rwlock_t
+ * 2、写锁先加pthread_rwlock_t的写锁，再关闭读偏向，逐个等待槽位清空；之后新来的读者走
+ *    pthread_rwlock_t的读锁，被写锁挡住。底层锁被占着要排队时提前关闭读偏向，排队期间新来的
+ *    读者也排到写者后面，不会一直进出槽位、和还持有底层读锁的读者抢CPU
+ * 3、撤销读偏向要扫描所有槽位，写得频繁时不划算：撤销之后的一段时间（撤销耗时的InhibitFactor倍）
+ *    不再打开读偏向，读写都直接用pthread_rwlock_t，写锁的代价有上界
+ * 4、写优先（默认）：底层锁使用PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP，有写者等待时
+ *    新的读者排在它后面，槽位上的读者在写者撤销读偏向后也只能走底层锁，写锁的等待时间有上界；
+ *    关闭写优先时底层锁是读优先，读者一直不断时写者可能饿死
+ * 5、超额订阅：线程数超过槽位数时多个线程共用一个槽位，槽位被占用的读者直接走底层锁，
+ *    结果仍然正确，只是这部分读者退化成pthread_rwlock_t；写者等待槽位清空时先短暂忙等，
+ *    读者迟迟不退出（比如被换出CPU）就在槽位上标记等待，然后futex睡眠，读者清空槽位时看到标记
+ *    才唤醒它，写者不会拿着底层写锁和读者抢同一个核
+ *
+ * 满足std::shared_lock和std::unique_lock的要求（lock_shared/unlock_shared/lock/unlock），
+ * 读锁和写锁都不可以重入（写优先时重入读锁会和等待的写者死锁，和pthread_rwlock_t一样）。
+ * 每个锁占槽位数*64字节，适合少量长期存在的读多写少的数据。
+*/
+class ScalableRWLock
+{
+public:
+    //slots为0时按CPU数的2倍取槽位数，向上取整为2的幂
+    explicit ScalableRWLock(bool writerPreference = true, size_t slots = 0) :
+    m_readBias(true),
+    m_inhibitUntil(0)
+    {
+        if (slots == 0)
+        {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            slots = cpus > 0 ? (size_t)cpus * 2 : 64;
+        }
+        m_slotNum = 1;
+        while (m_slotNum < slots)
+        {
+            m_slotNum <<= 1;
+        }
+        m_slots = new Slot[m_slotNum];
+        for (size_t i = 0; i < m_slotNum; i++)
+        {
+            m_slots[i].owner.store(0, std::memory_order_relaxed);
+        }
+
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        if (writerPreference)
+        {
+            pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        }
+        pthread_rwlock_init(&m_lock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+
+    ~ScalableRWLock()
+    {
+        pthread_rwlock_destroy(&m_lock);
+        delete[] m_slots;
+    }
+
+    ScalableRWLock(const ScalableRWLock&) = delete;
+    ScalableRWLock& operator=(const ScalableRWLock&) = delete;
+
+    //加读锁
+    void lock_shared()
+    {
+        if (tryFastShared())
+        {
+            return;
+        }
+        pthread_rwlock_rdlock(&m_lock);
+        restoreBias();
+    }
+
+    bool try_lock_shared()
+    {
+        if (tryFastShared())
+        {
+            return true;
+        }
+        if (pthread_rwlock_tryrdlock(&m_lock) != 0)
+        {
+            return false;
+        }
+        restoreBias();
+        return true;
+    }
+
+    //解锁读锁：槽位是自己占着的就清空槽位，否则是从底层锁加的读锁
+    void unlock_shared()
+    {
+        Slot& slot = m_slots[threadId() & (m_slotNum - 1)];
+        if ((slot.owner.load(std::memory_order_relaxed) & ~WriterWaiting) == threadId())
+        {
+            releaseSlot(slot);
+            return;
+        }
+        pthread_rwlock_unlock(&m_lock);
+    }
+
+    //加写锁：拿到底层写锁后撤销读偏向，等槽位上的读者全部退出
+    void lock()
+    {
+        bool biased = m_readBias.load(std::memory_order_relaxed);
+        if (pthread_rwlock_trywrlock(&m_lock) != 0)
+        {
+            //底层锁被占着，提前关闭读偏向，已经在槽位上的读者拿到写锁后再等；
+            //排队期间拿到底层读锁的读者不能再打开读偏向，拿到写锁后会重新设置抑制期
+            if (biased)
+            {
+                m_inhibitUntil.store(INT64_MAX, std::memory_order_relaxed);
+                m_readBias.store(false, std::memory_order_relaxed);
+            }
+            pthread_rwlock_wrlock(&m_lock);
+        }
+        if (biased || m_readBias.load(std::memory_order_relaxed))
+        {
+            int64_t start = nowNs();
+            m_readBias.store(false, std::memory_order_seq_cst);
+            for (size_t i = 0; i < m_slotNum; i++)
+            {
+                waitSlot(m_slots[i]);
+            }
+            int64_t now = nowNs();
+            m_inhibitUntil.store(now + (now - start) * InhibitFactor, std::memory_order_relaxed);
+        }
+    }
+
+    //尝试加写锁，槽位上还有读者时不等待，直接返回false
+    bool try_lock()
+    {
+        if (pthread_rwlock_trywrlock(&m_lock) != 0)
+        {
+            return false;
+        }
+        if (m_readBias.load(std::memory_order_relaxed))
+        {
+            m_readBias.store(false, std::memory_order_seq_cst);
+            for (size_t i = 0; i < m_slotNum; i++)
+            {
+                if (m_slots[i].owner.load(std::memory_order_acquire) != 0)
+                {
+                    m_readBias.store(true, std::memory_order_release);
+                    pthread_rwlock_unlock(&m_lock);
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void unlock()
+    {
+        pthread_rwlock_unlock(&m_lock);
+    }
+
+    //读偏向是否打开，只是一个近似值
+    inline bool readBiased() const
+    {
+        return m_readBias.load(std::memory_order_relaxed);
+    }
+
+private:
+    //撤销读偏向之后，撤销耗时的多少倍时间内不再打开
+    static const int InhibitFactor = 9;
+    //写者等待一个槽位时，忙等多少次之后去睡眠
+    static const int SpinCount = 1000;
+    //槽位上的写者等待标记，线程编号不会用到最高位
+    static const uint32_t WriterWaiting = 1u << 31;
+
+    struct alignas(64) Slot
+    {
+        //占用槽位的线程编号，0表示空闲；写者在上面睡眠时带WriterWaiting标记
+        std::atomic<uint32_t> owner;
+    };
+
+    //线程编号从1开始按线程创建的先后分配，槽位数以内的线程不会共用槽位
+    static uint32_t threadId()
+    {
+        static std::atomic<uint32_t> s_next(1);
+        static thread_local uint32_t id = s_next.fetch_add(1, std::memory_order_relaxed);
+        return id;
+    }
+
+    //读偏向打开时占用自己的槽位，占用后读偏向仍然开着才算加锁成功
+    bool tryFastShared()
+    {
+        if (!m_readBias.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        uint32_t id = threadId();
+        Slot& slot = m_slots[id & (m_slotNum - 1)];
+        uint32_t expected = 0;
+        if (!slot.owner.compare_exchange_strong(expected, id, std::memory_order_seq_cst))
+        {
+            //槽位被共用它的线程占着，走底层锁
+            return false;
+        }
+        //和写者的“关闭读偏向、再检查槽位”配对，两边至少有一边看到对方
+        if (m_readBias.load(std::memory_order_seq_cst))
+        {
+            return true;
+        }
+        releaseSlot(slot);
+        return false;
+    }
+
+    //清空自己的槽位，写者在上面睡眠时唤醒它
+    static void releaseSlot(Slot& slot)
+    {
+        if (slot.owner.exchange(0, std::memory_order_release) & WriterWaiting)
+        {
+            futexWake(&slot.owner, 1);
+        }
+    }
+
+    //已经拿到底层读锁，没有写者，过了抑制期就重新打开读偏向
+    void restoreBias()
+    {
+        if (!m_readBias.load(std::memory_order_relaxed) && nowNs() >= m_inhibitUntil.load(std::memory_order_relaxed))
+        {
+            m_readBias.store(true, std::memory_order_release);
+        }
+    }
+
+    //写者持有底层写锁时调用，同一时刻只有一个写者标记槽位
+    static void waitSlot(Slot& slot)
+    {
+        int spin = 0;
+        uint32_t owner;
+        while ((owner = slot.owner.load(std::memory_order_acquire)) != 0)
+        {
+            if (++spin <= SpinCount)
+            {
+                continue;
+            }
+            //标记之后读者清空槽位一定会唤醒；标记失败说明槽位刚变过，重新检查
+            if ((owner & WriterWaiting) != 0 ||
+                slot.owner.compare_exchange_strong(owner, owner | WriterWaiting, std::memory_order_acquire))
+            {
+                futexWait(&slot.owner, owner | WriterWaiting, nullptr);
+            }
+        }
+    }
+
+    static inline int64_t nowNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+private:
+    //读者每次都要读的字段放在一个缓存行，底层锁的状态放在另一个，读者走槽位时不受写者和慢路径影响
+    //读偏向打开时读者走槽位
+    alignas(64) std::atomic<bool> m_readBias;
+    Slot* m_slots;
+    size_t m_slotNum;
+    alignas(64) pthread_rwlock_t m_lock;
+    //读偏向的抑制期，写者持有写锁或者排队时写，读者持有读锁时读
+    std::atomic<int64_t> m_inhibitUntil;
+};
+
+#endif // _SCALABLE_RWLOCK_H_
@@ -0,0 +1,191 @@
+#ifndef _SEQ_LOCK_H_
+#define _SEQ_LOCK_H_
+
+#include <sched.h>
+#include <string.h>
+#include <atomic>
+#include <type_traits>
+#include <stdint.h>
+
+/**
+ * 顺序锁：保护很小的、读多写少的结构（配置、路由表项），读者只读不写共享内存
+ *
+ *     SeqLock<Config> config;
+ *     写者：config.store(newConfig);  或者  config.update([](Config& c) { c.weight++; });
+ *     读者：Config c = config.load();
+ *
+ * 1、写者写之前序号加一（变奇数），写完再加一（变偶数）
+ * 2、读者先读序号，是奇数说明正在写，等一下再读；然后拷贝数据，再读一次序号，
+ *    两次相同说明拷贝期间没有写者，拷贝有效，否则重试
+ * 3、读者不修改任何共享的缓存行，读线程再多也不会互相影响，一次读取只是两次读序号加一次拷贝，
+ *    比读写锁的读锁（一次原子读改写加一次解锁）快得多，代价是写得频繁时读者要重试
+ * 4、多写者（MultiWriter为true）：写者用CAS把偶数序号改成奇数来抢写权，奇数序号同时就是写锁，
+ *    不需要额外的互斥锁；单写者版本只有一个线程写，序号直接加一
+ * 5、load(retries)把这次读取的重试次数累加到调用者自己的计数上，每个读者各自统计，
+ *    重试多说明写得太频繁或者写者在写的过程中被换出了CPU
+ *
+ * 数据按8字节一个原子变量保存，读写都用relaxed原子操作，配合序号前后的内存屏障，
+ * 拷贝和写者并发也不是数据竞争（Boehm的做法），T必须可以平凡拷贝。
+ * 写者在写的过程中被换出CPU时，读者自旋一段时间后让出CPU。
+*/
+template <typename T, bool MultiWriter = false>
+class SeqLock
+{
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock requires a trivially copyable type");
+
+public:
+    SeqLock() : m_seq(0)
+    {
+        T value = T();
+        write(value);
+    }
+
+    explicit SeqLock(const T& value) : m_seq(0)
+    {
+        write(value);
+    }
+
+    SeqLock(const SeqLock&) = delete;
+    SeqLock& operator=(const SeqLock&) = delete;
+
+    //读取一份一致的拷贝
+    T load() const
+    {
+        uint64_t retries = 0;
+        return load(retries);
+    }
+
+    //读取一份一致的拷贝，重试次数累加到retries
+    T load(uint64_t& retries) const
+    {
+        uint64_t words[WordNum];
+        int spins = 0;
+        while (true)
+        {
+            uint32_t seq = m_seq.load(std::memory_order_acquire);
+            if ((seq & 1) == 0)
+            {
+                for (size_t i = 0; i < WordNum; i++)
+                {
+                    words[i] = m_words[i].load(std::memory_order_relaxed);
+                }
+                //拷贝的读取不能排到第二次读序号之后
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (m_seq.load(std::memory_order_relaxed) == seq)
+                {
+                    break;
+                }
+            }
+            retries++;
+            pause(spins);
+        }
+
+        T value;
+        memcpy(&value, words, sizeof(T));
+        return value;
+    }
+
+    //写入新值
+    void store(const T& value)
+    {
+        uint32_t seq = beginWrite();
+        write(value);
+        endWrite(seq);
+    }
+
+    //在写者独占的情况下读出当前值，修改后写回，多写者时可以做“读-改-写”而不丢失其他写者的修改
+    template <typename F>
+    void update(F f)
+    {
+        uint32_t seq = beginWrite();
+        T value = read();
+        f(value);
+        write(value);
+        endWrite(seq);
+    }
+
+    //当前序号，写入的次数是它的一半
+    inline uint32_t sequence() const
+    {
+        return m_seq.load(std::memory_order_acquire);
+    }
+
+private:
+    static const size_t WordNum = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    //序号变奇数，返回写之前的偶数序号
+    uint32_t beginWrite()
+    {
+        uint32_t seq = m_seq.load(std::memory_order_relaxed);
+        if (MultiWriter)
+        {
+            int spins = 0;
+            while ((seq & 1) != 0 ||
+                   !m_seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                pause(spins);
+                seq = m_seq.load(std::memory_order_relaxed);
+            }
+        }
+        else
+        {
+            m_seq.store(seq + 1, std::memory_order_relaxed);
+        }
+        //数据的写入不能排到序号变奇数之前
+        std::atomic_thread_fence(std::memory_order_release);
+        return seq;
+    }
+
+    //序号变成下一个偶数，写入对读者可见
+    void endWrite(uint32_t seq)
+    {
+        m_seq.store(seq + 2, std::memory_order_release);
+    }
+
+    void write(const T& value)
+    {
+        uint64_t words[WordNum] = {};
+        memcpy(words, &value, sizeof(T));
+        for (size_t i = 0; i < WordNum; i++)
+        {
+            m_words[i].store(words[i], std::memory_order_relaxed);
+        }
+    }
+
+    //只在写者独占时调用
+    T read() const
+    {
+        uint64_t words[WordNum];
+        for (size_t i = 0; i < WordNum; i++)
+        {
+            words[i] = m_words[i].load(std::memory_order_relaxed);
+        }
+        T value;
+        memcpy(&value, words, sizeof(T));
+        return value;
+    }
+
+    //写者写得很快，先pause几次，迟迟写不完多半是被换出了CPU，让出CPU
+    static inline void pause(int& spins)
+    {
+        if (++spins < 256)
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#elif defined(__aarch64__)
+            asm volatile("yield");
+#endif
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+
+private:
+    //序号和数据放在一起，一次读取通常只碰一个缓存行；和其他数据分开，避免伪共享
+    alignas(64) std::atomic<uint32_t> m_seq;
+    std::atomic<uint64_t> m_words[WordNum];
+};
+
+#endif // _SEQ_LOCK_H_
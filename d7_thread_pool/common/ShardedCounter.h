@@ -0,0 +1,214 @@
+#ifndef _SHARDED_COUNTER_H_
+#define _SHARDED_COUNTER_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * 分片计数器：代替“全局计数器+互斥锁”的统计计数
+ *
+ *     ShardedCounter requests;    requests.inc();          requests.read();
+ *     ShardedMax maxLatency;      maxLatency.update(ns);   maxLatency.read();
+ *     ShardedGauge inflight;      inflight.inc(); ... inflight.dec();
+ *
+ * 1、计数器由若干个单元组成，每个单元独占一个缓存行，线程第一次使用时按先后分到一个单元，
+ *    之后只修改自己的单元，用relaxed原子操作，不加锁，也不和其他线程抢同一个缓存行
+ * 2、单元数默认是CPU数的2倍（向上取整为2的幂），线程数更多时几个线程共用一个单元，结果仍然正确
+ * 3、read把所有单元汇总，是某一段时间内的值，不是某一时刻的快照；各个单元的修改都是原子的，不会丢
+ * 4、readApprox返回缓存的汇总值，超过maxAgeNs才重新汇总一次，监控线程频繁读取时不用每次扫描所有单元
+ *
+ * 三种计数器：
+ *      ShardedCounter  只增不减的累计值（请求数、字节数），read返回总和
+ *      ShardedGauge    可增可减的当前值（在途请求数、队列长度），read返回总和
+ *      ShardedMax      最大值（最大延迟、最大队列长度），read返回所有单元的最大值
+*/
+
+//各类分片计数器共用的单元数组，Combine决定单元的合并方式
+template <typename Combine>
+class ShardedCells
+{
+public:
+    //cells为0时按CPU数的2倍取单元数
+    explicit ShardedCells(int64_t initial, size_t cells) :
+    m_initial(initial),
+    m_cachedValue(initial),
+    m_cachedAt(0)
+    {
+        if (cells == 0)
+        {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            cells = cpus > 0 ? (size_t)cpus * 2 : 64;
+        }
+        m_cellNum = 1;
+        while (m_cellNum < cells)
+        {
+            m_cellNum <<= 1;
+        }
+        m_cells = new Cell[m_cellNum];
+        for (size_t i = 0; i < m_cellNum; i++)
+        {
+            m_cells[i].value.store(initial, std::memory_order_relaxed);
+        }
+    }
+
+    ~ShardedCells()
+    {
+        delete[] m_cells;
+    }
+
+    ShardedCells(const ShardedCells&) = delete;
+    ShardedCells& operator=(const ShardedCells&) = delete;
+
+    //汇总所有单元
+    int64_t read() const
+    {
+        int64_t value = m_initial;
+        for (size_t i = 0; i < m_cellNum; i++)
+        {
+            value = Combine::combine(value, m_cells[i].value.load(std::memory_order_relaxed));
+        }
+        return value;
+    }
+
+    //缓存的汇总值，超过maxAgeNs纳秒才重新汇总
+    int64_t readApprox(int64_t maxAgeNs = 1000000) const
+    {
+        int64_t now = nowNs();
+        if (now - m_cachedAt.load(std::memory_order_relaxed) < maxAgeNs)
+        {
+            return m_cachedValue.load(std::memory_order_relaxed);
+        }
+        int64_t value = read();
+        m_cachedValue.store(value, std::memory_order_relaxed);
+        m_cachedAt.store(now, std::memory_order_relaxed);
+        return value;
+    }
+
+    //所有单元恢复初始值，和并发的修改同时进行时可能丢掉其中一部分
+    void reset()
+    {
+        for (size_t i = 0; i < m_cellNum; i++)
+        {
+            m_cells[i].value.store(m_initial, std::memory_order_relaxed);
+        }
+        m_cachedAt.store(0, std::memory_order_relaxed);
+    }
+
+    inline size_t cells() const
+    {
+        return m_cellNum;
+    }
+
+protected:
+    struct alignas(64) Cell
+    {
+        std::atomic<int64_t> value;
+    };
+
+    //当前线程的单元
+    inline Cell& local()
+    {
+        return m_cells[threadIndex() & (m_cellNum - 1)];
+    }
+
+private:
+    //线程编号按第一次使用的先后分配，单元数以内的线程各用各的单元
+    static size_t threadIndex()
+    {
+        static std::atomic<size_t> s_next(0);
+        static thread_local size_t index = s_next.fetch_add(1, std::memory_order_relaxed);
+        return index;
+    }
+
+    static inline int64_t nowNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+private:
+    Cell* m_cells;
+    size_t m_cellNum;
+    int64_t m_initial;
+    //readApprox的缓存，和单元分开放，读者刷新缓存时不影响写者
+    alignas(64) mutable std::atomic<int64_t> m_cachedValue;
+    mutable std::atomic<int64_t> m_cachedAt;
+};
+
+struct ShardedSum
+{
+    static inline int64_t combine(int64_t a, int64_t b)
+    {
+        return a + b;
+    }
+};
+
+struct ShardedMaximum
+{
+    static inline int64_t combine(int64_t a, int64_t b)
+    {
+        return a > b ? a : b;
+    }
+};
+
+//累计计数
+class ShardedCounter : public ShardedCells<ShardedSum>
+{
+public:
+    explicit ShardedCounter(size_t cells = 0) : ShardedCells<ShardedSum>(0, cells) {}
+
+    inline void add(int64_t n)
+    {
+        local().value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    inline void inc()
+    {
+        add(1);
+    }
+};
+
+//当前值，可增可减；某个单元单独看可能是负数，汇总之后才有意义
+class ShardedGauge : public ShardedCells<ShardedSum>
+{
+public:
+    explicit ShardedGauge(size_t cells = 0) : ShardedCells<ShardedSum>(0, cells) {}
+
+    inline void add(int64_t n)
+    {
+        local().value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    inline void inc()
+    {
+        add(1);
+    }
+
+    inline void dec()
+    {
+        add(-1);
+    }
+};
+
+//最大值，没有更新过时read返回INT64_MIN
+class ShardedMax : public ShardedCells<ShardedMaximum>
+{
+public:
+    explicit ShardedMax(size_t cells = 0) : ShardedCells<ShardedMaximum>(INT64_MIN, cells) {}
+
+    //不比自己单元里的值大时只有一次读，不写缓存行
+    inline void update(int64_t value)
+    {
+        std::atomic<int64_t>& cell = local().value;
+        int64_t cur = cell.load(std::memory_order_relaxed);
+        while (value > cur && !cell.compare_exchange_weak(cur, value, std::memory_order_relaxed))
+        {
+        }
+    }
+};
+
+#endif // _SHARDED_COUNTER_H_
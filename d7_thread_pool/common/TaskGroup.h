@@ -0,0 +1,377 @@
+#ifndef _TASK_GROUP_H_
+#define _TASK_GROUP_H_
+
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <memory>
+#include <exception>
+#include <utility>
+#include <type_traits>
+#include <stddef.h>
+
+/**
+ * 任务组：在一个线程池上等待或取消一批任务，不用为每一批任务重建线程池
+ *
+ *     TaskGroup group(pool);
+ *     for (...) group.spawn([=]() { ... });
+ *     group.wait();
+ *
+ * 同时支持pool1的threadpool_t和pool2的ThreadPool，提交方式和Parallel.h相同。
+ * 1、spawn把任务放进任务组自己的队列，再往线程池投递一个执行者，执行者从任务组队列取一个任务执行
+ * 2、wait先在调用线程上执行任务组里还在排队的任务，队列取空后才睡眠等待其他线程手里的任务，
+ *    线程池很忙或者在工作线程里等待子任务组时不会死锁
+ * 3、取消是协作式的：cancel之后排队的任务直接丢弃，正在执行的任务通过token().cancelled()
+ *    自己决定是否提前结束；多个任务组可以共用一个CancelToken，一次取消一整棵任务树
+ * 4、任务抛出异常时取消任务组，wait重新抛出第一个异常
+ * 5、wait返回后任务组可以继续使用，析构时等待剩下的任务，丢弃异常
+ *
+ * 执行者持有任务组共享状态的引用，任务组析构后才执行的执行者发现队列为空直接返回。
+*/
+
+//协作式取消标志，可以复制，副本之间共享同一个标志
+class CancelToken
+{
+public:
+    CancelToken() : m_flag(std::make_shared<std::atomic<bool> >(false)) {}
+
+    inline void cancel() const
+    {
+        m_flag->store(true, std::memory_order_release);
+    }
+
+    inline bool cancelled() const
+    {
+        return m_flag->load(std::memory_order_acquire);
+    }
+
+private:
+    std::shared_ptr<std::atomic<bool> > m_flag;
+};
+
+//任务组队列中的任务，侵入式单链表
+struct TaskGroupItem
+{
+    TaskGroupItem* next = nullptr;
+
+    virtual ~TaskGroupItem() {}
+    virtual void run() = 0;
+};
+
+template <typename F>
+struct TaskGroupItemImpl : public TaskGroupItem
+{
+    F fn;
+
+    explicit TaskGroupItemImpl(F&& f) : fn(std::move(f)) {}
+    explicit TaskGroupItemImpl(const F& f) : fn(f) {}
+
+    void run() override
+    {
+        fn();
+    }
+};
+
+//任务组的共享状态，执行者和任务组共同持有
+class TaskGroupState
+{
+public:
+    explicit TaskGroupState(const CancelToken& token) :
+    m_token(token),
+    m_head(nullptr),
+    m_tail(nullptr),
+    m_pending(0),
+    m_waiting(false),
+    m_skipped(0)
+    {
+        pthread_mutex_init(&m_mutex, nullptr);
+        pthread_cond_init(&m_cond, nullptr);
+    }
+
+    ~TaskGroupState()
+    {
+        drop(detachAll());
+        pthread_mutex_destroy(&m_mutex);
+        pthread_cond_destroy(&m_cond);
+    }
+
+    //放进队列，已经取消时直接丢弃并返回false
+    bool push(TaskGroupItem* item)
+    {
+        if (m_token.cancelled())
+        {
+            delete item;
+            m_skipped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        pthread_mutex_lock(&m_mutex);
+        if (m_tail != nullptr)
+        {
+            m_tail->next = item;
+        }
+        else
+        {
+            m_head = item;
+        }
+        m_tail = item;
+        m_pending++;
+        pthread_mutex_unlock(&m_mutex);
+        return true;
+    }
+
+    //取一个任务执行，已经取消的任务直接丢弃；队列为空返回false
+    bool runOne()
+    {
+        pthread_mutex_lock(&m_mutex);
+        TaskGroupItem* item = m_head;
+        if (item != nullptr)
+        {
+            m_head = item->next;
+            if (m_head == nullptr)
+            {
+                m_tail = nullptr;
+            }
+        }
+        pthread_mutex_unlock(&m_mutex);
+        if (item == nullptr)
+        {
+            return false;
+        }
+
+        if (m_token.cancelled())
+        {
+            m_skipped.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            try
+            {
+                item->run();
+            }
+            catch (...)
+            {
+                pthread_mutex_lock(&m_mutex);
+                if (!m_error)
+                {
+                    m_error = std::current_exception();
+                }
+                pthread_mutex_unlock(&m_mutex);
+                cancel();
+            }
+        }
+        delete item;
+        finish(1);
+        return true;
+    }
+
+    //帮着执行排队的任务，再等待其他线程手里的任务，返回第一个异常
+    std::exception_ptr wait()
+    {
+        while (runOne())
+        {
+        }
+        //剩下的任务已经在其他线程上执行，先短暂让出CPU，任务比较长时再睡眠
+        for (int i = 0; i < 64 && pending() > 0; i++)
+        {
+            sched_yield();
+        }
+        pthread_mutex_lock(&m_mutex);
+        m_waiting = true;
+        while (m_pending > 0)
+        {
+            pthread_cond_wait(&m_cond, &m_mutex);
+        }
+        m_waiting = false;
+        std::exception_ptr error = m_error;
+        m_error = nullptr;
+        pthread_mutex_unlock(&m_mutex);
+        return error;
+    }
+
+    //设置取消标志，丢弃还在排队的任务
+    void cancel()
+    {
+        m_token.cancel();
+        TaskGroupItem* items = detachAll();
+        size_t n = drop(items);
+        m_skipped.fetch_add(n, std::memory_order_relaxed);
+        finish(n);
+    }
+
+    inline const CancelToken& token() const
+    {
+        return m_token;
+    }
+
+    inline size_t pending()
+    {
+        pthread_mutex_lock(&m_mutex);
+        size_t n = m_pending;
+        pthread_mutex_unlock(&m_mutex);
+        return n;
+    }
+
+    inline size_t skipped() const
+    {
+        return m_skipped.load(std::memory_order_relaxed);
+    }
+
+private:
+    TaskGroupItem* detachAll()
+    {
+        pthread_mutex_lock(&m_mutex);
+        TaskGroupItem* items = m_head;
+        m_head = nullptr;
+        m_tail = nullptr;
+        pthread_mutex_unlock(&m_mutex);
+        return items;
+    }
+
+    static size_t drop(TaskGroupItem* items)
+    {
+        size_t n = 0;
+        while (items != nullptr)
+        {
+            TaskGroupItem* next = items->next;
+            delete items;
+            items = next;
+            n++;
+        }
+        return n;
+    }
+
+    //n个任务结束（执行完或被丢弃），全部结束时唤醒等待者
+    void finish(size_t n)
+    {
+        if (n == 0)
+        {
+            return;
+        }
+        pthread_mutex_lock(&m_mutex);
+        m_pending -= n;
+        if (m_pending == 0 && m_waiting)
+        {
+            pthread_cond_broadcast(&m_cond);
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+private:
+    CancelToken m_token;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+    //以下由m_mutex保护
+    TaskGroupItem* m_head;
+    TaskGroupItem* m_tail;
+    //已提交还没结束的任务数，包括排队的和正在执行的
+    size_t m_pending;
+    bool m_waiting;
+    std::exception_ptr m_error;
+    //因为取消而没有执行的任务数
+    std::atomic<size_t> m_skipped;
+};
+
+//pool1的执行者入口，参数是堆上的shared_ptr
+static inline void* taskGroupTrampoline(void* arg)
+{
+    std::shared_ptr<TaskGroupState>* state = (std::shared_ptr<TaskGroupState>*)arg;
+    (*state)->runOne();
+    delete state;
+    return nullptr;
+}
+
+//执行者：从任务组队列取一个任务执行
+struct TaskGroupRunner
+{
+    std::shared_ptr<TaskGroupState> state;
+
+    void operator()()
+    {
+        state->runOne();
+    }
+};
+
+//投递一个执行者：pool2的ThreadPool直接提交可调用对象
+template <typename Pool>
+inline auto taskGroupPost(Pool& pool, const std::shared_ptr<TaskGroupState>& state, int)
+    -> decltype(pool.addTask(TaskGroupRunner{state}), void())
+{
+    pool.addTask(TaskGroupRunner{state});
+}
+
+//pool1的threadpool_t通过回调函数+参数提交
+template <typename Pool>
+inline auto taskGroupPost(Pool& pool, const std::shared_ptr<TaskGroupState>& state, long)
+    -> decltype(threadpool_add_task(&pool, taskGroupTrampoline, nullptr), void())
+{
+    threadpool_add_task(&pool, taskGroupTrampoline, new std::shared_ptr<TaskGroupState>(state));
+}
+
+template <typename Pool>
+class TaskGroup
+{
+public:
+    explicit TaskGroup(Pool& pool, const CancelToken& token = CancelToken()) :
+    m_pool(pool),
+    m_state(std::make_shared<TaskGroupState>(token))
+    {
+    }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    ~TaskGroup()
+    {
+        m_state->wait();
+    }
+
+    //提交一个任务，任务组已经取消时直接丢弃
+    template <typename F>
+    void spawn(F&& f)
+    {
+        typedef typename std::decay<F>::type Fn;
+        if (m_state->push(new TaskGroupItemImpl<Fn>(std::forward<F>(f))))
+        {
+            taskGroupPost(m_pool, m_state, 0);
+        }
+    }
+
+    //等待所有任务结束，调用线程帮着执行排队的任务；有任务抛出异常时重新抛出第一个
+    void wait()
+    {
+        std::exception_ptr error = m_state->wait();
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    //取消任务组：排队的任务不再执行，正在执行的任务可以检查token().cancelled()提前结束
+    void cancel()
+    {
+        m_state->cancel();
+    }
+
+    inline bool cancelled() const
+    {
+        return m_state->token().cancelled();
+    }
+
+    //任务里检查取消标志用，也可以传给子任务组，取消时一起取消
+    inline const CancelToken& token() const
+    {
+        return m_state->token();
+    }
+
+    //因为取消而没有执行的任务数
+    inline size_t skipped() const
+    {
+        return m_state->skipped();
+    }
+
+private:
+    Pool& m_pool;
+    std::shared_ptr<TaskGroupState> m_state;
+};
+
+#endif // _TASK_GROUP_H_
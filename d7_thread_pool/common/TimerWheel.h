@@ -0,0 +1,500 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <functional>
+#include <utility>
+#include <vector>
+
+//定时器编号，0表示无效
+typedef uint64_t TimerId;
+
+/**
+ * 分层时间轮，给线程池提供延迟任务和周期任务
+ *
+ * d4_daemon/MyDaemon.cpp里用setitimer+SIGALRM做定时，一个进程只有一个ITIMER_REAL，
+ * 回调在信号处理函数里执行，能做的事情很少。这里改成：
+ * 1、一个定时器线程阻塞在timerfd（CLOCK_MONOTONIC）上，不使用信号，不受系统时间调整影响，
+ *    timerfd只设置到最近一个可能到期的时刻，没有定时器时不设置，空闲时不会周期性醒来
+ * 2、时间轮分Levels层，每层64个槽，第0层一个槽是一个tick，第l层一个槽是64^l个tick，
+ *    默认tick为1毫秒，6层可以覆盖约2年，更远的定时器先放在最高层，转下来时再重新计算
+ * 3、每个槽是侵入式双向链表，添加是算出层和槽后挂到链表头，取消是从链表里摘下来，都是O(1)；
+ *    高层的槽到期时把整条链表转到低层（cascade），每个定时器最多被转Levels-1次
+ * 4、每层一个64位的占用位图，推进时间和计算下次唤醒时刻都是按位查找，跳过空槽
+ * 5、同一个tick到期的定时器收集成一批，释放锁后一次交给dispatch，由线程池批量放进普通任务队列，
+ *    定时器线程自己不执行任务
+ * 6、定时器节点分块分配，地址不变，编号里带节点下标和代数，取消时O(1)找到节点，
+ *    节点复用后旧编号失效
+ *
+ * Payload是定时器携带的数据，一次性定时器到期时移交给dispatch，周期定时器每次到期复制一份，
+ * 所以Payload应当复制代价很低，例如函数指针加参数或者shared_ptr。
+ * 定时器线程在第一次添加定时器时才创建，不用定时器的线程池没有额外线程。
+ * 析构时还没到期的定时器直接丢弃，不会再调用dispatch。
+*/
+template <typename Payload>
+class TimerWheel
+{
+public:
+    //定时器线程上调用，参数是这次到期的一批定时器，调用期间不持有时间轮的锁
+    typedef std::function<void(std::vector<Payload>& batch)> Dispatch;
+
+    explicit TimerWheel(Dispatch dispatch, int64_t tickNs = 1000000)
+        : m_dispatch(std::move(dispatch)), m_tickNs(tickNs > 0 ? tickNs : 1000000),
+          m_startNs(nowNs()), m_base(0), m_armed(0), m_count(0), m_free(nullptr),
+          m_fd(-1), m_started(false), m_stop(false)
+    {
+        pthread_mutex_init(&m_lock, NULL);
+        memset(m_slots, 0, sizeof(m_slots));
+        memset(m_occupied, 0, sizeof(m_occupied));
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    ~TimerWheel()
+    {
+        pthread_mutex_lock(&m_lock);
+        bool started = m_started;
+        m_stop = true;
+        pthread_mutex_unlock(&m_lock);
+        if (started)
+        {
+            //让timerfd立即到期，唤醒阻塞在read上的定时器线程
+            arm(1, false);
+            pthread_join(m_thread, NULL);
+        }
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+        for (size_t i = 0; i < m_chunks.size(); ++i)
+        {
+            delete[] m_chunks[i];
+        }
+        pthread_mutex_destroy(&m_lock);
+    }
+
+    //delayNs之后到期一次，返回定时器编号，失败（创建timerfd或线程失败、已经析构）返回0
+    TimerId addAfter(int64_t delayNs, Payload payload)
+    {
+        return add(delayNs, 0, std::move(payload));
+    }
+
+    //每隔periodNs到期一次，第一次在periodNs之后
+    TimerId addEvery(int64_t periodNs, Payload payload)
+    {
+        return add(periodNs, periodNs > 0 ? periodNs : 1, std::move(payload));
+    }
+
+    //取消定时器，定时器还在时间轮里返回true；已经到期交给dispatch的一次性定时器返回false，
+    //周期定时器取消后不会再到期，已经交出去的那一次不受影响
+    bool cancel(TimerId id)
+    {
+        uint32_t index = (uint32_t)id;
+        uint32_t gen = (uint32_t)(id >> 32);
+        if (index == 0)
+        {
+            return false;
+        }
+        index--;
+
+        pthread_mutex_lock(&m_lock);
+        if (index >= m_chunks.size() * ChunkSize)
+        {
+            pthread_mutex_unlock(&m_lock);
+            return false;
+        }
+        Node* node = &m_chunks[index / ChunkSize][index % ChunkSize];
+        if (node->gen != gen || node->level < 0)
+        {
+            pthread_mutex_unlock(&m_lock);
+            return false;
+        }
+        unlink(node);
+        Payload dropped = std::move(node->payload);
+        release(node);
+        pthread_mutex_unlock(&m_lock);
+        //Payload在锁外析构，它可能持有用户对象
+        (void)dropped;
+        return true;
+    }
+
+    //时间轮里的定时器个数
+    size_t size()
+    {
+        pthread_mutex_lock(&m_lock);
+        size_t n = m_count;
+        pthread_mutex_unlock(&m_lock);
+        return n;
+    }
+
+private:
+    enum
+    {
+        Levels = 6,
+        SlotBits = 6,
+        Slots = 1 << SlotBits,
+        ChunkSize = 1024
+    };
+
+    struct Node
+    {
+        uint64_t expire;    //到期的tick
+        uint64_t period;    //周期（tick），0表示一次性
+        uint32_t gen;       //代数，节点每次复用加一
+        uint32_t index;     //节点下标
+        int level;          //所在的层和槽，-1表示空闲
+        int slot;
+        Node* prev;
+        Node* next;
+        Payload payload;
+    };
+
+    static inline int64_t nowNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    //当前时刻对应的tick，已经过去的tick都可以处理
+    uint64_t currentTick() const
+    {
+        int64_t elapsed = nowNs() - m_startNs;
+        return elapsed > 0 ? (uint64_t)(elapsed / m_tickNs) : 0;
+    }
+
+    TimerId add(int64_t delayNs, int64_t periodNs, Payload&& payload)
+    {
+        if (delayNs < 0)
+        {
+            delayNs = 0;
+        }
+        //向上取整，定时器不会比要求的时间早到期
+        uint64_t expire = (uint64_t)((nowNs() - m_startNs + delayNs + m_tickNs - 1) / m_tickNs);
+        uint64_t period = periodNs > 0 ? (uint64_t)((periodNs + m_tickNs - 1) / m_tickNs) : 0;
+
+        pthread_mutex_lock(&m_lock);
+        if (m_stop || (!m_started && !start()))
+        {
+            pthread_mutex_unlock(&m_lock);
+            return 0;
+        }
+        if (m_count == 0)
+        {
+            //时间轮空了以后定时器线程不再推进，直接把起点挪到现在
+            uint64_t now = currentTick();
+            if (now > m_base)
+            {
+                m_base = now;
+            }
+        }
+        Node* node = acquire();
+        node->expire = expire;
+        node->period = period;
+        node->payload = std::move(payload);
+        link(node);
+        TimerId id = ((uint64_t)node->gen << 32) | (node->index + 1);
+        //比timerfd当前设置的时刻早，重新设置
+        uint64_t due = expire > m_base ? expire : m_base;
+        if (m_armed == 0 || due < m_armed)
+        {
+            m_armed = due;
+            arm(m_startNs + (int64_t)due * m_tickNs, true);
+        }
+        pthread_mutex_unlock(&m_lock);
+        return id;
+    }
+
+    //创建timerfd和定时器线程，调用前需持有m_lock
+    bool start()
+    {
+        m_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (m_fd < 0)
+        {
+            return false;
+        }
+        if (pthread_create(&m_thread, NULL, routine, this) != 0)
+        {
+            close(m_fd);
+            m_fd = -1;
+            return false;
+        }
+        m_started = true;
+        return true;
+    }
+
+    //absolute为true时ns是CLOCK_MONOTONIC的绝对时刻，否则是相对时间；0表示停止
+    void arm(int64_t ns, bool absolute)
+    {
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        if (ns > 0)
+        {
+            spec.it_value.tv_sec = ns / 1000000000;
+            spec.it_value.tv_nsec = ns % 1000000000;
+        }
+        timerfd_settime(m_fd, absolute ? TFD_TIMER_ABSTIME : 0, &spec, NULL);
+    }
+
+    //分配一个节点，调用前需持有m_lock
+    Node* acquire()
+    {
+        if (m_free == nullptr)
+        {
+            Node* chunk = new Node[ChunkSize];
+            uint32_t first = (uint32_t)(m_chunks.size() * ChunkSize);
+            m_chunks.push_back(chunk);
+            for (int i = ChunkSize - 1; i >= 0; --i)
+            {
+                chunk[i].gen = 0;
+                chunk[i].index = first + i;
+                chunk[i].level = -1;
+                chunk[i].next = m_free;
+                m_free = &chunk[i];
+            }
+        }
+        Node* node = m_free;
+        m_free = node->next;
+        m_count++;
+        return node;
+    }
+
+    //回收节点，旧编号随代数加一失效，调用前需持有m_lock
+    void release(Node* node)
+    {
+        node->gen++;
+        node->level = -1;
+        node->next = m_free;
+        m_free = node;
+        m_count--;
+    }
+
+    //按到期时间挂到对应的层和槽上，m_base是下一个要处理的tick
+    void link(Node* node)
+    {
+        uint64_t expire = node->expire > m_base ? node->expire : m_base;
+        uint64_t delta = expire - m_base;
+        int level = 0;
+        while (level < Levels - 1 && delta >= ((uint64_t)1 << (SlotBits * (level + 1))))
+        {
+            level++;
+        }
+        if (level == Levels - 1 && delta >= ((uint64_t)1 << (SlotBits * Levels)))
+        {
+            //超出时间轮范围，先放在最高层最远的槽，转下来时重新计算
+            expire = m_base + ((uint64_t)1 << (SlotBits * Levels)) - 1;
+        }
+        int slot = (int)((expire >> (SlotBits * level)) & (Slots - 1));
+
+        node->level = level;
+        node->slot = slot;
+        node->prev = nullptr;
+        node->next = m_slots[level][slot];
+        if (node->next != nullptr)
+        {
+            node->next->prev = node;
+        }
+        m_slots[level][slot] = node;
+        m_occupied[level] |= (uint64_t)1 << slot;
+    }
+
+    void unlink(Node* node)
+    {
+        if (node->prev != nullptr)
+        {
+            node->prev->next = node->next;
+        }
+        else
+        {
+            m_slots[node->level][node->slot] = node->next;
+            if (node->next == nullptr)
+            {
+                m_occupied[node->level] &= ~((uint64_t)1 << node->slot);
+            }
+        }
+        if (node->next != nullptr)
+        {
+            node->next->prev = node->prev;
+        }
+    }
+
+    //摘下整个槽
+    Node* take(int level, int slot)
+    {
+        Node* list = m_slots[level][slot];
+        m_slots[level][slot] = nullptr;
+        m_occupied[level] &= ~((uint64_t)1 << slot);
+        return list;
+    }
+
+    //处理到now为止（包括now）的所有tick，到期的Payload放进batch，调用前需持有m_lock
+    void advance(uint64_t now, std::vector<Payload>& batch)
+    {
+        while (m_base <= now)
+        {
+            uint64_t t = m_base;
+            if ((t & (Slots - 1)) == 0)
+            {
+                //从高层往低层转，高层转下来的定时器可能正好落在这个tick要转的低层槽里
+                int top = 1;
+                while (top < Levels - 1 && (t & (((uint64_t)1 << (SlotBits * (top + 1))) - 1)) == 0)
+                {
+                    top++;
+                }
+                for (int level = top; level >= 1; --level)
+                {
+                    int slot = (int)((t >> (SlotBits * level)) & (Slots - 1));
+                    Node* node = take(level, slot);
+                    while (node != nullptr)
+                    {
+                        Node* next = node->next;
+                        link(node);
+                        node = next;
+                    }
+                }
+            }
+
+            int slot = (int)(t & (Slots - 1));
+            Node* node = take(0, slot);
+            while (node != nullptr)
+            {
+                Node* next = node->next;
+                if (node->expire > t)
+                {
+                    //超出范围后被截断的远期定时器，还没到
+                    link(node);
+                }
+                else if (node->period == 0)
+                {
+                    batch.push_back(std::move(node->payload));
+                    release(node);
+                }
+                else
+                {
+                    batch.push_back(node->payload);
+                    //按原定节拍继续，落后太多（定时器线程被耽误）时不补发，从现在开始重新计时
+                    node->expire += node->period;
+                    if (node->expire <= t)
+                    {
+                        node->expire = t + node->period;
+                    }
+                    link(node);
+                }
+                node = next;
+            }
+
+            //中间没有定时器到期也没有非空的槽要转，直接跳过去
+            uint64_t next = nextTick();
+            m_base = next != 0 && next <= now ? next : now + 1;
+        }
+    }
+
+    //下一个可能有定时器到期或需要转槽的tick，没有定时器返回0，调用前需持有m_lock
+    uint64_t nextTick() const
+    {
+        if (m_count == 0)
+        {
+            return 0;
+        }
+        uint64_t best = UINT64_MAX;
+        for (int level = 0; level < Levels; ++level)
+        {
+            uint64_t bits = m_occupied[level];
+            if (bits == 0)
+            {
+                continue;
+            }
+            int shift = SlotBits * level;
+            uint64_t unit = m_base >> shift;
+            int current = (int)(unit & (Slots - 1));
+            //当前槽还没转过（m_base正好在槽的起点）时从当前槽算起，否则从下一个槽算起
+            bool aligned = level == 0 || (m_base & (((uint64_t)1 << shift) - 1)) == 0;
+            int from = aligned ? current : current + 1;
+            uint64_t rotated = from < Slots ? (bits >> from) | (from > 0 ? bits << (Slots - from) : 0) : bits;
+            uint64_t distance = (uint64_t)__builtin_ctzll(rotated) + (uint64_t)(from - current);
+            uint64_t tick = (unit + distance) << shift;
+            if (tick < m_base)
+            {
+                tick = m_base;
+            }
+            if (tick < best)
+            {
+                best = tick;
+            }
+        }
+        return best;
+    }
+
+    static void* routine(void* arg)
+    {
+        static_cast<TimerWheel*>(arg)->run();
+        return NULL;
+    }
+
+    void run()
+    {
+        std::vector<Payload> batch;
+        for (;;)
+        {
+            uint64_t expirations;
+            //timerfd到期或者被重新设置成更早的时刻才返回，被信号打断就重新等
+            if (read(m_fd, &expirations, sizeof(expirations)) < 0)
+            {
+                pthread_mutex_lock(&m_lock);
+                bool stop = m_stop;
+                pthread_mutex_unlock(&m_lock);
+                if (stop)
+                {
+                    break;
+                }
+                continue;
+            }
+
+            pthread_mutex_lock(&m_lock);
+            if (m_stop)
+            {
+                pthread_mutex_unlock(&m_lock);
+                break;
+            }
+            advance(currentTick(), batch);
+            m_armed = nextTick();
+            arm(m_armed != 0 ? m_startNs + (int64_t)m_armed * m_tickNs : 0, true);
+            pthread_mutex_unlock(&m_lock);
+
+            if (!batch.empty())
+            {
+                m_dispatch(batch);
+                batch.clear();
+            }
+        }
+    }
+
+private:
+    Dispatch m_dispatch;
+    const int64_t m_tickNs;
+    //tick 0对应的CLOCK_MONOTONIC时刻
+    const int64_t m_startNs;
+    //以下由m_lock保护
+    pthread_mutex_t m_lock;
+    //下一个要处理的tick，之前的都已经处理过
+    uint64_t m_base;
+    //timerfd设置的tick，0表示没有设置
+    uint64_t m_armed;
+    size_t m_count;
+    Node* m_slots[Levels][Slots];
+    uint64_t m_occupied[Levels];
+    std::vector<Node*> m_chunks;
+    Node* m_free;
+    int m_fd;
+    pthread_t m_thread;
+    bool m_started;
+    bool m_stop;
+};
+
+#endif // _TIMER_WHEEL_H_
@@ -0,0 +1,139 @@
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+#include <vector>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * CPU和NUMA节点的对应关系
+ *
+ * 从/sys/devices/system/node/online和nodeN/cpulist读取，不依赖libnuma。
+ * 没有NUMA信息的机器上所有CPU都属于节点0。节点编号可能不连续，nodeCount是最大编号加一，
+ * 中间的编号上没有CPU。
+ *
+ * 内存放在哪个节点上采用内核默认的首次访问策略：线程先绑核，再自己分配并写一遍内存，
+ * 页就会落在该核所在的节点上。
+*/
+class CpuTopology
+{
+public:
+    static const CpuTopology& instance()
+    {
+        static CpuTopology topology;
+        return topology;
+    }
+
+    //CPU所在的节点，未知的CPU返回0
+    inline int nodeOf(int cpu) const
+    {
+        return (cpu >= 0 && cpu < (int)m_cpuNode.size()) ? m_cpuNode[cpu] : 0;
+    }
+
+    inline int nodeCount() const
+    {
+        return m_nodes;
+    }
+
+    inline int cpuCount() const
+    {
+        return (int)m_cpuNode.size();
+    }
+
+    //当前线程所在的节点，sched_getcpu走vDSO，开销很小
+    inline int currentNode() const
+    {
+        return nodeOf(sched_getcpu());
+    }
+
+private:
+    CpuTopology() : m_nodes(1)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        m_cpuNode.assign(cpus > 0 ? cpus : 1, 0);
+
+        //节点编号可能不连续（离线节点、只有内存的节点），按online列出的编号读取，
+        //不能从0开始数到第一个不存在的节点为止
+        std::vector<int> nodes;
+        if (!readList("/sys/devices/system/node/online", nodes))
+        {
+            return;
+        }
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            int node = nodes[i];
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            std::vector<int> list;
+            readList(path, list);
+            for (size_t j = 0; j < list.size(); j++)
+            {
+                int cpu = list[j];
+                if (cpu >= (int)m_cpuNode.size())
+                {
+                    m_cpuNode.resize(cpu + 1, 0);
+                }
+                m_cpuNode[cpu] = node;
+            }
+            //nodeCount是最大编号加一，调用者按节点编号下标访问
+            if (node + 1 > m_nodes)
+            {
+                m_nodes = node + 1;
+            }
+        }
+    }
+
+    //读取一个"0-3,8-11"格式的列表文件，文件不存在返回false
+    static bool readList(const char* path, std::vector<int>& out)
+    {
+        FILE* fp = fopen(path, "r");
+        if (fp == NULL)
+        {
+            return false;
+        }
+        char line[4096];
+        if (fgets(line, sizeof(line), fp) != NULL)
+        {
+            parseList(line, out);
+        }
+        fclose(fp);
+        return true;
+    }
+
+    //解析"0-3,8-11"格式的列表
+    static void parseList(const char* s, std::vector<int>& out)
+    {
+        while (*s != '\0' && *s != '\n')
+        {
+            char* end;
+            long first = strtol(s, &end, 10);
+            if (end == s)
+            {
+                break;
+            }
+            long last = first;
+            s = end;
+            if (*s == '-')
+            {
+                last = strtol(s + 1, &end, 10);
+                s = end;
+            }
+            for (long id = first; id <= last; id++)
+            {
+                out.push_back((int)id);
+            }
+            if (*s == ',')
+            {
+                s++;
+            }
+        }
+    }
+
+private:
+    std::vector<int> m_cpuNode;
+    int m_nodes;
+};
+
+#endif // _TOPOLOGY_H_
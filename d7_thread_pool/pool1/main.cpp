@@ -1,7 +1,8 @@
 /**
- * g++ -o thread_pool main.cpp condition.cpp threadpool.cpp -lpthread
+ * g++ -o thread_pool main.cpp threadpool.cpp taskalloc.cpp ../common/TaskGroup.h -lpthread
 */
 #include "threadpool.h"
+#include "../common/TaskGroup.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -21,18 +22,57 @@ void* mytask(void* arg)
 int main()
 {
     threadpool pool;
-    //初始化N个线程
-    threadpool_init(&pool, NUM_THREADS);
-    int i;
-    //创建N个任务
+    //初始化N个线程，预先创建1个常驻线程，空闲线程先轮询50us再睡眠
+    threadpool_options_t opts;
+    threadpool_options_default(&opts, NUM_THREADS);
+    opts.min_threads = 1;
+    opts.spin_us = 50;
+    threadpool_init_options(&pool, &opts);
+    //统计排队时间和执行时间
+    threadpool_set_metrics_timing(&pool, 1);
+    //创建N个任务，放在一个任务组里，之后可以单独等待这一批任务
+    TaskGroup<threadpool_t> group(pool);
     for (int i = 0; i < MAX_TASKS; i++)
     {
         int* arg = (int*)malloc(sizeof(int));
         *arg = i;
         //提交任务
-        threadpool_add_task(&pool, mytask, arg);
+        group.spawn([arg]() { mytask(arg); });
     }
 
+    //批量提交N个任务，整批只做一次原子交换
+    task_t batch[MAX_TASKS];
+    for (int i = 0; i < MAX_TASKS; i++)
+    {
+        int* arg = (int*)malloc(sizeof(int));
+        *arg = MAX_TASKS + i;
+        batch[i].run = mytask;
+        batch[i].arg = arg;
+    }
+    threadpool_add_tasks(&pool, batch, MAX_TASKS);
+
+    //高优先级任务不用排在前面的任务后面
+    int* urgent = (int*)malloc(sizeof(int));
+    *urgent = MAX_TASKS * 2;
+    threadpool_add_task_priority(&pool, mytask, urgent, PriorityHigh);
+
+    //延迟任务：2秒后放进任务队列，由定时器线程提交，不占用工作线程
+    int* delayed = (int*)malloc(sizeof(int));
+    *delayed = MAX_TASKS * 2 + 1;
+    threadpool_schedule_after(&pool, 2000, mytask, delayed);
+
+    //等待任务组里的任务执行完，当前线程也帮着执行，不需要销毁线程池
+    group.wait();
+    std::cout << "task group done" << std::endl;
+
+    //销毁前打印性能指标，销毁会等待所有任务执行完
+    sleep((MAX_TASKS * 2 + NUM_THREADS - 1) / NUM_THREADS + 1);
+    PoolMetricsSnapshot metrics;
+    threadpool_get_metrics(&pool, &metrics);
+    std::cout << "metrics: tasks=" << metrics.total.tasks << " parks=" << metrics.total.parks
+              << " queue wait p99(us)=" << metrics.queueWait.percentile(99) / 1000
+              << " run time p99(us)=" << metrics.runTime.percentile(99) / 1000 << std::endl;
+
     threadpool_destroy(&pool);
 
     return 0;
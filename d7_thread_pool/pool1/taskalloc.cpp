@@ -0,0 +1,339 @@
+#include "taskalloc.h"
+#include "threadpool.h"
+#include <stdlib.h>
+#include <atomic>
+#include <vector>
+
+//每个slab的节点数
+#define SLAB_NODES 64
+
+struct task_slab;
+
+//节点：任务后面跟着所属的slab
+typedef struct task_node
+{
+    task_t task;
+    struct task_slab* slab;
+}task_node_t;
+
+typedef struct task_slab
+{
+    struct task_cache* owner;
+    //所属缓存的全部slab链表
+    struct task_slab* prev;
+    struct task_slab* next;
+    //有空闲节点的slab链表
+    struct task_slab* partial_prev;
+    struct task_slab* partial_next;
+    int in_partial;
+    //空闲节点链表，复用task_t的next指针
+    task_t* free;
+    int free_count;
+    task_node_t nodes[SLAB_NODES];
+}task_slab_t;
+
+typedef struct task_cache
+{
+    task_allocator_t* alloc;
+    //所属线程，线程退出后alive为false，等待新线程接管
+    std::atomic<pthread_t> owner_tid;
+    std::atomic<bool> alive;
+    //其他线程归还的节点
+    std::atomic<task_t*> remote;
+    //以下只由所属线程访问
+    task_slab_t* slabs;
+    task_slab_t* partial;
+    int free_nodes;
+    struct task_cache* next;
+}task_cache_t;
+
+//线程持有的缓存，按分配器查找，线程退出时把缓存标记为无主
+struct cache_ref
+{
+    task_allocator_t* alloc;
+    unsigned long id;
+    task_cache_t* cache;
+};
+
+//还存活的分配器，线程退出时只处理仍然存活的分配器的缓存；对象故意不释放，
+//进程退出时仍在运行的线程可能晚于静态对象析构
+static pthread_mutex_t g_live_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<task_allocator_t*>* g_live = new std::vector<task_allocator_t*>();
+static std::atomic<unsigned long> g_next_id(1);
+
+struct thread_caches
+{
+    std::vector<cache_ref> refs;
+
+    ~thread_caches()
+    {
+        pthread_mutex_lock(&g_live_lock);
+        for (size_t i = 0; i < refs.size(); i++)
+        {
+            for (size_t j = 0; j < g_live->size(); j++)
+            {
+                if ((*g_live)[j] == refs[i].alloc && refs[i].alloc->id == refs[i].id)
+                {
+                    refs[i].cache->alive.store(false, std::memory_order_release);
+                    break;
+                }
+            }
+        }
+        pthread_mutex_unlock(&g_live_lock);
+    }
+};
+
+static thread_local thread_caches t_caches;
+
+//从有空闲节点的slab链表中移除
+static void partial_remove(task_cache_t* c, task_slab_t* s)
+{
+    if (s->partial_prev != NULL)
+    {
+        s->partial_prev->partial_next = s->partial_next;
+    }
+    else
+    {
+        c->partial = s->partial_next;
+    }
+    if (s->partial_next != NULL)
+    {
+        s->partial_next->partial_prev = s->partial_prev;
+    }
+    s->in_partial = 0;
+}
+
+//加入有空闲节点的slab链表头
+static void partial_add(task_cache_t* c, task_slab_t* s)
+{
+    s->partial_prev = NULL;
+    s->partial_next = c->partial;
+    if (c->partial != NULL)
+    {
+        c->partial->partial_prev = s;
+    }
+    c->partial = s;
+    s->in_partial = 1;
+}
+
+//新建一个slab，所有节点都串到空闲链表上
+static task_slab_t* slab_create(task_cache_t* c)
+{
+    task_slab_t* s = (task_slab_t*)malloc(sizeof(task_slab_t));
+    if (s == NULL)
+    {
+        return NULL;
+    }
+    s->owner = c;
+    s->free = NULL;
+    for (int i = SLAB_NODES - 1; i >= 0; i--)
+    {
+        s->nodes[i].slab = s;
+        s->nodes[i].task.next = s->free;
+        s->free = &s->nodes[i].task;
+    }
+    s->free_count = SLAB_NODES;
+    c->free_nodes += SLAB_NODES;
+
+    s->prev = NULL;
+    s->next = c->slabs;
+    if (c->slabs != NULL)
+    {
+        c->slabs->prev = s;
+    }
+    c->slabs = s;
+    partial_add(c, s);
+    return s;
+}
+
+//完全空闲的slab还给系统
+static void slab_release(task_cache_t* c, task_slab_t* s)
+{
+    partial_remove(c, s);
+    if (s->prev != NULL)
+    {
+        s->prev->next = s->next;
+    }
+    else
+    {
+        c->slabs = s->next;
+    }
+    if (s->next != NULL)
+    {
+        s->next->prev = s->prev;
+    }
+    c->free_nodes -= SLAB_NODES;
+    free(s);
+}
+
+//所属线程把节点还回slab
+static void local_free(task_cache_t* c, task_t* t)
+{
+    task_slab_t* s = ((task_node_t*)t)->slab;
+    t->next = s->free;
+    s->free = t;
+    s->free_count++;
+    c->free_nodes++;
+    if (!s->in_partial)
+    {
+        partial_add(c, s);
+    }
+    if (s->free_count == SLAB_NODES && c->free_nodes - SLAB_NODES >= c->alloc->max_cached)
+    {
+        slab_release(c, s);
+    }
+}
+
+//一次取走其他线程归还的全部节点
+static void drain_remote(task_cache_t* c)
+{
+    task_t* t = c->remote.exchange(NULL, std::memory_order_acquire);
+    while (t != NULL)
+    {
+        task_t* next = t->next;
+        local_free(c, t);
+        t = next;
+    }
+}
+
+//查找当前线程在该分配器上的缓存，第一次使用时接管无主的缓存或者新建一个
+static task_cache_t* get_cache(task_allocator_t* alloc)
+{
+    std::vector<cache_ref>& refs = t_caches.refs;
+    for (size_t i = 0; i < refs.size(); i++)
+    {
+        if (refs[i].alloc == alloc && refs[i].id == alloc->id)
+        {
+            return refs[i].cache;
+        }
+    }
+
+    task_cache_t* c = NULL;
+    pthread_mutex_lock(&alloc->lock);
+    for (task_cache_t* it = alloc->caches; it != NULL; it = it->next)
+    {
+        if (!it->alive.load(std::memory_order_acquire))
+        {
+            c = it;
+            break;
+        }
+    }
+    if (c == NULL)
+    {
+        c = new task_cache_t();
+        c->alloc = alloc;
+        c->remote.store(NULL);
+        c->slabs = NULL;
+        c->partial = NULL;
+        c->free_nodes = 0;
+        c->next = alloc->caches;
+        alloc->caches = c;
+    }
+    //先写所属线程再标记存活，释放节点的线程先读alive再读owner_tid
+    c->owner_tid.store(pthread_self(), std::memory_order_relaxed);
+    c->alive.store(true, std::memory_order_release);
+    pthread_mutex_unlock(&alloc->lock);
+
+    //清掉同一地址上已经销毁的分配器留下的记录
+    for (size_t i = 0; i < refs.size(); )
+    {
+        if (refs[i].alloc == alloc)
+        {
+            refs[i] = refs.back();
+            refs.pop_back();
+        }
+        else
+        {
+            i++;
+        }
+    }
+    cache_ref ref = { alloc, alloc->id, c };
+    refs.push_back(ref);
+    return c;
+}
+
+void task_allocator_init(task_allocator_t* alloc, int max_cached)
+{
+    pthread_mutex_init(&alloc->lock, NULL);
+    alloc->caches = NULL;
+    alloc->max_cached = max_cached;
+    alloc->id = g_next_id.fetch_add(1);
+
+    pthread_mutex_lock(&g_live_lock);
+    g_live->push_back(alloc);
+    pthread_mutex_unlock(&g_live_lock);
+}
+
+task_t* task_allocator_alloc(task_allocator_t* alloc)
+{
+    task_cache_t* c = get_cache(alloc);
+    if (c->partial == NULL)
+    {
+        drain_remote(c);
+    }
+    if (c->partial == NULL && slab_create(c) == NULL)
+    {
+        return NULL;
+    }
+
+    task_slab_t* s = c->partial;
+    task_t* t = s->free;
+    s->free = t->next;
+    s->free_count--;
+    c->free_nodes--;
+    if (s->free == NULL)
+    {
+        partial_remove(c, s);
+    }
+    return t;
+}
+
+void task_allocator_free(task_t* t)
+{
+    task_cache_t* c = ((task_node_t*)t)->slab->owner;
+    if (c->alive.load(std::memory_order_acquire)
+        && pthread_equal(c->owner_tid.load(std::memory_order_relaxed), pthread_self()))
+    {
+        local_free(c, t);
+        return;
+    }
+
+    //压入所属缓存的归还栈，所属线程一次取走整个栈，不存在ABA问题
+    task_t* head = c->remote.load(std::memory_order_relaxed);
+    do
+    {
+        t->next = head;
+    } while (!c->remote.compare_exchange_weak(head, t, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void task_allocator_destroy(task_allocator_t* alloc)
+{
+    pthread_mutex_lock(&g_live_lock);
+    for (size_t i = 0; i < g_live->size(); i++)
+    {
+        if ((*g_live)[i] == alloc)
+        {
+            (*g_live)[i] = g_live->back();
+            g_live->pop_back();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_live_lock);
+
+    task_cache_t* c = alloc->caches;
+    while (c != NULL)
+    {
+        task_slab_t* s = c->slabs;
+        while (s != NULL)
+        {
+            task_slab_t* next = s->next;
+            free(s);
+            s = next;
+        }
+        task_cache_t* next = c->next;
+        delete c;
+        c = next;
+    }
+    alloc->caches = NULL;
+    pthread_mutex_destroy(&alloc->lock);
+}
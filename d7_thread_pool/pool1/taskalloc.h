@@ -0,0 +1,38 @@
+#ifndef _TASK_ALLOC_H_
+#define _TASK_ALLOC_H_
+
+#include <pthread.h>
+
+struct task;
+struct task_cache;
+
+/**
+ * task_t节点分配器
+ *
+ * 提交任务的线程malloc节点，工作线程free节点，跨线程释放是glibc内存分配最差的情况。
+ * 这里每个提交任务的线程一个缓存，缓存从slab（一次分配64个节点）里切节点：
+ * 1、申请：从本线程缓存的slab里取，稳定运行后不再调用malloc
+ * 2、同一线程释放：直接还回所属的slab
+ * 3、其他线程释放：无锁地压入所属缓存的归还栈，所属线程下次申请时一次取走整个栈
+ * 4、缓存的空闲节点超过max_cached时，完全空闲的slab还给系统，限制常驻内存
+ *
+ * 线程退出后它的缓存留给之后的新线程复用。
+*/
+typedef struct task_allocator
+{
+    pthread_mutex_t lock;           //保护caches链表
+    struct task_cache* caches;      //所有线程缓存
+    int max_cached;                 //每个线程缓存最多保留的空闲节点数
+    unsigned long id;               //分配器编号，区分先后分配在同一地址上的分配器
+}task_allocator_t;
+
+//初始化
+void task_allocator_init(task_allocator_t* alloc, int max_cached);
+//申请一个节点
+struct task* task_allocator_alloc(task_allocator_t* alloc);
+//释放一个节点，可以在任意线程调用
+void task_allocator_free(struct task* t);
+//销毁，释放所有slab，调用前所有节点都已经不再使用
+void task_allocator_destroy(task_allocator_t* alloc);
+
+#endif // _TASK_ALLOC_H_
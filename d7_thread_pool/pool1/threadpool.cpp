@@ -1,182 +1,506 @@
 #include "threadpool.h"
+#include "../common/AsyncLog.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
-#include <iostream>
+#include <sched.h>
+
+//忙等待时降低功耗
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+static inline long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//生产者已经把任务压到栈顶、还没补上next时，next的临时值
+#define TASK_PENDING ((task_t*)1)
+
+//获取消费锁，持有时间只是摘链表和出队几条指令；抢不到的线程先短暂自旋再在futex上睡眠，
+//持有者被换出CPU（或者在等生产者补next）时不会有一群线程陪着空转
+static inline void consumer_lock(threadpool_t* pool)
+{
+    pool->consuming.lock();
+}
+
+static inline void consumer_unlock(threadpool_t* pool)
+{
+    pool->consuming.unlock();
+}
+
+//把一串任务压到对应优先级的提交栈，top是最后提交的任务，沿next到bottom，bottom是最先提交的任务，
+//只有一次exchange，不需要加锁也没有重试
+static void queue_push(threadpool_t* pool, task_t* top, task_t* bottom, int n, int priority)
+{
+    bottom->next = TASK_PENDING;
+    task_t* prev = pool->inbox[priority].exchange(top, std::memory_order_acq_rel);
+    __atomic_store_n(&bottom->next, prev, __ATOMIC_RELEASE);
+    //先加任务数再检查睡眠线程数，和睡眠线程的先登记再检查任务数配对
+    pool->task_count.fetch_add(n);
+}
+
+//摘下一个优先级的整个提交栈，反转成提交顺序接到本地链表尾，调用前需持有消费锁
+static void queue_drain(threadpool_t* pool, int priority)
+{
+    task_t* top = pool->inbox[priority].exchange(NULL, std::memory_order_acquire);
+    task_t* head = NULL;
+    task_t* t = top;
+    while (t != NULL)
+    {
+        //生产者交换完栈顶还没补上next，等它写完
+        task_t* next;
+        int spins = 0;
+        while ((next = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE)) == TASK_PENDING)
+        {
+            if (++spins < 128)
+            {
+                cpu_relax();
+            }
+            else
+            {
+                sched_yield();
+            }
+        }
+        t->next = head;
+        head = t;
+        t = next;
+    }
+    if (head == NULL)
+    {
+        return;
+    }
+
+    if (pool->first[priority] == NULL)
+    {
+        pool->first[priority] = head;
+    }
+    else
+    {
+        pool->last[priority]->next = head;
+    }
+    pool->last[priority] = top;
+    pool->ready_mask |= 1u << priority;
+}
+
+//取出最高的非空优先级（考虑老化）的第一个任务，没有任务时返回NULL
+static task_t* queue_pop(threadpool_t* pool)
+{
+    //没有任务时不去争抢消费锁
+    if (pool->task_count.load(std::memory_order_acquire) <= 0)
+    {
+        return NULL;
+    }
+
+    consumer_lock(pool);
+    //本地链表非空或者提交栈非空的优先级
+    unsigned int mask = pool->ready_mask;
+    for (int i = 0; i < PriorityLevels; i++)
+    {
+        if (pool->inbox[i].load(std::memory_order_relaxed) != NULL)
+        {
+            mask |= 1u << i;
+        }
+    }
+
+    task_t* t = NULL;
+    if (mask != 0)
+    {
+        int priority = pool->picker.pick(mask);
+        //本地链表取空了才摘提交栈，一次摘下整批
+        if (pool->first[priority] == NULL)
+        {
+            queue_drain(pool, priority);
+        }
+        t = pool->first[priority];
+        pool->first[priority] = t->next;
+        if (pool->first[priority] == NULL)
+        {
+            pool->last[priority] = NULL;
+            pool->ready_mask &= ~(1u << priority);
+        }
+        pool->task_count.fetch_sub(1, std::memory_order_relaxed);
+    }
+    consumer_unlock(pool);
+    return t;
+}
+
+//不加锁轮询最多us微秒，等到任务或者线程池销毁返回1
+static int spin_wait(threadpool_t* pool, int us)
+{
+    long long deadline = now_us() + us;
+    do
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            if (pool->task_count.load(std::memory_order_acquire) > 0 || pool->quit.load(std::memory_order_relaxed))
+            {
+                return 1;
+            }
+            cpu_relax();
+        }
+    } while (now_us() < deadline);
+    return 0;
+}
+
+void* thread_routine(void* arg);
+
+//线程数减1，最后一个线程通知销毁线程池的线程；之后不能再访问pool，它可能已经被释放
+static void thread_exit(threadpool_t* pool)
+{
+    if (pool->counter.fetch_sub(1) == 1)
+    {
+        futexWake(&pool->counter, 1);
+    }
+}
+
+//创建一个工作线程，调用前已经把counter加1占住名额，失败时撤销
+static void spawn_worker(threadpool_t* pool)
+{
+    pthread_t pid;
+    if (pthread_create(&pid, NULL, thread_routine, pool) != 0)
+    {
+        thread_exit(pool);
+        return;
+    }
+    //线程自己退出，不需要回收
+    pthread_detach(pid);
+}
+
+//没有任务时睡眠，有任务或者线程池销毁时返回1，超时返回0
+static int worker_sleep(threadpool_t* pool, WorkerMetrics& metrics)
+{
+    //先登记再检查任务数，和提交者的先加任务数再通知配对，不会漏掉唤醒
+    pool->ready.prepareWait();
+    if (pool->task_count.load() > 0 || pool->quit.load())
+    {
+        pool->ready.cancelWait();
+        return 1;
+    }
+
+    //否则线程阻塞等地啊
+    LOG_DEBUG("thread tid:{} is waiting", pthread_self());
+    metrics.onPark();
+    bool notified = pool->ready.wait((int64_t)pool->idle_timeout_ms * 1000000);
+    metrics.onUnpark();
+    if (!notified)
+    {
+        LOG_DEBUG("thread tid:{} time out", pthread_self());
+    }
+    return notified || pool->task_count.load() > 0;
+}
 
 //线程创建函数
 void* thread_routine(void* arg)
 {
-    struct timespec abstime;
-    int timeout;
-    std::cout << "thread tid:" << pthread_self() << " starting" << std::endl;
+    LOG_DEBUG("thread tid:{} starting", pthread_self());
     threadpool_t* pool = (threadpool_t*)arg;
+    //线程数不超过max_threads，一般一次就能拿到槽位；常驻线程超时后会短暂归还槽位
+    int slot;
+    while ((slot = pool->metrics->acquireSlot()) < 0)
+    {
+        sched_yield();
+    }
+    WorkerMetrics* metrics = &pool->metrics->worker(slot);
+    //本线程当前的轮询时间，在[spin_us/8, spin_us]之间自适应
+    int spin_budget = pool->spin_us;
 
     while(1)
     {
-        timeout = 0;
-        //访问线程池之前加锁
-        condition_lock(&pool->ready);
-
-        //空闲线程加1
-        pool->idle ++;
-        
-        //等待队列有任务到来或者线程池销毁通知
-        while(pool->first == NULL && !pool->quit)
-        {
-            //否则线程阻塞等地啊
-            std::cout << "thread tid:" << pthread_self() << " is waiting" << std::endl;
-            //获取当前时间，并加上等待时间，设置线程的超市睡眠时间
-            clock_gettime(CLOCK_REALTIME, &abstime);
-            abstime.tv_sec += 2;
-            int status;
-            //该函数会解锁，允许其他线程访问，当被唤醒时，加锁
-            status = condition_timedwait(&pool->ready, &abstime);
-            if (status == ETIMEDOUT)
+        task_t* t = queue_pop(pool);
+        if (t != NULL)
+        {
+            //执行任务
+            uint64_t start = pool->metrics->stamp();
+            t->run(t->arg);
+            metrics->onTask(t->enqueue_ns, start, start != 0 ? metricsNowNs() : 0);
+            //执行完把节点还给分配器
+            task_allocator_free(t);
+            continue;
+        }
+
+        //没有任务了才退出线程池
+        if (pool->quit.load())
+        {
+            //先归还槽位再减少线程数，销毁时所有线程都不再访问指标
+            pool->metrics->releaseSlot(slot);
+            //当前工作线程--，如果线程池中没有线程，通知等待的线程(主线程) 全部任务已经完成
+            thread_exit(pool);
+            break;
+        }
+
+        //空闲线程加1，轮询中的线程也算空闲，提交任务时不会为它再创建线程
+        pool->idle.fetch_add(1);
+        int awake = 1;
+        //先不加锁轮询一会，任务很快到来时省掉一次睡眠和唤醒
+        if (spin_budget > 0 && spin_wait(pool, spin_budget))
+        {
+            spin_budget = spin_budget * 2 < pool->spin_us ? spin_budget * 2 : pool->spin_us;
+        }
+        else
+        {
+            if (spin_budget > 0)
             {
-                std::cout << "thread tid:" << pthread_self() << " time out" << std::endl;
-                timeout = 1;
-                break;
+                int floor = pool->spin_us / 8 > 0 ? pool->spin_us / 8 : 1;
+                spin_budget = spin_budget / 2 > floor ? spin_budget / 2 : floor;
             }
+            awake = worker_sleep(pool, *metrics);
         }
-
         //线程被唤醒，空闲线程--
-        pool->idle --;
-        
-        if (pool->first != NULL)
-        {
-            //取出队列最前的任务，移除任务并执行
-            task_t* t = pool->first;
-            pool->first = t->next;
-            //由于线程任务的执行需要时间，先解锁让其他线程访问线程池
-            condition_unlock(&pool->ready);
-            //执行任务
-            t->run(t->arg);
-            //执行完释放内存
-            free(t);
-            //重新加锁
-            condition_lock(&pool->ready);
-        }
-        
-        //退出线程池
-        if (pool->quit && pool->first == NULL)
-        {
-            //当前工作线程--
-            pool->counter --;
-            //如果线程池中没有线程，通知等待的线程(主线程) 全部任务已经完成
-            if (pool->counter == 0)
+        pool->idle.fetch_sub(1);
+        //超时醒来到减空闲数之间，提交者可能已经把本线程算作空闲而没有创建新线程，通知也落了空；
+        //先减空闲数再检查任务数，和提交者的先加任务数再读空闲数配对，两边至少有一边看到对方
+        if (awake || pool->task_count.load() > 0 || pool->quit.load())
+        {
+            continue;
+        }
+
+        //超时退出，常驻线程继续等待；先归还槽位再减少线程数，减少之后不能再访问pool
+        pool->metrics->releaseSlot(slot);
+        int min_threads = pool->min_threads;
+        int c = pool->counter.load();
+        while (c > min_threads && !pool->counter.compare_exchange_weak(c, c - 1))
+        {
+        }
+        if (c > min_threads)
+        {
+            if (c == 1)
             {
-                condition_signal(&pool->ready);
+                futexWake(&pool->counter, 1);
             }
-            condition_unlock(&pool->ready);
             break;
         }
-        
-        //超时退出
-        if (timeout == 1)
+        while ((slot = pool->metrics->acquireSlot()) < 0)
         {
-            pool->counter --;
-            condition_unlock(&pool->ready);
-            break;
+            sched_yield();
         }
-        
-        condition_unlock(&pool->ready);
+        metrics = &pool->metrics->worker(slot);
     }
 
-    std::cout << "thread tid:" << pthread_self() << " is exiting" << std::endl;
+    LOG_DEBUG("thread tid:{} is exiting", pthread_self());
 
     return NULL;    
 }
 
+//默认参数
+void threadpool_options_default(threadpool_options_t* opts, int threads)
+{
+    opts->min_threads = 0;
+    opts->max_threads = threads;
+    opts->idle_timeout_ms = 2000;
+    opts->spin_us = 0;
+}
+
 //线程池初始化
 void threadpool_init(threadpool_t* pool, int threads)
 {
-    condition_init(&pool->ready);
-    pool->first = NULL;
-    pool->last = NULL;
-    pool->counter = 0;
-    pool->idle = 0;
+    threadpool_options_t opts;
+    threadpool_options_default(&opts, threads);
+    threadpool_init_options(pool, &opts);
+}
+
+//按参数初始化线程池
+void threadpool_init_options(threadpool_t* pool, const threadpool_options_t* opts)
+{
+    int threads = opts->max_threads;
+    for (int i = 0; i < PriorityLevels; i++)
+    {
+        pool->inbox[i].store(NULL);
+        pool->first[i] = NULL;
+        pool->last[i] = NULL;
+    }
+    pool->ready_mask = 0;
+    pool->task_count.store(0);
+    pool->counter.store(0);
+    pool->idle.store(0);
+    pool->min_threads = opts->min_threads < threads ? opts->min_threads : threads;
     pool->max_threads = threads;
-    pool->quit = 0;
+    pool->idle_timeout_ms = opts->idle_timeout_ms;
+    pool->spin_us = opts->spin_us;
+    pool->quit.store(0);
+    pool->metrics = new PoolMetrics(threads);
+    task_allocator_init(&pool->allocator, TASK_CACHE_MAX_NODES);
+    //同一个tick到期的定时任务整批提交，只做一次原子交换
+    pool->timers = new TimerWheel<timer_task_t>([pool](std::vector<timer_task_t>& batch)
+    {
+        std::vector<task_t> tasks(batch.size());
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            tasks[i].run = batch[i].run;
+            tasks[i].arg = batch[i].arg;
+        }
+        threadpool_add_tasks(pool, tasks.data(), (int)tasks.size());
+    });
+
+    //预先创建常驻线程，突发流量到来时不用在提交路径上创建线程
+    pool->counter.store(pool->min_threads);
+    for (int i = 0; i < pool->min_threads; i++)
+    {
+        spawn_worker(pool);
+    }
 }
 
-//添加任务到线程池
+//添加普通优先级的任务到线程池
 void threadpool_add_task(threadpool_t* pool, void*(*run)(void* arg), void* arg)
 {
-    //产生一个新任务
-    task_t* newtask = (task_t*)malloc(sizeof(task_t));
+    threadpool_add_task_priority(pool, run, arg, PriorityNormal);
+}
+
+//提交n个任务后唤醒睡眠的线程，空闲线程不够时创建新线程
+static void wake_workers(threadpool_t* pool, int n)
+{
+    //没有线程睡眠时只是一次读，不加锁也不进内核；最多唤醒n个，每个都是确定的一个线程
+    pool->ready.notify(n);
+
+    //空闲线程不够，占住名额创建新线程处理剩下的任务，不超过最大线程数；
+    //空闲数要在加任务数之后顺序一致地读，正在超时退出的线程要么被算作不空闲，要么自己看到任务
+    int need = n - pool->idle.load();
+    int spawn = 0;
+    int c = pool->counter.load(std::memory_order_relaxed);
+    while (spawn < need && c < pool->max_threads)
+    {
+        if (pool->counter.compare_exchange_weak(c, c + 1))
+        {
+            spawn ++;
+            c ++;
+        }
+    }
+
+    //名额已经用CAS占好，不用加锁直接创建
+    for (int i = 0; i < spawn; i++)
+    {
+        spawn_worker(pool);
+    }
+}
+
+//添加任务到线程池
+void threadpool_add_task_priority(threadpool_t* pool, void*(*run)(void* arg), void* arg, int priority)
+{
+    priority = clampPriority(priority);
+    //产生一个新任务，稳定运行后节点都来自本线程的缓存，不再调用malloc
+    task_t* newtask = task_allocator_alloc(&pool->allocator);
     newtask->run = run;
     newtask->arg = arg;
-    //新任务放入队尾
-    newtask->next = NULL;
+    newtask->enqueue_ns = pool->metrics->stamp();
 
-    //线程池锁被多个线程共享，添加任务前加锁
-    condition_lock(&pool->ready);
+    //压到对应优先级的提交栈，不加锁
+    queue_push(pool, newtask, newtask, 1, priority);
 
-    //第一个任务
-    if (pool->first == NULL)
+    wake_workers(pool, 1);
+}
+
+//批量添加普通优先级的任务到线程池
+void threadpool_add_tasks(threadpool_t* pool, const task_t* tasks, int n)
+{
+    threadpool_add_tasks_priority(pool, tasks, n, PriorityNormal);
+}
+
+//批量添加任务到线程池
+void threadpool_add_tasks_priority(threadpool_t* pool, const task_t* tasks, int n, int priority)
+{
+    priority = clampPriority(priority);
+    if (n <= 0)
     {
-        pool->first = newtask;
+        return;
     }
-    else
+
+    //把整批任务串成栈的顺序，后面的任务在上面
+    task_t* top = NULL;
+    task_t* bottom = NULL;
+    uint64_t stamp = pool->metrics->stamp();
+    for (int i = 0; i < n; i++)
     {
-        //添加队尾
-        pool->last->next = newtask;
+        task_t* newtask = task_allocator_alloc(&pool->allocator);
+        newtask->run = tasks[i].run;
+        newtask->arg = tasks[i].arg;
+        newtask->enqueue_ns = stamp;
+        newtask->next = top;
+        if (bottom == NULL)
+        {
+            bottom = newtask;
+        }
+        top = newtask;
     }
-    
-    //队尾指向最新的任务
-    pool->last = newtask;
 
-    //唤醒线程池中空闲线程
-    if (pool->idle > 0)
+    //整批只做一次exchange
+    queue_push(pool, top, bottom, n, priority);
+
+    wake_workers(pool, n);
+}
+
+//延迟任务
+TimerId threadpool_schedule_after(threadpool_t* pool, int64_t delay_ms, void*(*run)(void* arg), void* arg)
+{
+    if (pool->quit.load())
     {
-        condition_signal(&pool->ready);
+        return 0;
     }
-    //线程池中线程个数没达到最大，创建一个新线程
-    else if(pool->counter < pool->max_threads)
+    timer_task_t task = { run, arg };
+    return pool->timers->addAfter(delay_ms * 1000000, task);
+}
+
+//周期任务
+TimerId threadpool_schedule_every(threadpool_t* pool, int64_t period_ms, void*(*run)(void* arg), void* arg)
+{
+    if (pool->quit.load())
     {
-        pthread_t pid;
-        pthread_create(&pid, NULL, thread_routine, pool);
-        pool->counter ++;
+        return 0;
     }
-    
-    //结束访问
-    condition_unlock(&pool->ready);
+    timer_task_t task = { run, arg };
+    return pool->timers->addEvery(period_ms * 1000000, task);
+}
+
+int threadpool_cancel_timer(threadpool_t* pool, TimerId id)
+{
+    return pool->timers->cancel(id) ? 1 : 0;
+}
+
+//读取性能指标快照，不需要加锁
+void threadpool_get_metrics(threadpool_t* pool, PoolMetricsSnapshot* snapshot)
+{
+    *snapshot = pool->metrics->snapshot();
+}
+
+void threadpool_set_metrics_timing(threadpool_t* pool, int enable)
+{
+    pool->metrics->setTiming(enable != 0);
 }
 
 //线程池销毁
 void threadpool_destroy(threadpool_t* pool)
 {
     //如果已经调用销毁，直接返回
-    if (pool->quit)
+    if (pool->quit.load())
     {
         return;
     }
 
-    //加锁
-    condition_lock(&pool->ready);
-    //设置销毁标志
-    pool->quit = 1;
-
-    //线程池个数大于0
-    if(pool->counter > 0)
-    {
-        //对于等待的线程，发送信号唤醒
-        if (pool->idle > 0)
-        {
-            condition_broadcast(&pool->ready);
+    //先停掉定时器线程，之后不会再有定时任务提交进来
+    delete pool->timers;
+    pool->timers = NULL;
 
-        }
+    //设置销毁标志，唤醒所有睡眠的线程
+    pool->quit.store(1);
+    pool->ready.notifyAll();
 
-        //等待执行任务的线程结束任务
-        while(pool->counter)
-        {
-            condition_wait(&pool->ready);
-        }
+    //等待执行任务的线程执行完剩下的任务后退出，最后一个线程退出时唤醒这里
+    int c;
+    while ((c = pool->counter.load()) != 0)
+    {
+        futexWait(&pool->counter, (uint32_t)c, NULL);
     }
 
-    condition_unlock(&pool->ready);
-    condition_destroy(&pool->ready);
+    delete pool->metrics;
+    pool->metrics = NULL;
+    task_allocator_destroy(&pool->allocator);
 }
\ No newline at end of file
@@ -1,7 +1,13 @@
-#ifndef _THREAD_POOL_H_
-#define _THREAD_POOL_H_
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
 
-#include "condition.h"
+#include "taskalloc.h"
+#include "../common/PoolMetrics.h"
+#include "../common/Priority.h"
+#include "../common/EventCount.h"
+#include "../common/Locks.h"
+#include "../common/TimerWheel.h"
+#include <atomic>
 
 //封装线程池中的对象需要执行的任务对象
 typedef struct task
@@ -12,30 +18,101 @@ typedef struct task
     void* arg;
     //下一个任务
     struct task* next;
+    //入队时间，打开计时统计时由线程池填写
+    uint64_t enqueue_ns;
 }task_t;
 
+//定时任务，到期时作为普通优先级的任务放进任务队列
+typedef struct timer_task
+{
+    void*(*run)(void* args);
+    void* arg;
+}timer_task_t;
+
 //线程池结构体
+/**
+ * 任务提交是无锁的（参考Vyukov的侵入式MPSC队列），复用task_t的next指针，不额外分配内存：
+ * 1、提交：每个优先级一个提交栈，生产者一次exchange把任务（或整批任务）压到栈顶，再补上next，
+ *    没有循环重试，提交是wait-free的
+ * 2、取任务：同一时刻只有持有消费锁的工作线程取任务，本地链表取空时用一次exchange摘下整个
+ *    提交栈，反转成提交顺序接到本地链表后面，之后逐个出队
+ * 3、睡眠：空闲线程在事件计数上睡眠，生产者发现有线程在睡眠时才进内核唤醒其中一个
+*/
 typedef struct threadpool
 {
-    condition_t ready;       //状态量
-    task_t* first;          //任务队列第一个任务
-    task_t* last;           //任务队列最后一个任务
-    int counter;            //线程池中已有线程数
-    int idle;               //线程池中的空闲线程数
+    EventCount ready;        //空闲线程在这里睡眠
+    std::atomic<task_t*> inbox[PriorityLevels];     //每个优先级的提交栈，后提交的在栈顶
+    AdaptiveMutex consuming;        //消费锁，持有者才能访问下面的本地链表，抢不到时睡眠而不是空转
+    task_t* first[PriorityLevels];  //每个优先级已摘下任务的第一个任务，按提交顺序排列
+    task_t* last[PriorityLevels];   //每个优先级已摘下任务的最后一个任务
+    unsigned int ready_mask;        //本地链表非空的优先级位图
+    PriorityPicker picker;          //按优先级出队，低优先级老化
+    std::atomic<int> task_count;    //排队的任务数，提交后增加，取出后减少，短时间内可能为负
+    std::atomic<int> counter;       //线程池中已有线程数（包括正在创建的），销毁时在它上面futex等待
+    std::atomic<int> idle;          //线程池中的空闲线程数（轮询和睡眠的）
+    int min_threads;        //常驻线程数，空闲也不退出
     int max_threads;        //线程池中最大线程数
-    int quit;               //线程池退出标志
+    int idle_timeout_ms;    //多于常驻数的线程空闲超过该时间退出
+    int spin_us;            //睡眠前最多轮询等待的时间
+    std::atomic<int> quit;  //线程池退出标志
+    PoolMetrics* metrics;   //性能指标，每个线程占用一个槽位
+    task_allocator_t allocator;     //任务节点分配器
+    TimerWheel<timer_task_t>* timers;   //延迟任务和周期任务，第一次使用时才创建定时器线程
 }threadpool_t;
 
+//每个提交线程最多缓存的空闲任务节点数
+#define TASK_CACHE_MAX_NODES 4096
+
+//线程池参数
+typedef struct threadpool_options
+{
+    int min_threads;        //常驻线程数，初始化时创建好，空闲也不退出
+    int max_threads;        //最大线程数
+    int idle_timeout_ms;    //多于常驻数的线程空闲超过该时间退出
+    int spin_us;            //没有任务时先不加锁轮询的最长时间，0表示直接睡眠；
+                            //实际轮询时间自适应：轮询等到任务就加倍，没等到就减半
+}threadpool_options_t;
+
+//默认参数：不预先创建线程，空闲2秒退出，不轮询
+void threadpool_options_default(threadpool_options_t* opts, int threads);
+
 //线程池初始化
 void threadpool_init(threadpool_t* pool, int threads);
 
-//往线程池中添加任务
+//按参数初始化线程池
+void threadpool_init_options(threadpool_t* pool, const threadpool_options_t* opts);
+
+//往线程池中添加普通优先级的任务
 void threadpool_add_task(threadpool_t* pool, void*(*run)(void* arg), void* arg);
 
+//往线程池中添加任务，priority为TaskPriority，高优先级先执行，低优先级有老化不会饿死
+void threadpool_add_task_priority(threadpool_t* pool, void*(*run)(void* arg), void* arg, int priority);
+
+//往线程池中批量添加普通优先级的任务，只使用tasks中的run和arg，整批只做一次原子交换
+void threadpool_add_tasks(threadpool_t* pool, const task_t* tasks, int n);
+
+//往线程池中批量添加同一优先级的任务
+void threadpool_add_tasks_priority(threadpool_t* pool, const task_t* tasks, int n, int priority);
+
+//delay_ms毫秒后把任务放进任务队列，返回定时器编号，线程池已经销毁或创建定时器线程失败返回0
+TimerId threadpool_schedule_after(threadpool_t* pool, int64_t delay_ms, void*(*run)(void* arg), void* arg);
+
+//每隔period_ms毫秒把任务放进任务队列一次；任务执行得比周期慢时会有多次同时执行，arg要能并发使用
+TimerId threadpool_schedule_every(threadpool_t* pool, int64_t period_ms, void*(*run)(void* arg), void* arg);
+
+//取消定时任务，还没到期返回1，否则返回0；已经放进任务队列的那一次不受影响
+int threadpool_cancel_timer(threadpool_t* pool, TimerId id);
+
+//读取性能指标快照
+void threadpool_get_metrics(threadpool_t* pool, PoolMetricsSnapshot* snapshot);
+
+//是否统计排队时间和执行时间
+void threadpool_set_metrics_timing(threadpool_t* pool, int enable);
+
 //销毁线程池
 void threadpool_destroy(threadpool_t* pool);
 
 
 
 
-#endif // _THREAD_POOL_H_
\ No newline at end of file
+#endif // _THREADPOOL_H_
\ No newline at end of file
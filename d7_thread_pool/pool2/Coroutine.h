@@ -0,0 +1,774 @@
+#ifndef _COROUTINE_H_
+#define _COROUTINE_H_
+
+#include "ThreadPool.h"
+#include <coroutine>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * 基于C++20协程的线程池执行器，需要 -std=c++20
+ *
+ * 普通任务一旦阻塞等待（I/O、另一个任务的结果）就占住一个工作线程，协程在等待时挂起，
+ * 工作线程可以去执行别的任务，少量工作线程就能同时推进成千上万个请求流程：
+ *
+ *     CoTask<int> handle(ThreadPool& pool)
+ *     {
+ *         co_await pool.schedule();                       //切到线程池上执行
+ *         auto [a, b] = co_await when_all(load(1), load(2));  //并发执行两个子任务
+ *         co_await coSleep(pool, 10);                     //挂起10毫秒，不占用线程
+ *         co_return a + b;
+ *     }
+ *     Future<int> result = coSpawn(pool, handle(pool));
+ *
+ * 1、CoTask<T>是惰性的，被co_await时才开始执行，执行完成后通过对称转移直接切回等待者，
+ *    长的co_await链不会加深调用栈，也不经过任务队列
+ * 2、pool.schedule()把协程的恢复作为一个普通任务投递到线程池，在工作线程内部投递时
+ *    进入本线程的本地队列（工作窃取模式）
+ * 3、when_all在当前线程上依次启动各个子任务，子任务挂起后继续启动下一个，
+ *    最后一个完成的子任务直接恢复等待者；任一子任务抛出的异常在全部完成后重新抛出
+ * 4、可以直接co_await一个Future，结果就绪后在线程池上恢复
+ * 5、协程帧从按线程缓存的分配器分配（CoFrameAllocator），工作线程上结束的协程把帧还给
+ *    本线程，之后在这个线程上创建的协程直接复用，稳定运行后不再调用malloc
+ *
+ * 线程池关闭后投递的恢复任务会被丢弃：schedule和coSleep在co_await处抛出runtime_error，
+ * 沿调用链传到coSpawn的Future；co_await Future在完成结果的线程上直接恢复。协程帧都会正常销毁，
+ * 但丢弃发生在线程池析构的过程中，之后协程不应再使用这个线程池，销毁前最好等所有协程结束。
+*/
+
+//协程帧分配器，每个线程按64字节分档缓存空闲帧
+class CoFrameAllocator
+{
+public:
+    static void* allocate(size_t size)
+    {
+        size_t cls = (size + Granularity - 1) / Granularity;
+        if (cls == 0 || cls > Classes)
+        {
+            return ::operator new(size);
+        }
+        Cache& cache = localCache();
+        Block* block = cache.head[cls - 1];
+        if (block != nullptr)
+        {
+            cache.head[cls - 1] = block->next;
+            cache.count[cls - 1]--;
+            return block;
+        }
+        return ::operator new(cls * Granularity);
+    }
+
+    static void deallocate(void* p, size_t size)
+    {
+        size_t cls = (size + Granularity - 1) / Granularity;
+        if (cls == 0 || cls > Classes)
+        {
+            ::operator delete(p);
+            return;
+        }
+        //在提交线程上创建、在工作线程上结束的帧会不断流向工作线程，超出上限直接释放
+        Cache& cache = localCache();
+        if (cache.count[cls - 1] >= MaxCached)
+        {
+            ::operator delete(p);
+            return;
+        }
+        Block* block = static_cast<Block*>(p);
+        block->next = cache.head[cls - 1];
+        cache.head[cls - 1] = block;
+        cache.count[cls - 1]++;
+    }
+
+private:
+    enum
+    {
+        Granularity = 64,       //分档粒度
+        Classes = 16,           //最多缓存1KB的帧，更大的帧直接走operator new
+        MaxCached = 256         //每个线程每档最多缓存的帧数
+    };
+
+    struct Block
+    {
+        Block* next;
+    };
+
+    struct Cache
+    {
+        Block* head[Classes] = {};
+        int count[Classes] = {};
+
+        ~Cache()
+        {
+            for (int i = 0; i < Classes; i++)
+            {
+                while (head[i] != nullptr)
+                {
+                    Block* next = head[i]->next;
+                    ::operator delete(head[i]);
+                    head[i] = next;
+                }
+            }
+        }
+    };
+
+    static Cache& localCache()
+    {
+        static thread_local Cache cache;
+        return cache;
+    }
+};
+
+//协程帧都从CoFrameAllocator分配
+struct CoFramePromise
+{
+    static void* operator new(size_t size)
+    {
+        return CoFrameAllocator::allocate(size);
+    }
+
+    static void operator delete(void* p, size_t size)
+    {
+        CoFrameAllocator::deallocate(p, size);
+    }
+};
+
+template <typename T>
+class CoTask;
+
+//CoTask的promise公共部分：保存等待者和异常
+class CoPromiseBase : public CoFramePromise
+{
+public:
+    //执行完成后直接切回等待者（对称转移），没有等待者时停在这里等CoTask析构
+    struct FinalAwaiter
+    {
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            std::coroutine_handle<> continuation = h.promise().m_continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    //惰性启动，被co_await时才开始执行
+    std::suspend_always initial_suspend() const noexcept
+    {
+        return {};
+    }
+
+    FinalAwaiter final_suspend() const noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception() noexcept
+    {
+        m_error = std::current_exception();
+    }
+
+    inline void setContinuation(std::coroutine_handle<> continuation)
+    {
+        m_continuation = continuation;
+    }
+
+protected:
+    std::coroutine_handle<> m_continuation;
+    std::exception_ptr m_error;
+};
+
+template <typename T>
+class CoPromise : public CoPromiseBase
+{
+public:
+    CoTask<T> get_return_object() noexcept;
+
+    template <typename U>
+    void return_value(U&& value)
+    {
+        m_value.emplace(std::forward<U>(value));
+    }
+
+    //取走结果，协程抛出的异常在这里重新抛出
+    T result()
+    {
+        if (m_error)
+        {
+            std::rethrow_exception(m_error);
+        }
+        return std::move(*m_value);
+    }
+
+private:
+    std::optional<T> m_value;
+};
+
+template <>
+class CoPromise<void> : public CoPromiseBase
+{
+public:
+    CoTask<void> get_return_object() noexcept;
+
+    void return_void() const noexcept
+    {
+    }
+
+    void result()
+    {
+        if (m_error)
+        {
+            std::rethrow_exception(m_error);
+        }
+    }
+};
+
+//返回T的协程，只能移动，析构时销毁协程帧
+template <typename T = void>
+class CoTask
+{
+public:
+    typedef CoPromise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    CoTask() : m_handle(nullptr) {}
+    explicit CoTask(Handle handle) : m_handle(handle) {}
+    CoTask(CoTask&& other) noexcept : m_handle(other.m_handle)
+    {
+        other.m_handle = nullptr;
+    }
+
+    CoTask& operator=(CoTask&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (m_handle)
+            {
+                m_handle.destroy();
+            }
+            m_handle = other.m_handle;
+            other.m_handle = nullptr;
+        }
+        return *this;
+    }
+
+    CoTask(const CoTask&) = delete;
+    CoTask& operator=(const CoTask&) = delete;
+
+    ~CoTask()
+    {
+        if (m_handle)
+        {
+            m_handle.destroy();
+        }
+    }
+
+    inline bool valid() const
+    {
+        return m_handle != nullptr;
+    }
+
+    //co_await：记下等待者后直接切到这个协程执行，完成后再切回来
+    struct Awaiter
+    {
+        Handle handle;
+
+        bool await_ready() const noexcept
+        {
+            return !handle || handle.done();
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            handle.promise().setContinuation(awaiting);
+            return handle;
+        }
+
+        T await_resume()
+        {
+            return handle.promise().result();
+        }
+    };
+
+    Awaiter operator co_await() const noexcept
+    {
+        return Awaiter{ m_handle };
+    }
+
+private:
+    Handle m_handle;
+};
+
+template <typename T>
+inline CoTask<T> CoPromise<T>::get_return_object() noexcept
+{
+    return CoTask<T>(std::coroutine_handle<CoPromise<T> >::from_promise(*this));
+}
+
+inline CoTask<void> CoPromise<void>::get_return_object() noexcept
+{
+    return CoTask<void>(std::coroutine_handle<CoPromise<void> >::from_promise(*this));
+}
+
+//恢复协程的任务：执行时恢复协程；没有执行就被析构（线程池已经关闭，或者析构时还在队列里）时
+//先置上丢弃标志再就地恢复，协程不会永远挂起，帧也不会泄漏
+class CoResumer
+{
+public:
+    CoResumer(std::coroutine_handle<> handle, bool* dropped) : m_handle(handle), m_dropped(dropped) {}
+    CoResumer(CoResumer&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)), m_dropped(other.m_dropped) {}
+    CoResumer(const CoResumer&) = delete;
+    CoResumer& operator=(const CoResumer&) = delete;
+
+    ~CoResumer()
+    {
+        if (m_handle)
+        {
+            if (m_dropped != nullptr)
+            {
+                *m_dropped = true;
+            }
+            m_handle.resume();
+        }
+    }
+
+    void operator()()
+    {
+        std::exchange(m_handle, nullptr).resume();
+    }
+
+private:
+    std::coroutine_handle<> m_handle;
+    bool* m_dropped;        //在等待者（协程帧）里，恢复之前一直有效
+};
+
+//恢复任务被丢弃时，在co_await处抛出
+inline void coCheckDropped(bool dropped)
+{
+    if (dropped)
+    {
+        throw std::runtime_error("task dropped: thread pool is shut down");
+    }
+}
+
+//co_await pool.schedule()：把协程剩下的部分作为一个任务投递到线程池
+class ScheduleAwaiter
+{
+public:
+    ScheduleAwaiter(ThreadPool* pool, int priority) : m_pool(pool), m_priority(priority), m_dropped(false) {}
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    //投递失败时任务在addTask里析构，协程已经就地恢复，之后不能再访问成员
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        m_pool->addTask(Task(CoResumer(h, &m_dropped)), m_priority);
+    }
+
+    void await_resume() const
+    {
+        coCheckDropped(m_dropped);
+    }
+
+private:
+    ThreadPool* m_pool;
+    int m_priority;
+    bool m_dropped;
+};
+
+inline ScheduleAwaiter ThreadPool::schedule(int priority)
+{
+    return ScheduleAwaiter(this, priority);
+}
+
+//co_await coSleep(pool, ms)：挂起ms毫秒后在线程池上恢复，等待期间不占用线程
+class SleepAwaiter
+{
+public:
+    SleepAwaiter(ThreadPool* pool, int64_t delayMs) : m_pool(pool), m_delayMs(delayMs), m_dropped(false) {}
+
+    bool await_ready() const noexcept
+    {
+        return m_delayMs <= 0;
+    }
+
+    //和ScheduleAwaiter一样，定时任务被丢弃时协程已经就地恢复
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        m_pool->scheduleAfter(m_delayMs, Task(CoResumer(h, &m_dropped)));
+    }
+
+    void await_resume() const
+    {
+        coCheckDropped(m_dropped);
+    }
+
+private:
+    ThreadPool* m_pool;
+    int64_t m_delayMs;
+    bool m_dropped;
+};
+
+inline SleepAwaiter coSleep(ThreadPool& pool, int64_t delayMs)
+{
+    return SleepAwaiter(&pool, delayMs);
+}
+
+//co_await一个Future：结果就绪后把协程的恢复投递到产生结果的线程池
+template <typename T>
+class FutureAwaiter
+{
+public:
+    explicit FutureAwaiter(Future<T> future) : m_future(std::move(future)) {}
+
+    bool await_ready() const
+    {
+        return m_future.ready();
+    }
+
+    //结果已经就绪才会调度续延，续延被丢弃时在完成结果的线程上就地恢复，照常取结果
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        m_future.state()->setContinuation(Task(CoResumer(h, nullptr)), false);
+    }
+
+    T await_resume()
+    {
+        return m_future.get();
+    }
+
+private:
+    Future<T> m_future;
+};
+
+template <typename T>
+inline FutureAwaiter<T> operator co_await(Future<T> future)
+{
+    return FutureAwaiter<T>(std::move(future));
+}
+
+//when_all中void子任务的结果
+struct CoVoid
+{
+};
+
+template <typename T>
+struct CoResult
+{
+    typedef T type;
+};
+
+template <>
+struct CoResult<void>
+{
+    typedef CoVoid type;
+};
+
+//when_all的共享状态：未完成的子任务数（多1，由等待者持有）、等待者和第一个异常
+struct WhenAllState
+{
+    std::atomic<size_t> count;
+    std::coroutine_handle<> awaiting;
+    std::atomic<bool> failed;
+    std::exception_ptr error;
+
+    WhenAllState() : count(0), failed(false) {}
+
+    //子任务完成，最后一个返回等待者
+    std::coroutine_handle<> arrive() noexcept
+    {
+        if (count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            return awaiting;
+        }
+        return std::noop_coroutine();
+    }
+
+    void fail(std::exception_ptr e)
+    {
+        if (!failed.exchange(true))
+        {
+            error = e;
+        }
+    }
+
+    void rethrow()
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+//when_all为每个子任务创建一个驱动协程，完成时通知共享状态
+class WhenAllChild
+{
+public:
+    struct promise_type : public CoFramePromise
+    {
+        WhenAllState* state = nullptr;
+
+        WhenAllChild get_return_object() noexcept
+        {
+            return WhenAllChild(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() const noexcept
+        {
+            return {};
+        }
+
+        struct FinalAwaiter
+        {
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+            {
+                return h.promise().state->arrive();
+            }
+
+            void await_resume() const noexcept
+            {
+            }
+        };
+
+        FinalAwaiter final_suspend() const noexcept
+        {
+            return {};
+        }
+
+        void return_void() const noexcept
+        {
+        }
+
+        //子任务的异常在驱动协程里已经捕获
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+
+    explicit WhenAllChild(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+    WhenAllChild(WhenAllChild&& other) noexcept : m_handle(other.m_handle)
+    {
+        other.m_handle = nullptr;
+    }
+    WhenAllChild(const WhenAllChild&) = delete;
+    WhenAllChild& operator=(const WhenAllChild&) = delete;
+
+    ~WhenAllChild()
+    {
+        if (m_handle)
+        {
+            m_handle.destroy();
+        }
+    }
+
+    void start(WhenAllState& state)
+    {
+        m_handle.promise().state = &state;
+        m_handle.resume();
+    }
+
+private:
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+template <typename T>
+WhenAllChild whenAllChild(CoTask<T>& task, std::optional<typename CoResult<T>::type>& out, WhenAllState& state)
+{
+    try
+    {
+        if constexpr (std::is_void<T>::value)
+        {
+            co_await task;
+            out.emplace();
+        }
+        else
+        {
+            out.emplace(co_await task);
+        }
+    }
+    catch (...)
+    {
+        state.fail(std::current_exception());
+    }
+}
+
+//依次启动全部子任务，全部同步完成时不挂起，否则由最后一个完成的子任务恢复
+class WhenAllAwaiter
+{
+public:
+    WhenAllAwaiter(WhenAllState& state, std::vector<WhenAllChild>& children) : m_state(state), m_children(children) {}
+
+    bool await_ready() const noexcept
+    {
+        return m_children.empty();
+    }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        m_state.awaiting = h;
+        m_state.count.store(m_children.size() + 1, std::memory_order_relaxed);
+        for (size_t i = 0; i < m_children.size(); i++)
+        {
+            m_children[i].start(m_state);
+        }
+        return m_state.count.fetch_sub(1, std::memory_order_acq_rel) != 1;
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+
+private:
+    WhenAllState& m_state;
+    std::vector<WhenAllChild>& m_children;
+};
+
+//并发等待一组同类型的协程，结果按输入顺序排列
+template <typename T>
+CoTask<std::vector<T> > when_all(std::vector<CoTask<T> > tasks)
+{
+    std::vector<std::optional<T> > slots(tasks.size());
+    WhenAllState state;
+    std::vector<WhenAllChild> children;
+    children.reserve(tasks.size());
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        children.push_back(whenAllChild(tasks[i], slots[i], state));
+    }
+    co_await WhenAllAwaiter(state, children);
+    state.rethrow();
+
+    std::vector<T> result;
+    result.reserve(slots.size());
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        result.push_back(std::move(*slots[i]));
+    }
+    co_return result;
+}
+
+inline CoTask<void> when_all(std::vector<CoTask<void> > tasks)
+{
+    std::vector<std::optional<CoVoid> > slots(tasks.size());
+    WhenAllState state;
+    std::vector<WhenAllChild> children;
+    children.reserve(tasks.size());
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        children.push_back(whenAllChild(tasks[i], slots[i], state));
+    }
+    co_await WhenAllAwaiter(state, children);
+    state.rethrow();
+}
+
+template <typename... Ts, size_t... I>
+CoTask<std::tuple<typename CoResult<Ts>::type...> > whenAllTuple(std::index_sequence<I...>, CoTask<Ts>... tasks)
+{
+    std::tuple<std::optional<typename CoResult<Ts>::type>...> slots;
+    WhenAllState state;
+    std::vector<WhenAllChild> children;
+    children.reserve(sizeof...(Ts));
+    (children.push_back(whenAllChild(tasks, std::get<I>(slots), state)), ...);
+    co_await WhenAllAwaiter(state, children);
+    state.rethrow();
+    co_return std::tuple<typename CoResult<Ts>::type...>(std::move(*std::get<I>(slots))...);
+}
+
+//并发等待不同类型的协程，结果是tuple，void子任务的结果是CoVoid
+template <typename... Ts>
+CoTask<std::tuple<typename CoResult<Ts>::type...> > when_all(CoTask<Ts>... tasks)
+{
+    return whenAllTuple(std::index_sequence_for<Ts...>(), std::move(tasks)...);
+}
+
+//不被任何人等待的驱动协程，执行完成后自己销毁
+struct CoDetached
+{
+    struct promise_type : public CoFramePromise
+    {
+        CoDetached get_return_object() const noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() const noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() const noexcept
+        {
+            return {};
+        }
+
+        void return_void() const noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+};
+
+template <typename T>
+CoDetached coSpawnDriver(ThreadPool* pool, CoTask<T> task, std::shared_ptr<FutureState<T> > state, int priority)
+{
+    //驱动协程的帧没有写入结果就被销毁时，Future以异常结束
+    FutureDropGuard guard(state);
+    try
+    {
+        //线程池已经关闭时这里抛出，Future以异常结束
+        co_await pool->schedule(priority);
+        if constexpr (std::is_void<T>::value)
+        {
+            co_await task;
+            state->setValue();
+        }
+        else
+        {
+            state->setValue(co_await task);
+        }
+    }
+    catch (...)
+    {
+        state->setException(std::current_exception());
+    }
+}
+
+//在线程池上启动一个协程，不阻塞当前线程，结果通过Future取得（可以get，也可以then或co_await）
+template <typename T>
+Future<T> coSpawn(ThreadPool& pool, CoTask<T> task, int priority = PriorityNormal)
+{
+    std::shared_ptr<FutureState<T> > state = std::make_shared<FutureState<T> >(poolLink(&pool));
+    coSpawnDriver(&pool, std::move(task), state, priority);
+    return Future<T>(state);
+}
+
+#endif // _COROUTINE_H_
@@ -0,0 +1,458 @@
+#ifndef _FUTURE_H_
+#define _FUTURE_H_
+
+#include "Task.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+#include <type_traits>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+class ThreadPool;
+
+//共享状态对线程池的引用：线程池析构时断开，之后投递到它上面的续延都失败，
+//结果已经就绪的Future在线程池析构之后再调用then也不会访问已经释放的线程池
+struct PoolLink
+{
+    std::atomic<ThreadPool*> pool;
+    //正在通过该引用投递任务的线程数，线程池断开后等它归零
+    std::atomic<int> users;
+};
+
+//线程池的引用，定义在ThreadPool.cpp中，pool为nullptr时返回nullptr
+std::shared_ptr<PoolLink> poolLink(ThreadPool* pool);
+//把续延任务投递到线程池，线程池已经关闭或析构时返回false，任务原样留在task里，定义在ThreadPool.cpp中
+bool scheduleOnPool(PoolLink* link, Task&& task);
+
+/**
+ * 轻量的异步结果
+ *
+ * std::future 的共享状态内部是一把互斥锁加一个条件变量，每次取结果都要加锁。
+ * 这里的共享状态只有一个原子状态字：
+ * 1、Pending -> Ready：结果写入后一次原子交换发布
+ * 2、Pending -> HasContinuation -> Ready：先挂上续延再完成，完成的线程负责调度续延
+ * 3、阻塞等待的线程直接在状态字上futex等待，只有真的有人等待时完成方才做唤醒系统调用
+ *
+ * 续延默认投递回产生该结果的线程池执行，不会占用一个阻塞等待的工作线程。
+ * 任务没有执行就被丢弃（线程池已经关闭，或者析构时还在队列里）时，对应的Future以runtime_error结束，
+ * 等待它的get、then、when_all不会永远阻塞。
+*/
+class FutureStateBase
+{
+public:
+    explicit FutureStateBase(std::shared_ptr<PoolLink> link) :
+    m_state(Pending),
+    m_waiters(0),
+    m_link(std::move(link)),
+    m_inline(false)
+    {
+    }
+
+    FutureStateBase(const FutureStateBase&) = delete;
+    FutureStateBase& operator=(const FutureStateBase&) = delete;
+
+    inline bool ready() const
+    {
+        return m_state.load(std::memory_order_acquire) == Ready;
+    }
+
+    //阻塞等待结果，先自旋一会，仍未完成再futex睡眠
+    void wait()
+    {
+        for (int i = 0; i < 64 && !ready(); i++)
+        {
+            sched_yield();
+        }
+        if (ready())
+        {
+            return;
+        }
+
+        m_waiters.fetch_add(1);
+        int state;
+        while ((state = m_state.load()) != Ready)
+        {
+            syscall(SYS_futex, reinterpret_cast<int*>(&m_state), FUTEX_WAIT_PRIVATE, state, nullptr, nullptr, 0);
+        }
+        m_waiters.fetch_sub(1);
+    }
+
+    inline void setException(std::exception_ptr error)
+    {
+        m_error = error;
+        markReady();
+    }
+
+    inline std::exception_ptr exception() const
+    {
+        return m_error;
+    }
+
+    //挂上续延，只能调用一次。inlineRun为true时在完成结果的线程上直接执行，否则投递到线程池
+    void setContinuation(Task&& task, bool inlineRun)
+    {
+        m_continuation = std::move(task);
+        m_inline = inlineRun;
+        int expected = Pending;
+        if (!m_state.compare_exchange_strong(expected, HasContinuation, std::memory_order_acq_rel))
+        {
+            //结果已经就绪，直接调度
+            dispatch();
+        }
+    }
+
+    inline const std::shared_ptr<PoolLink>& link() const
+    {
+        return m_link;
+    }
+
+protected:
+    //发布结果，唤醒等待者并调度续延
+    void markReady()
+    {
+        int prev = m_state.exchange(Ready);
+        if (m_waiters.load() > 0)
+        {
+            syscall(SYS_futex, reinterpret_cast<int*>(&m_state), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+        }
+        if (prev == HasContinuation)
+        {
+            dispatch();
+        }
+    }
+
+private:
+    void dispatch()
+    {
+        Task task = std::move(m_continuation);
+        if (m_inline || m_link == nullptr)
+        {
+            task();
+        }
+        else if (!scheduleOnPool(m_link.get(), std::move(task)))
+        {
+            //线程池已经关闭，丢弃续延，续延里的FutureDropGuard让后继以异常结束
+            task.reset();
+        }
+    }
+
+private:
+    enum { Pending = 0, HasContinuation = 1, Ready = 2 };
+
+    std::atomic<int> m_state;
+    std::atomic<int> m_waiters;
+    std::shared_ptr<PoolLink> m_link;
+    bool m_inline;
+    Task m_continuation;
+    std::exception_ptr m_error;
+};
+
+template <typename T>
+class FutureState : public FutureStateBase
+{
+public:
+    explicit FutureState(std::shared_ptr<PoolLink> link) : FutureStateBase(std::move(link)), m_hasValue(false) {}
+
+    ~FutureState()
+    {
+        if (m_hasValue)
+        {
+            reinterpret_cast<T*>(m_value)->~T();
+        }
+    }
+
+    template <typename U>
+    void setValue(U&& value)
+    {
+        new (m_value) T(std::forward<U>(value));
+        m_hasValue = true;
+        markReady();
+    }
+
+    //取走结果，只能调用一次
+    T take()
+    {
+        return std::move(*reinterpret_cast<T*>(m_value));
+    }
+
+private:
+    alignas(T) unsigned char m_value[sizeof(T)];
+    bool m_hasValue;
+};
+
+template <>
+class FutureState<void> : public FutureStateBase
+{
+public:
+    explicit FutureState(std::shared_ptr<PoolLink> link) : FutureStateBase(std::move(link)) {}
+
+    inline void setValue()
+    {
+        markReady();
+    }
+
+    inline void take()
+    {
+    }
+};
+
+//放在投递到线程池的任务里：任务没有执行就被析构时，让共享状态以异常结束
+class FutureDropGuard
+{
+public:
+    explicit FutureDropGuard(std::shared_ptr<FutureStateBase> state) : m_state(std::move(state)) {}
+    FutureDropGuard(FutureDropGuard&&) = default;
+    FutureDropGuard& operator=(FutureDropGuard&&) = default;
+
+    ~FutureDropGuard()
+    {
+        //任务执行过时结果一定已经写入；被移走的守卫不再持有状态
+        if (m_state != nullptr && !m_state->ready())
+        {
+            m_state->setException(std::make_exception_ptr(std::runtime_error("task dropped: thread pool is shut down")));
+        }
+    }
+
+private:
+    std::shared_ptr<FutureStateBase> m_state;
+};
+
+//执行可调用对象并把返回值或异常写入共享状态
+template <typename R>
+struct FutureSetter
+{
+    template <typename F, typename... Args>
+    static void run(FutureState<R>& state, F& f, Args&&... args)
+    {
+        try
+        {
+            state.setValue(f(std::forward<Args>(args)...));
+        }
+        catch (...)
+        {
+            state.setException(std::current_exception());
+        }
+    }
+};
+
+template <>
+struct FutureSetter<void>
+{
+    template <typename F, typename... Args>
+    static void run(FutureState<void>& state, F& f, Args&&... args)
+    {
+        try
+        {
+            f(std::forward<Args>(args)...);
+            state.setValue();
+        }
+        catch (...)
+        {
+            state.setException(std::current_exception());
+        }
+    }
+};
+
+//续延的返回值类型：前驱为void时续延不带参数
+template <typename F, typename T>
+struct ContinuationResult
+{
+    typedef decltype(std::declval<F&>()(std::declval<T>())) type;
+};
+
+template <typename F>
+struct ContinuationResult<F, void>
+{
+    typedef decltype(std::declval<F&>()()) type;
+};
+
+//用前驱的结果调用续延
+template <typename T>
+struct ContinuationRunner
+{
+    template <typename R, typename F>
+    static void run(FutureState<T>& prev, FutureState<R>& next, F& f)
+    {
+        FutureSetter<R>::run(next, f, prev.take());
+    }
+};
+
+template <>
+struct ContinuationRunner<void>
+{
+    template <typename R, typename F>
+    static void run(FutureState<void>&, FutureState<R>& next, F& f)
+    {
+        FutureSetter<R>::run(next, f);
+    }
+};
+
+template <typename T>
+class Future
+{
+public:
+    Future() {}
+    explicit Future(std::shared_ptr<FutureState<T> > state) : m_state(std::move(state)) {}
+
+    inline bool valid() const
+    {
+        return m_state != nullptr;
+    }
+
+    inline bool ready() const
+    {
+        return m_state->ready();
+    }
+
+    inline void wait() const
+    {
+        m_state->wait();
+    }
+
+    //阻塞等待并取走结果，任务抛出的异常在这里重新抛出
+    T get()
+    {
+        m_state->wait();
+        std::shared_ptr<FutureState<T> > state = std::move(m_state);
+        if (state->exception())
+        {
+            std::rethrow_exception(state->exception());
+        }
+        return state->take();
+    }
+
+    //结果就绪后把f(结果)投递到线程池执行，返回f的结果。前驱抛出的异常直接传递给后继
+    template <typename F>
+    Future<typename ContinuationResult<F, T>::type> then(F&& f)
+    {
+        typedef typename ContinuationResult<F, T>::type R;
+        std::shared_ptr<FutureState<T> > prev = std::move(m_state);
+        std::shared_ptr<FutureState<R> > next = std::make_shared<FutureState<R> >(prev->link());
+        FutureState<T>* prevRaw = prev.get();
+        prevRaw->setContinuation(Task(
+            [prev, next, guard = FutureDropGuard(next), fn = typename std::decay<F>::type(std::forward<F>(f))]() mutable
+            {
+                if (prev->exception())
+                {
+                    next->setException(prev->exception());
+                    return;
+                }
+                ContinuationRunner<T>::template run<R>(*prev, *next, fn);
+            }), false);
+        return Future<R>(next);
+    }
+
+    inline std::shared_ptr<FutureState<T> >& state()
+    {
+        return m_state;
+    }
+
+private:
+    std::shared_ptr<FutureState<T> > m_state;
+};
+
+//when_any的结果：第一个就绪的下标和全部输入
+template <typename T>
+struct WhenAnyResult
+{
+    size_t index;
+    std::vector<Future<T> > futures;
+};
+
+//全部输入就绪后完成，结果是已经就绪的输入，可以逐个get
+template <typename T>
+Future<std::vector<Future<T> > > when_all(std::vector<Future<T> > futures)
+{
+    typedef std::vector<Future<T> > Result;
+    struct Context
+    {
+        std::atomic<size_t> remaining;
+        Result futures;
+        std::shared_ptr<FutureState<Result> > result;
+    };
+
+    std::shared_ptr<PoolLink> link = futures.empty() ? nullptr : futures[0].state()->link();
+    std::shared_ptr<Context> ctx = std::make_shared<Context>();
+    ctx->result = std::make_shared<FutureState<Result> >(link);
+    Future<Result> out(ctx->result);
+    if (futures.empty())
+    {
+        ctx->result->setValue(Result());
+        return out;
+    }
+
+    //先保存状态指针，挂续延的过程中futures可能已经被移走
+    std::vector<std::shared_ptr<FutureState<T> > > states;
+    for (size_t i = 0; i < futures.size(); i++)
+    {
+        states.push_back(futures[i].state());
+    }
+    ctx->remaining.store(futures.size());
+    ctx->futures = std::move(futures);
+
+    for (size_t i = 0; i < states.size(); i++)
+    {
+        //计数在完成输入的线程上直接递减，不占用线程池
+        states[i]->setContinuation(Task([ctx]()
+        {
+            if (ctx->remaining.fetch_sub(1) == 1)
+            {
+                ctx->result->setValue(std::move(ctx->futures));
+            }
+        }), true);
+    }
+    return out;
+}
+
+//任意一个输入就绪后完成
+template <typename T>
+Future<WhenAnyResult<T> > when_any(std::vector<Future<T> > futures)
+{
+    typedef WhenAnyResult<T> Result;
+    struct Context
+    {
+        std::atomic<bool> done;
+        std::vector<Future<T> > futures;
+        std::shared_ptr<FutureState<Result> > result;
+    };
+
+    if (futures.empty())
+    {
+        throw std::invalid_argument("when_any requires at least one future");
+    }
+
+    std::shared_ptr<Context> ctx = std::make_shared<Context>();
+    ctx->done.store(false);
+    ctx->result = std::make_shared<FutureState<Result> >(futures[0].state()->link());
+    Future<Result> out(ctx->result);
+
+    std::vector<std::shared_ptr<FutureState<T> > > states;
+    for (size_t i = 0; i < futures.size(); i++)
+    {
+        states.push_back(futures[i].state());
+    }
+    ctx->futures = std::move(futures);
+
+    for (size_t i = 0; i < states.size(); i++)
+    {
+        states[i]->setContinuation(Task([ctx, i]()
+        {
+            if (!ctx->done.exchange(true))
+            {
+                Result r;
+                r.index = i;
+                r.futures = std::move(ctx->futures);
+                ctx->result->setValue(std::move(r));
+            }
+        }), true);
+    }
+    return out;
+}
+
+#endif // _FUTURE_H_
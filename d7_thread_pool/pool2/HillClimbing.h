@@ -0,0 +1,117 @@
+#ifndef _HILL_CLIMBING_H_
+#define _HILL_CLIMBING_H_
+
+#include <stdint.h>
+
+/**
+ * 爬山算法选择工作线程数
+ *
+ * 每个采样周期测一次吞吐量（完成的任务数/秒），和上一个周期比较：
+ * 1、吞吐量明显上升：沿原方向继续调整线程数
+ * 2、吞吐量明显下降：上一次调整是错的，反向调整
+ * 3、变化不明显：保持不动，连续几个周期都不变才试探一步，避免线程数来回抖动
+ * 4、队列没有积压：不需要更多线程，目标值收缩到正在忙的线程数
+ * 5、一个周期完成的任务少于MinSampleTasks时吞吐量没有意义（任务比采样周期还长），
+ *    调用者先延长采样窗口，仍然不够时保持不动，不当作吞吐量为0，也不重新开始试探
+ * 6、调整到了边界就停在边界，方向不变，只有吞吐量真的下降才反向
+*/
+class HillClimbing
+{
+public:
+    HillClimbing() :
+    m_lastThroughput(0),
+    m_direction(1),
+    m_flatSamples(0)
+    {
+    }
+
+    //一个采样窗口至少要完成的任务数
+    static const int MinSampleTasks = 8;
+
+    //throughput: 本周期吞吐量；completed: 本周期完成的任务数；pending: 积压任务数；
+    //busy: 忙线程数；current: 当前目标线程数
+    //返回新的目标线程数，reason为本次决策的原因
+    int update(double throughput, uint64_t completed, int pending, int busy, int current,
+               int minNum, int maxNum, int step, double threshold, const char*& reason)
+    {
+        if (pending == 0)
+        {
+            //没有积压，下次有积压时重新开始测量
+            m_lastThroughput = 0;
+            m_flatSamples = 0;
+            int target = clamp(busy + 1, minNum, maxNum);
+            if (target < current)
+            {
+                reason = "no backlog, shrink";
+                return target;
+            }
+            reason = "no backlog, hold";
+            return current;
+        }
+
+        if (completed < (uint64_t)MinSampleTasks)
+        {
+            //样本太少，没有信号，保持上一次的测量结果
+            reason = "too few completions, hold";
+            return current;
+        }
+
+        if (m_lastThroughput <= 0)
+        {
+            //第一个有积压的采样，先向增加线程的方向试探
+            m_direction = 1;
+            reason = "first sample, probe up";
+        }
+        else
+        {
+            double change = (throughput - m_lastThroughput) / m_lastThroughput;
+            if (change < -threshold)
+            {
+                m_direction = -m_direction;
+                m_flatSamples = 0;
+                reason = "throughput dropped, reverse";
+            }
+            else if (change > threshold)
+            {
+                m_flatSamples = 0;
+                reason = "throughput improved, continue";
+            }
+            else if (++m_flatSamples < FlatProbeSamples)
+            {
+                m_lastThroughput = throughput;
+                reason = "throughput flat, hold";
+                return current;
+            }
+            else
+            {
+                m_flatSamples = 0;
+                reason = "throughput flat, probe";
+            }
+        }
+        m_lastThroughput = throughput;
+
+        int target = clamp(current + m_direction * step, minNum, maxNum);
+        if (target == current)
+        {
+            //到了边界，停在这里，吞吐量下降时才会反向
+            reason = "at bound, hold";
+        }
+        return target;
+    }
+
+private:
+    static int clamp(int v, int lo, int hi)
+    {
+        return v < lo ? lo : (v > hi ? hi : v);
+    }
+
+private:
+    //吞吐量连续不变多少个周期后再试探
+    static const int FlatProbeSamples = 4;
+
+    double m_lastThroughput;
+    int m_direction;
+    int m_flatSamples;
+};
+
+#endif // _HILL_CLIMBING_H_
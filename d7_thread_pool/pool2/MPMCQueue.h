@@ -0,0 +1,160 @@
+#ifndef _MPMC_QUEUE_H_
+#define _MPMC_QUEUE_H_
+
+#include <atomic>
+#include <new>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * 无锁有界多生产者多消费者环形队列（Dmitry Vyukov 的实现思路）
+ *
+ * 1、每个槽位带一个序号seq，生产者看到 seq == pos 说明槽位空闲，
+ *    消费者看到 seq == pos + 1 说明槽位有数据
+ * 2、生产者/消费者通过CAS抢占enqueue/dequeue位置，抢到后独占该槽位，
+ *    写完数据再发布新的序号，不需要任何锁
+ * 3、队头队尾放在不同的缓存行，生产者和消费者互不干扰
+ *
+ * 容量向上取整为2的幂，元素在槽位内原地构造，支持只能移动的类型。
+*/
+template <typename T>
+class MPMCQueue
+{
+public:
+    explicit MPMCQueue(size_t capacity)
+    {
+        size_t cap = 2;
+        while (cap < capacity)
+        {
+            cap <<= 1;
+        }
+        m_mask = cap - 1;
+        m_cells = new Cell[cap];
+        for (size_t i = 0; i < cap; i++)
+        {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+        m_enqueuePos.store(0, std::memory_order_relaxed);
+        m_dequeuePos.store(0, std::memory_order_relaxed);
+    }
+
+    ~MPMCQueue()
+    {
+        //析构还没取走的元素
+        T item;
+        while (tryPop(item))
+        {
+        }
+        delete[] m_cells;
+    }
+
+    MPMCQueue(const MPMCQueue&) = delete;
+    MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+    //入队，队列满时返回false
+    template <typename U>
+    bool tryPush(U&& item)
+    {
+        Cell* cell;
+        size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                //槽位空闲，抢占写入位置
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                //槽位还没被消费者取走，队列满
+                return false;
+            }
+            else
+            {
+                //被其他生产者抢先了，重新读取位置
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        new (cell->storage) T(std::forward<U>(item));
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    //出队，队列空时返回false
+    bool tryPop(T& item)
+    {
+        Cell* cell;
+        size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                //槽位有数据，抢占读取位置
+                if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                //生产者还没写入，队列空
+                return false;
+            }
+            else
+            {
+                pos = m_dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        T* data = reinterpret_cast<T*>(cell->storage);
+        item = std::move(*data);
+        data->~T();
+        //序号加上容量，留给下一圈的生产者
+        cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    //近似的元素个数
+    inline size_t size() const
+    {
+        size_t tail = m_enqueuePos.load(std::memory_order_relaxed);
+        size_t head = m_dequeuePos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    inline bool empty() const
+    {
+        return size() == 0;
+    }
+
+    inline size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    alignas(64) Cell* m_cells;
+    size_t m_mask;
+    //生产者和消费者各自独占一个缓存行
+    alignas(64) std::atomic<size_t> m_enqueuePos;
+    alignas(64) std::atomic<size_t> m_dequeuePos;
+};
+
+#endif // _MPMC_QUEUE_H_
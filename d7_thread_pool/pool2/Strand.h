@@ -0,0 +1,198 @@
+#ifndef _STRAND_H_
+#define _STRAND_H_
+
+#include "ThreadPool.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <sched.h>
+
+/**
+ * 串行执行器（strand）：提交到同一个strand的任务按提交顺序一个接一个执行，不同的strand并行执行
+ *
+ * 每个会话/对象的状态只在它自己的strand上访问，就不再需要给每个对象加互斥锁：
+ *     Strand session(pool);
+ *     session.post([&]() { state.append(x); });
+ *
+ * 1、提交：任务压入strand自己的无锁MPSC队列（Vyukov），一次exchange，计数从0变1的提交者
+ *    负责把strand投递到线程池，之后的提交只入队，不再投递
+ * 2、执行：任何时刻最多只有一个线程在执行某个strand的任务，由计数保证，执行用户代码时不持有任何锁
+ * 3、公平：一次最多连续执行MaxBatch个任务，还有剩余就把自己重新投递，不会长期霸占工作线程
+ * 4、亲和：记住上次执行的工作线程，重新投递时交给同一个线程（工作窃取模式），
+ *    会话状态留在那个核的缓存里；那个线程忙不过来时仍然可以被其他线程窃取
+ *
+ * Strand是一个句柄，复制后指向同一个串行队列；还有任务没执行完时内部状态由投递出去的任务持有，
+ * 句柄先析构也没关系。任务抛出的异常和普通任务一样不被捕获。
+*/
+class Strand
+{
+public:
+    explicit Strand(ThreadPool& pool) : m_state(std::make_shared<State>(&pool)) {}
+
+    //提交一个任务，和同一个strand上之前提交的任务串行、按顺序执行
+    template <typename F>
+    void post(F&& f)
+    {
+        m_state->post(Task(std::forward<F>(f)));
+    }
+
+    //当前线程是否正在执行这个strand的任务，是的话可以直接访问它保护的状态
+    inline bool runningInThisThread() const
+    {
+        return current() == m_state.get();
+    }
+
+    //还没执行完的任务数，只是一个近似值
+    inline int pending() const
+    {
+        return m_state->m_pending.load(std::memory_order_relaxed);
+    }
+
+private:
+    //一次连续执行的最多任务数
+    static const int MaxBatch = 64;
+
+    struct Node
+    {
+        std::atomic<Node*> next;
+        Task task;
+    };
+
+    struct State : public std::enable_shared_from_this<State>
+    {
+        ThreadPool* m_pool;
+        //生产者端，最后入队的节点
+        std::atomic<Node*> m_head;
+        //消费者端，已经取走任务的哑节点，只有执行者访问
+        Node* m_tail;
+        //已提交还没执行完的任务数，从0变1的提交者负责投递
+        std::atomic<int> m_pending;
+        //上次执行的工作线程下标
+        std::atomic<int> m_worker;
+
+        explicit State(ThreadPool* pool) : m_pool(pool), m_pending(0), m_worker(-1)
+        {
+            Node* stub = new Node;
+            stub->next.store(nullptr, std::memory_order_relaxed);
+            m_head.store(stub, std::memory_order_relaxed);
+            m_tail = stub;
+        }
+
+        ~State()
+        {
+            //线程池关闭时丢弃的任务还留在队列里
+            while (m_tail != nullptr)
+            {
+                Node* next = m_tail->next.load(std::memory_order_relaxed);
+                delete m_tail;
+                m_tail = next;
+            }
+        }
+
+        void post(Task&& task)
+        {
+            Node* node = new Node;
+            node->next.store(nullptr, std::memory_order_relaxed);
+            node->task = std::move(task);
+            Node* prev = m_head.exchange(node, std::memory_order_acq_rel);
+            prev->next.store(node, std::memory_order_release);
+            if (m_pending.fetch_add(1, std::memory_order_acq_rel) == 0)
+            {
+                schedule();
+            }
+        }
+
+        //投递到上次执行的工作线程，任务里持有State
+        void schedule()
+        {
+            std::shared_ptr<State> self = shared_from_this();
+            m_pool->addTaskTo(m_worker.load(std::memory_order_relaxed), Task([self]() { self->drain(); }));
+        }
+
+        //取下一个任务；计数大于0时节点一定已经入队，只是生产者可能还没来得及链上next
+        Task pop()
+        {
+            Node* next;
+            while ((next = m_tail->next.load(std::memory_order_acquire)) == nullptr)
+            {
+                sched_yield();
+            }
+            Task task = std::move(next->task);
+            delete m_tail;
+            m_tail = next;
+            return task;
+        }
+
+        void drain()
+        {
+            State*& running = current();
+            State* outer = running;
+            running = this;
+            m_worker.store(m_pool->currentWorker(), std::memory_order_relaxed);
+            for (int i = 0; i < MaxBatch; i++)
+            {
+                Task task = pop();
+                task();
+                task.reset();
+                if (m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                    running = outer;
+                    return;
+                }
+            }
+            running = outer;
+            //还有任务，让出工作线程，排到同一个线程的队列后面
+            schedule();
+        }
+    };
+
+    //当前线程正在执行的strand
+    static State*& current()
+    {
+        static thread_local State* state = nullptr;
+        return state;
+    }
+
+private:
+    std::shared_ptr<State> m_state;
+};
+
+/**
+ * 按key串行：同一个key的任务在同一个strand上按提交顺序执行，不同key并行
+ *
+ * key按哈希分到固定数量的strand上，提交路径上没有查表加锁，也不用为每个key创建和回收strand；
+ * 哈希到同一个strand的不同key也会串行，strand数取工作线程数的若干倍就很少互相等待。
+*/
+template <typename Key, typename Hash = std::hash<Key> >
+class KeyedStrands
+{
+public:
+    KeyedStrands(ThreadPool& pool, size_t strands, const Hash& hash = Hash()) : m_hash(hash)
+    {
+        strands = strands > 0 ? strands : 1;
+        m_strands.reserve(strands);
+        for (size_t i = 0; i < strands; i++)
+        {
+            m_strands.emplace_back(pool);
+        }
+    }
+
+    template <typename F>
+    void post(const Key& key, F&& f)
+    {
+        strandOf(key).post(std::forward<F>(f));
+    }
+
+    inline Strand& strandOf(const Key& key)
+    {
+        return m_strands[m_hash(key) % m_strands.size()];
+    }
+
+private:
+    Hash m_hash;
+    std::vector<Strand> m_strands;
+};
+
+#endif // _STRAND_H_
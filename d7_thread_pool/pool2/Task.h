@@ -3,16 +3,187 @@
 
 #include <iostream>
 #include <string>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cstddef>
+#include <stdint.h>
 
 using callback = void (*)(void *);
 
-struct Task
+/**
+ * 任务对象：可以保存任意只能移动的可调用对象（带捕获的lambda、捕获unique_ptr的lambda等）
+ *
+ * 1、捕获不超过InlineSize字节的可调用对象直接构造在任务内部的缓冲区，不申请堆内存
+ * 2、更大的可调用对象才放到堆上，缓冲区里只保存指针
+ * 3、通过一张静态操作表（调用、移动、析构）实现类型擦除，整个任务正好一个缓存行
+ *
+ * 任务只能移动不能拷贝，执行完由析构函数释放捕获的资源，工作线程不再需要free参数。
+*/
+class Task
 {
-    callback function;
-    void* arg;
-    Task() : function(nullptr), arg(nullptr) {}
-    Task(callback f, void* arg_f) : function(f), arg(arg_f) {}
-    const int getArg() { return *(int*)arg; }
+public:
+    //内联缓冲区大小，加上操作表指针和入队时间一共64字节
+    static const size_t InlineSize = 48;
+
+    Task() : m_ops(nullptr), m_enqueueNs(0) {}
+
+    //兼容原来的回调函数+参数形式，参数由调用者负责释放
+    Task(callback f, void* arg_f) : m_ops(nullptr), m_enqueueNs(0)
+    {
+        if (f != nullptr)
+        {
+            emplace([f, arg_f]() { f(arg_f); });
+        }
+    }
+
+    //任意可调用对象
+    template <typename F,
+              typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& f) : m_ops(nullptr), m_enqueueNs(0)
+    {
+        emplace(std::forward<F>(f));
+    }
+
+    Task(Task&& other) noexcept : m_ops(other.m_ops), m_enqueueNs(other.m_enqueueNs)
+    {
+        if (m_ops)
+        {
+            m_ops->move(m_storage, other.m_storage);
+            other.m_ops = nullptr;
+        }
+    }
+
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            m_enqueueNs = other.m_enqueueNs;
+            if (other.m_ops)
+            {
+                m_ops = other.m_ops;
+                m_ops->move(m_storage, other.m_storage);
+                other.m_ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task()
+    {
+        reset();
+    }
+
+    //执行任务
+    inline void operator()()
+    {
+        m_ops->invoke(m_storage);
+    }
+
+    //是否保存了可调用对象
+    inline explicit operator bool() const
+    {
+        return m_ops != nullptr;
+    }
+
+    //释放保存的可调用对象
+    inline void reset()
+    {
+        if (m_ops)
+        {
+            m_ops->destroy(m_storage);
+            m_ops = nullptr;
+        }
+    }
+
+    //入队时间（纳秒），线程池打开计时统计时才设置，0表示没有记录
+    inline void setEnqueueTime(uint64_t ns)
+    {
+        m_enqueueNs = ns;
+    }
+
+    inline uint64_t enqueueTime() const
+    {
+        return m_enqueueNs;
+    }
+
+private:
+    struct Ops
+    {
+        void (*invoke)(void* storage);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* storage);
+    };
+
+    //能放进内联缓冲区的可调用对象
+    template <typename F>
+    struct InlineOps
+    {
+        static void invoke(void* s) { (*static_cast<F*>(s))(); }
+        static void move(void* dst, void* src)
+        {
+            new (dst) F(std::move(*static_cast<F*>(src)));
+            static_cast<F*>(src)->~F();
+        }
+        static void destroy(void* s) { static_cast<F*>(s)->~F(); }
+        static const Ops ops;
+    };
+
+    //放在堆上的可调用对象，缓冲区里只保存指针
+    template <typename F>
+    struct HeapOps
+    {
+        static F*& ptr(void* s) { return *static_cast<F**>(s); }
+        static void invoke(void* s) { (*ptr(s))(); }
+        static void move(void* dst, void* src)
+        {
+            *static_cast<F**>(dst) = ptr(src);
+            ptr(src) = nullptr;
+        }
+        static void destroy(void* s) { delete ptr(s); }
+        static const Ops ops;
+    };
+
+    template <typename F>
+    void emplace(F&& f)
+    {
+        typedef typename std::decay<F>::type Fn;
+        //是否可以放进内联缓冲区，移动构造可能抛异常的也放到堆上
+        typedef std::integral_constant<bool,
+            sizeof(Fn) <= InlineSize && alignof(Fn) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible<Fn>::value> FitsInline;
+        emplace<Fn>(std::forward<F>(f), FitsInline());
+    }
+
+    template <typename Fn, typename F>
+    void emplace(F&& f, std::true_type)
+    {
+        new (m_storage) Fn(std::forward<F>(f));
+        m_ops = &InlineOps<Fn>::ops;
+    }
+
+    template <typename Fn, typename F>
+    void emplace(F&& f, std::false_type)
+    {
+        *reinterpret_cast<Fn**>(m_storage) = new Fn(std::forward<F>(f));
+        m_ops = &HeapOps<Fn>::ops;
+    }
+
+private:
+    alignas(std::max_align_t) unsigned char m_storage[InlineSize];
+    const Ops* m_ops;
+    //放在原来的对齐填充里，任务仍然是64字节
+    uint64_t m_enqueueNs;
 };
 
-#endif // _TASK_H_
\ No newline at end of file
+template <typename F>
+const Task::Ops Task::InlineOps<F>::ops = { &Task::InlineOps<F>::invoke, &Task::InlineOps<F>::move, &Task::InlineOps<F>::destroy };
+
+template <typename F>
+const Task::Ops Task::HeapOps<F>::ops = { &Task::HeapOps<F>::invoke, &Task::HeapOps<F>::move, &Task::HeapOps<F>::destroy };
+
+#endif // _TASK_H_
@@ -2,69 +2,228 @@
 #define _TASK_QUEUE_H_
 
 #include "Task.h"
+#include "MPMCQueue.h"
+#include "../common/Priority.h"
+#include "../common/Locks.h"
 #include <queue>
+#include <atomic>
+#include <sched.h>
 
-//任务队列
-class TaskQueue
+//加锁队列使用的锁，编译时可以换成../common/Locks.h里的其他锁，例如-DTASK_QUEUE_LOCK=AdaptiveMutex
+#ifndef TASK_QUEUE_LOCK
+#define TASK_QUEUE_LOCK PosixMutex
+#endif
+
+//任务队列，每个优先级一个子队列，出队时取最高的非空优先级，低优先级有老化不会饿死
+//capacity为0时使用加锁的std::queue（无界），Lock是保护它的锁，满足Lockable即可
+//capacity大于0时使用无锁有界环形队列，适合大量生产者提交小任务，每个优先级的容量都是capacity
+template <typename Lock>
+class BasicTaskQueue
 {
 public:
-    TaskQueue()
+    explicit BasicTaskQueue(size_t capacity = 0) :
+    m_bitmap(0),
+    m_count(0)
     {
-        pthread_mutex_init(&m_mutex, nullptr);
+        for (int i = 0; i < PriorityLevels; i++)
+        {
+            m_rings[i] = capacity > 0 ? new MPMCQueue<Task>(capacity) : nullptr;
+        }
     }
 
-    ~TaskQueue()
+    ~BasicTaskQueue()
     {
-        pthread_mutex_destroy(&m_mutex);
+        for (int i = 0; i < PriorityLevels; i++)
+        {
+            delete m_rings[i];
+        }
     }
 
-    //添加任务
-    inline void addTask(Task &task)
+    //是否为无锁队列
+    inline bool lockFree() const
+    {
+        return m_rings[0] != nullptr;
+    }
+
+    //添加任务，环形队列满时让出CPU等待消费者腾出空间
+    inline void addTask(Task &&task, int priority = PriorityNormal)
+    {
+        priority = clampPriority(priority);
+        if (lockFree())
+        {
+            while (!m_rings[priority]->tryPush(std::move(task)))
+            {
+                sched_yield();
+            }
+            m_bitmap.fetch_or(1u << priority);
+            return;
+        }
+
+        m_mutex.lock();
+        m_queues[priority].push(std::move(task));
+        m_bitmap.fetch_or(1u << priority, std::memory_order_relaxed);
+        m_count.store(m_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        m_mutex.unlock();
+    }
+
+    //批量添加同一优先级的任务，加锁队列整批只加一次锁，任务会被移走
+    inline void addTasks(Task* tasks, size_t n, int priority = PriorityNormal)
     {
-        pthread_mutex_lock(&m_mutex);
-        m_queue.push(task);
-        pthread_mutex_unlock(&m_mutex);
+        priority = clampPriority(priority);
+        if (lockFree())
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                addTask(std::move(tasks[i]), priority);
+            }
+            return;
+        }
+
+        m_mutex.lock();
+        for (size_t i = 0; i < n; i++)
+        {
+            m_queues[priority].push(std::move(tasks[i]));
+        }
+        if (n > 0)
+        {
+            m_bitmap.fetch_or(1u << priority, std::memory_order_relaxed);
+        }
+        m_count.store(m_count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        m_mutex.unlock();
     }
 
     //添加任务
-    inline void addTask(callback func, void* arg)
+    inline void addTask(callback func, void* arg, int priority = PriorityNormal)
     {
-        pthread_mutex_lock(&m_mutex);
-        m_queue.push(Task(func, arg));
-        pthread_mutex_unlock(&m_mutex);
+        addTask(Task(func, arg), priority);
     }
 
-    //取出任务
+    //尝试添加任务，环形队列满时返回false且task保持不变，加锁队列总是成功
+    inline bool tryAddTask(Task &task, int priority = PriorityNormal)
+    {
+        priority = clampPriority(priority);
+        if (lockFree())
+        {
+            if (!m_rings[priority]->tryPush(std::move(task)))
+            {
+                return false;
+            }
+            m_bitmap.fetch_or(1u << priority);
+            return true;
+        }
+
+        addTask(std::move(task), priority);
+        return true;
+    }
+
+    //取出任务，队列为空时返回空任务
     inline Task getTask()
     {
         Task t;
-        pthread_mutex_lock(&m_mutex);
-        if (!m_queue.empty())
+        tryGetTask(t);
+        return t;
+    }
+
+    //尝试取出任务，队列为空时返回false
+    inline bool tryGetTask(Task &task)
+    {
+        if (lockFree())
         {
-            //取第一个任务弹出队列
-            t = m_queue.front();
-            m_queue.pop();
+            return tryGetRing(task);
         }
 
-        pthread_mutex_unlock(&m_mutex);
-        return t;
+        bool ok = false;
+        m_mutex.lock();
+        uint32_t bitmap = m_bitmap.load(std::memory_order_relaxed);
+        if (bitmap != 0)
+        {
+            //取选中优先级的第一个任务弹出队列
+            int level = m_picker.pick(bitmap);
+            std::queue<Task>& q = m_queues[level];
+            task = std::move(q.front());
+            q.pop();
+            if (q.empty())
+            {
+                m_bitmap.fetch_and(~(1u << level), std::memory_order_relaxed);
+            }
+            m_count.store(m_count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+            ok = true;
+        }
+
+        m_mutex.unlock();
+        return ok;
+    }
+
+    //最高的非空优先级，队列为空时返回PriorityLevels，不加锁，只是一个近似值
+    inline int topPriority()
+    {
+        return PriorityPicker::top(m_bitmap.load(std::memory_order_relaxed));
     }
 
-    //获得任务个数
+    //获得任务个数，不加锁，只是一个近似值
     inline const int taskNumber()
     {
-        return m_queue.size();
+        if (lockFree())
+        {
+            size_t n = 0;
+            for (int i = 0; i < PriorityLevels; i++)
+            {
+                n += m_rings[i]->size();
+            }
+            return n;
+        }
+        return m_count.load(std::memory_order_relaxed);
     }
 
-    //判断队列是否为空
+    //判断队列是否为空，不加锁，只是一个近似值
     inline const bool empty()
     {
-        return m_queue.empty();
+        return taskNumber() == 0;
+    }
+
+private:
+    //无锁模式出队：位图只是提示，入队后置位，发现子队列为空时清位再复查，
+    //位图全空时再完整检查一遍所有子队列，保证不会漏掉任务
+    bool tryGetRing(Task &task)
+    {
+        uint32_t tried = 0;
+        uint32_t bitmap;
+        while ((bitmap = m_bitmap.load() & ~tried) != 0)
+        {
+            int level = m_picker.pick(bitmap);
+            if (m_rings[level]->tryPop(task))
+            {
+                return true;
+            }
+            tried |= 1u << level;
+            m_bitmap.fetch_and(~(1u << level));
+            if (!m_rings[level]->empty())
+            {
+                m_bitmap.fetch_or(1u << level);
+            }
+        }
+
+        for (int i = 0; i < PriorityLevels; i++)
+        {
+            if (m_rings[i]->tryPop(task))
+            {
+                return true;
+            }
+        }
+        return false;
     }
 
 private:
-    pthread_mutex_t m_mutex;
-    std::queue<Task> m_queue;
+    MPMCQueue<Task>* m_rings[PriorityLevels];
+    Lock m_mutex;
+    std::queue<Task> m_queues[PriorityLevels];
+    //非空优先级的位图，第i位对应优先级i
+    std::atomic<uint32_t> m_bitmap;
+    PriorityPicker m_picker;
+    //队列长度的副本，在锁内更新，锁外读取
+    std::atomic<size_t> m_count;
 };
 
-#endif // _TASK_QUEUE_H_
\ No newline at end of file
+typedef BasicTaskQueue<TASK_QUEUE_LOCK> TaskQueue;
+
+#endif // _TASK_QUEUE_H_
@@ -1,44 +1,249 @@
 #include "ThreadPool.h"
+#include "../common/AsyncLog.h"
 #include <string.h>
 #include <unistd.h>
-#include <iostream>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
 
-ThreadPool::ThreadPool(const int min, const int max):
+thread_local ThreadPool::WorkerSlot* ThreadPool::s_currentSlot = nullptr;
+
+//工作窃取队列只能保存指针，任务放在节点里
+struct TaskNode
+{
+    Task task;
+    TaskNode* next;
+};
+
+//定时任务，周期任务每次到期都执行同一个可调用对象
+struct ScheduledTask
+{
+    Task task;
+    int priority;
+    bool periodic;
+    //周期任务已经有一次在排队或执行
+    std::atomic<bool> inFlight;
+};
+
+//每个线程缓存一些空闲节点，节点在哪个线程执行完就还给哪个线程，
+//整个过程都是线程私有的，稳定运行后不再申请内存
+struct TaskNodeCache
+{
+    //最多缓存的节点数，多出来的直接释放
+    static const int MaxNodes = 1024;
+
+    TaskNode* head = nullptr;
+    int count = 0;
+
+    ~TaskNodeCache()
+    {
+        while (head != nullptr)
+        {
+            TaskNode* next = head->next;
+            delete head;
+            head = next;
+        }
+    }
+
+    TaskNode* alloc(Task&& task)
+    {
+        if (head == nullptr)
+        {
+            return new TaskNode{std::move(task), nullptr};
+        }
+        TaskNode* node = head;
+        head = node->next;
+        count--;
+        node->task = std::move(task);
+        return node;
+    }
+
+    void free(TaskNode* node)
+    {
+        node->task.reset();
+        if (count >= MaxNodes)
+        {
+            delete node;
+            return;
+        }
+        node->next = head;
+        head = node;
+        count++;
+    }
+};
+
+static thread_local TaskNodeCache t_nodeCache;
+
+//线程私有的随机数，工作窃取时选择受害者用，避免rand()的全局锁
+static inline unsigned int fastRand()
+{
+    static thread_local unsigned int seed = (unsigned int)(size_t)&seed | 1;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static inline int64_t nowNs(clockid_t clock = CLOCK_MONOTONIC)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//计算条件变量的超时时间点，条件变量使用CLOCK_MONOTONIC
+static inline struct timespec deadlineAfterMs(int ms)
+{
+    int64_t ns = nowNs() + (int64_t)ms * 1000000;
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    return ts;
+}
+
+//忙等待时降低功耗，并把流水线资源让给同一物理核上的另一个超线程
+static inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+ThreadPool::ThreadPool(const int min, const int max, const bool workStealing, const size_t queueCapacity):
+ThreadPool(min, max, workStealing, queueCapacity, Affinity())
+{
+}
+
+ThreadPool::ThreadPool(const int min, const int max, const bool workStealing, const size_t queueCapacity,
+                       const Affinity& affinity):
 m_minNum(min),
 m_maxNum(max),
 m_busyNum(0),
-m_aliveNum(min),
+m_aliveNum(0),
 m_exitNum(0),
-m_shutdown(false)
+m_shutdown(false),
+m_workStealing(workStealing),
+m_lockFree(workStealing || queueCapacity > 0),
+m_pendingNum(0),
+m_idleTimeoutMs(Tunables().idleTimeoutMs),
+m_targetNum(min),
+m_completedNum(0),
+m_managerWake(false),
+m_decisionNum(0),
+m_metrics(max),
+m_affinity(affinity),
+m_link(std::make_shared<PoolLink>())
 {
+    m_link->pool = this;
+    m_link->users = 0;
+    //忙轮询线程从不退出，数量不能超过最少线程数
+    if (m_affinity.busyPollWorkers > min)
+    {
+        m_affinity.busyPollWorkers = min;
+    }
+    bool pinEach = m_affinity.pinEach && !m_affinity.cpus.empty();
+    if (pinEach)
+    {
+        m_nodeSlots.resize(CpuTopology::instance().nodeCount());
+    }
+
     //实例化任务队列
-    m_taskQ = new TaskQueue();
+    m_taskQ = new TaskQueue(queueCapacity);
     //给线程数组分配内存
     m_threadIDs = new pthread_t[m_maxNum];
-    memset(m_threadIDs, 0, sizeof(m_threadIDs));
-    //初始化锁和条件变量
+    memset(m_threadIDs, 0, sizeof(pthread_t) * m_maxNum);
+    //每个线程一个槽位，开始时全部空闲
+    m_slots = new WorkerSlot[m_maxNum];
+    m_freeSlots = new int[m_maxNum];
+    m_freeTop = 0;
+    for (int i = m_maxNum - 1; i >= 0; i--)
+    {
+        m_slots[i].pool = this;
+        m_slots[i].index = i;
+        m_slots[i].cpu = pinEach ? m_affinity.cpus[i % m_affinity.cpus.size()] : -1;
+        m_slots[i].node = pinEach ? CpuTopology::instance().nodeOf(m_slots[i].cpu) : -1;
+        m_slots[i].busyPoll = i < m_affinity.busyPollWorkers;
+        m_slots[i].localized = false;
+        m_slots[i].scratch = nullptr;
+        m_slots[i].scratchSize = 0;
+        m_slots[i].active = false;
+        m_slots[i].ticks = 0;
+        //栈顶是下标0，忙轮询线程占用最前面的槽位
+        m_freeSlots[m_freeTop++] = i;
+        if (pinEach)
+        {
+            m_nodeSlots[m_slots[i].node].push_back(i);
+        }
+    }
+    //初始化锁和条件变量，超时等待使用单调时钟，不受系统时间调整影响
     pthread_mutex_init(&m_lock, NULL);
-    pthread_cond_init(&m_not_Empty, NULL);
-    //创建管理者线程
-    pthread_create(&m_managerID, NULL, manager, this);
-    
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m_managerCond, &attr);
+    pthread_condattr_destroy(&attr);
+
     //创建最少初始数量工作线程
+    pthread_mutex_lock(&m_lock);
     for (int i = 0; i < min; i++)
     {
-        pthread_create(&m_threadIDs[i], NULL, worker, this);
+        spawnWorker();
     }
-    
+    pthread_mutex_unlock(&m_lock);
+
+    //到期的定时任务批量放进任务队列
+    m_timers = new TimerWheel<std::shared_ptr<ScheduledTask> >(
+        [this](std::vector<std::shared_ptr<ScheduledTask> >& batch) { dispatchTimers(batch); });
+
+    //创建管理者线程
+    pthread_create(&m_managerID, NULL, manager, this);
 }
 
 ThreadPool::~ThreadPool()
 {
-    this->m_shutdown = true;
+    //先停掉定时器线程，之后不会再有定时任务进来
+    delete m_timers;
+    m_timers = NULL;
+
+    //设置关闭标志并唤醒所有阻塞的工作线程和管理者线程
+    pthread_mutex_lock(&m_lock);
+    m_shutdown = true;
+    m_workReady.notifyAll();
+    pthread_cond_signal(&m_managerCond);
+    pthread_mutex_unlock(&m_lock);
+
+    //断开Future对线程池的引用，等正在投递续延的线程离开，之后的续延直接失败
+    m_link->pool.store(nullptr);
+    while (m_link->users.load() > 0)
+    {
+        sched_yield();
+    }
+
     //销毁管理者线程
     pthread_join(m_managerID, NULL);
-    //唤醒所有的消费者线程
-    for (int i = 0; i < m_aliveNum; i++)
+
+    //回收工作线程，被管理者回收的线程已经分离，槽位为0
+    for (int i = 0; i < m_maxNum; i++)
     {
-        pthread_cond_signal(&m_not_Empty);
+        pthread_mutex_lock(&m_lock);
+        pthread_t tid = m_threadIDs[i];
+        pthread_mutex_unlock(&m_lock);
+        if (tid != 0)
+        {
+            pthread_join(tid, NULL);
+        }
+    }
+
+    //释放本地队列中没有执行的任务
+    for (int i = 0; i < m_maxNum; i++)
+    {
+        TaskNode* t = nullptr;
+        while (m_slots[i].deque.pop(t))
+        {
+            delete t;
+        }
     }
 
     //销毁任务队列
@@ -47,185 +252,948 @@ ThreadPool::~ThreadPool()
         delete m_taskQ;
         m_taskQ = NULL;
     }
-    
+
+    if (m_slots)
+    {
+        for (int i = 0; i < m_maxNum; i++)
+        {
+            if (m_slots[i].scratch != nullptr)
+            {
+                munmap(m_slots[i].scratch, m_slots[i].scratchSize);
+            }
+        }
+        delete[] m_slots;
+        m_slots = NULL;
+    }
+
     //销毁保存消费者id的数组
     if (m_threadIDs)
     {
         delete[] m_threadIDs;
         m_threadIDs = NULL;
     }
-    
+
+    if (m_freeSlots)
+    {
+        delete[] m_freeSlots;
+        m_freeSlots = NULL;
+    }
+
     //销毁锁和条件变量
     pthread_mutex_destroy(&m_lock);
-    pthread_cond_destroy(&m_not_Empty);    
+    pthread_cond_destroy(&m_managerCond);
 }
 
 //添加任务
-void ThreadPool::addTask(Task task)
+void ThreadPool::addTask(Task task, int priority)
 {
     if (m_shutdown)
     {
         return;
     }
 
+    task.setEnqueueTime(m_metrics.stamp());
+    if (m_lockFree)
+    {
+        pushTask(std::move(task), priority);
+        return;
+    }
+
     //添加任务
-    m_taskQ->addTask(task);
-    //唤醒一个任务列表为空的工作处理线程
-    pthread_cond_signal(&m_not_Empty);
+    m_taskQ->addTask(std::move(task), priority);
+    //唤醒一个任务列表为空的工作处理线程，没有线程睡眠时不进内核
+    m_workReady.notifyOne();
+    notifyManager();
 }
 
-void ThreadPool::addTask(callback func, void* arg)
+void ThreadPool::addTask(callback func, void* arg, int priority)
 {
     if (m_shutdown)
     {
         return;
     }
 
+    Task task(func, arg);
+    task.setEnqueueTime(m_metrics.stamp());
+    if (m_lockFree)
+    {
+        pushTask(std::move(task), priority);
+        return;
+    }
+
     //添加任务
-    m_taskQ->addTask(func, arg);
-    //唤醒一个任务列表为空的工作处理线程
-    pthread_cond_signal(&m_not_Empty);
+    m_taskQ->addTask(std::move(task), priority);
+    //唤醒一个任务列表为空的工作处理线程，没有线程睡眠时不进内核
+    m_workReady.notifyOne();
+    notifyManager();
 }
 
-//工作线程任务函数
-void* ThreadPool::worker(void* arg)
+//批量添加任务
+void ThreadPool::addTasks(Task* tasks, size_t n, int priority)
 {
-    //强转参数
-    ThreadPool* pool = static_cast<ThreadPool*>(arg);
+    if (m_shutdown || n == 0)
+    {
+        return;
+    }
 
-    //循环执行任务
-    while (true)
+    //整批任务共用一个入队时间
+    uint64_t stamp = m_metrics.stamp();
+    for (size_t i = 0; i < n; i++)
+    {
+        tasks[i].setEnqueueTime(stamp);
+    }
+
+    if (!m_lockFree)
+    {
+        //整批任务一次加锁放入队列
+        m_taskQ->addTasks(tasks, n, priority);
+        wakeWorkers(n);
+        notifyManager();
+        return;
+    }
+
+    size_t queued = n;
+    if (!m_workStealing)
+    {
+        queued = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            bool ok;
+            while (!(ok = m_taskQ->tryAddTask(tasks[i], priority)))
+            {
+                //环形队列满，和pushTask一样工作线程直接执行
+                if (s_currentSlot != nullptr && s_currentSlot->pool == this)
+                {
+                    runTask(tasks[i]);
+                    break;
+                }
+                //外部线程先把已经入队的任务发布出去，让工作线程腾出空间
+                m_pendingNum.fetch_add(queued);
+                wakeWorkers(queued);
+                queued = 0;
+                sched_yield();
+            }
+            if (ok)
+            {
+                queued++;
+            }
+        }
+    }
+    else if (s_currentSlot != nullptr && s_currentSlot->pool == this && priority != PriorityNormal)
+    {
+        //本地双端队列不区分优先级，非普通优先级的任务放进自己的收件箱
+        s_currentSlot->inbox.addTasks(tasks, n, priority);
+    }
+    else if (s_currentSlot != nullptr && s_currentSlot->pool == this)
+    {
+        //工作线程提交的整批任务都放入本地队列，由空闲线程窃取
+        for (size_t i = 0; i < n; i++)
+        {
+            s_currentSlot->deque.push(t_nodeCache.alloc(std::move(tasks[i])));
+        }
+    }
+    else
+    {
+        //外部线程提交的任务按存活线程数切块，每块一次加锁放进一个收件箱
+        int alive = m_aliveNum.load();
+        size_t chunk = n / (alive > 0 ? alive : 1) + 1;
+        for (size_t i = 0; i < n; i += chunk)
+        {
+            size_t count = (n - i < chunk) ? n - i : chunk;
+            pickSlot()->inbox.addTasks(tasks + i, count, priority);
+        }
+    }
+
+    m_pendingNum.fetch_add(queued);
+    wakeWorkers(queued);
+    notifyManager();
+}
+
+TimerId ThreadPool::scheduleAfter(int64_t delayMs, Task task, int priority)
+{
+    if (m_shutdown)
+    {
+        return 0;
+    }
+    std::shared_ptr<ScheduledTask> st = std::make_shared<ScheduledTask>();
+    st->task = std::move(task);
+    st->priority = priority;
+    st->periodic = false;
+    st->inFlight = false;
+    return m_timers->addAfter(delayMs * 1000000, std::move(st));
+}
+
+TimerId ThreadPool::scheduleEvery(int64_t periodMs, Task task, int priority)
+{
+    if (m_shutdown)
+    {
+        return 0;
+    }
+    std::shared_ptr<ScheduledTask> st = std::make_shared<ScheduledTask>();
+    st->task = std::move(task);
+    st->priority = priority;
+    st->periodic = true;
+    st->inFlight = false;
+    return m_timers->addEvery(periodMs * 1000000, std::move(st));
+}
+
+bool ThreadPool::cancelTimer(TimerId id)
+{
+    return m_timers->cancel(id);
+}
+
+//一个tick到期的定时任务只加一次锁（或一次批量入队），周期任务上一次还没执行完就跳过这一次
+void ThreadPool::dispatchTimers(std::vector<std::shared_ptr<ScheduledTask> >& batch)
+{
+    std::vector<Task> tasks[PriorityLevels];
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        std::shared_ptr<ScheduledTask>& st = batch[i];
+        int priority = clampPriority(st->priority);
+        if (!st->periodic)
+        {
+            tasks[priority].emplace_back([st]() { st->task(); });
+            continue;
+        }
+        if (st->inFlight.exchange(true, std::memory_order_acquire))
+        {
+            continue;
+        }
+        tasks[priority].emplace_back([st]()
+        {
+            st->task();
+            st->inFlight.store(false, std::memory_order_release);
+        });
+    }
+    for (int p = 0; p < PriorityLevels; p++)
+    {
+        if (!tasks[p].empty())
+        {
+            addTasks(tasks[p].data(), tasks[p].size(), p);
+        }
+    }
+}
+
+//添加任务到指定的工作线程
+void ThreadPool::addTaskTo(int worker, Task task, int priority)
+{
+    if (!m_workStealing || worker < 0 || worker >= m_maxNum)
+    {
+        addTask(std::move(task), priority);
+        return;
+    }
+    if (m_shutdown)
+    {
+        return;
+    }
+
+    task.setEnqueueTime(m_metrics.stamp());
+    //目标是当前线程时也放进收件箱，本地队列后进先出，重新投递自己的任务会插到其他任务前面；
+    //目标线程已经退出时换一个线程，避免任务只能等别人窃取
+    WorkerSlot* slot = m_slots[worker].active.load() ? &m_slots[worker] : pickSlot();
+    slot->inbox.addTask(std::move(task), priority);
+    m_pendingNum.fetch_add(1);
+    if (!m_workReady.notifyOne())
+    {
+        notifyManager();
+    }
+}
+
+int ThreadPool::currentWorker() const
+{
+    return s_currentSlot != nullptr && s_currentSlot->pool == this ? s_currentSlot->index : -1;
+}
+
+//唤醒min(n, 睡眠线程数)个工作线程
+void ThreadPool::wakeWorkers(size_t n)
+{
+    m_workReady.notify(n < 0x7fffffff ? (int)n : 0x7fffffff);
+}
+
+//无锁模式：提交任务
+void ThreadPool::pushTask(Task task, int priority)
+{
+    if (!m_workStealing)
+    {
+        //无锁环形队列，队列满时工作线程直接执行该任务，
+        //否则所有工作线程都阻塞在提交上就没有人消费了
+        while (!m_taskQ->tryAddTask(task, priority))
+        {
+            if (s_currentSlot != nullptr && s_currentSlot->pool == this)
+            {
+                runTask(task);
+                return;
+            }
+            sched_yield();
+        }
+    }
+    else if (s_currentSlot != nullptr && s_currentSlot->pool == this && priority == PriorityNormal)
+    {
+        //工作线程自己提交的任务放入本地队列，无锁
+        s_currentSlot->deque.push(t_nodeCache.alloc(std::move(task)));
+    }
+    else if (s_currentSlot != nullptr && s_currentSlot->pool == this)
+    {
+        //本地双端队列不区分优先级，非普通优先级的任务放进自己的收件箱
+        s_currentSlot->inbox.addTask(std::move(task), priority);
+    }
+    else
+    {
+        //外部线程提交的任务分散到各个工作线程的收件箱
+        pickSlot()->inbox.addTask(std::move(task), priority);
+    }
+
+    //先增加任务计数再通知，和waitTask中的先登记再检查任务计数配对，保证不会丢失唤醒
+    m_pendingNum.fetch_add(1);
+    if (!m_workReady.notifyOne())
+    {
+        notifyManager();
+    }
+}
+
+//两次随机选择：随机挑两个存活的工作线程，把任务给队列较短的那个
+ThreadPool::WorkerSlot* ThreadPool::pickSlot()
+{
+    WorkerSlot* a;
+    WorkerSlot* b;
+    int node = m_nodeSlots.empty() ? -1 : CpuTopology::instance().currentNode();
+    if (node >= 0 && !m_nodeSlots[node].empty())
+    {
+        //绑核时从提交者所在节点的线程中挑选，任务数据留在本节点的缓存里
+        const std::vector<int>& near = m_nodeSlots[node];
+        a = &m_slots[near[fastRand() % near.size()]];
+        b = &m_slots[near[fastRand() % near.size()]];
+    }
+    else
+    {
+        a = &m_slots[fastRand() % m_maxNum];
+        b = &m_slots[fastRand() % m_maxNum];
+    }
+    if (!a->active)
+    {
+        a = b;
+    }
+    if (!b->active)
+    {
+        b = a;
+    }
+    if (!a->active)
+    {
+        //两次都没选中存活线程，顺序找一个
+        for (int i = 0; i < m_maxNum; i++)
+        {
+            if (m_slots[i].active)
+            {
+                return &m_slots[i];
+            }
+        }
+        return a;
+    }
+
+    int64_t loadA = a->deque.size() + a->inbox.taskNumber();
+    int64_t loadB = b->deque.size() + b->inbox.taskNumber();
+    return loadA <= loadB ? a : b;
+}
+
+//无锁模式：取任务
+bool ThreadPool::takeTask(WorkerSlot* slot, Task& task)
+{
+    if (!m_workStealing)
+    {
+        return m_taskQ->tryGetTask(task);
+    }
+
+    TaskNode* t = nullptr;
+    //每FairInterval次先取收件箱（自己的和被窃取者的），收件箱里的任务按优先级老化，
+    //本地队列一直有任务时也能保证外部投递、addTaskTo和低优先级的任务按时执行
+    bool fair = ++slot->ticks % FairInterval == 0;
+
+    //0、收件箱里有高优先级任务时先取收件箱，本地队列都是普通优先级
+    if ((fair || slot->inbox.topPriority() < PriorityNormal) && !slot->inbox.empty() && slot->inbox.tryGetTask(task))
+    {
+        return true;
+    }
+
+    //1、本地队列，后进先出
+    if (slot->deque.pop(t))
+    {
+        task = std::move(t->task);
+        t_nodeCache.free(t);
+        return true;
+    }
+
+    //2、自己的收件箱
+    if (!slot->inbox.empty() && slot->inbox.tryGetTask(task))
+    {
+        return true;
+    }
+
+    //3、绑核时先窃取同一节点上的线程，跨节点窃取要搬运对方缓存里的数据
+    if (slot->node >= 0)
+    {
+        const std::vector<int>& near = m_nodeSlots[slot->node];
+        size_t start = fastRand() % near.size();
+        for (size_t i = 0; i < near.size(); i++)
+        {
+            if (stealFrom(slot, &m_slots[near[(start + i) % near.size()]], task, fair))
+            {
+                return true;
+            }
+        }
+    }
+
+    //4、从随机位置开始依次窃取其他线程的任务
+    int start = fastRand() % m_maxNum;
+    for (int i = 0; i < m_maxNum; i++)
+    {
+        WorkerSlot* victim = &m_slots[(start + i) % m_maxNum];
+        if (slot->node >= 0 && victim->node == slot->node)
+        {
+            continue;
+        }
+        if (stealFrom(slot, victim, task, fair))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//从victim窃取一个任务：先取它收件箱里的高优先级任务，再取本地队列队头，最后取收件箱；
+//inboxFirst时收件箱排在本地队列前面，被窃取者自己忙着处理本地队列时收件箱也有人取
+bool ThreadPool::stealFrom(WorkerSlot* slot, WorkerSlot* victim, Task& task, bool inboxFirst)
+{
+    if (victim == slot)
+    {
+        return false;
+    }
+
+    if ((inboxFirst || victim->inbox.topPriority() < PriorityNormal) && !victim->inbox.empty() &&
+        victim->inbox.tryGetTask(task))
+    {
+        m_metrics.worker(slot->index).onSteal();
+        return true;
+    }
+
+    TaskNode* t = nullptr;
+    if (victim->deque.steal(t))
+    {
+        task = std::move(t->task);
+        t_nodeCache.free(t);
+        m_metrics.worker(slot->index).onSteal();
+        return true;
+    }
+
+    if (!victim->inbox.empty() && victim->inbox.tryGetTask(task))
+    {
+        m_metrics.worker(slot->index).onSteal();
+        return true;
+    }
+
+    return false;
+}
+
+//忙轮询线程取任务，取不到就pause后重试，从不睡眠
+bool ThreadPool::pollTask(WorkerSlot* slot, Task& task)
+{
+    while (!m_shutdown.load(std::memory_order_relaxed))
+    {
+        if (m_lockFree ? takeTask(slot, task) : m_taskQ->tryGetTask(task))
+        {
+            if (m_lockFree)
+            {
+                m_pendingNum.fetch_sub(1);
+            }
+            m_busyNum ++;
+            return true;
+        }
+        cpuRelax();
+    }
+    return false;
+}
+
+//工作线程启动后调用，这时已经运行在绑定的CPU上，
+//重新分配的本地队列和本地内存按首次访问落在本地NUMA节点
+void ThreadPool::localizeSlot(WorkerSlot* slot)
+{
+    if (slot->localized)
+    {
+        return;
+    }
+    slot->localized = true;
+
+    if (m_workStealing && slot->cpu >= 0)
+    {
+        slot->deque.localize();
+    }
+
+    if (m_affinity.scratchBytes > 0)
+    {
+        void* p = mmap(nullptr, m_affinity.scratchBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED)
+        {
+            //写一遍，让每一页都在当前节点上分配
+            memset(p, 0, m_affinity.scratchBytes);
+            slot->scratch = p;
+            slot->scratchSize = m_affinity.scratchBytes;
+        }
+    }
+}
+
+void* ThreadPool::localScratch(size_t* size)
+{
+    WorkerSlot* slot = s_currentSlot;
+    if (slot == nullptr || slot->scratch == nullptr)
+    {
+        if (size != nullptr)
+        {
+            *size = 0;
+        }
+        return nullptr;
+    }
+    if (size != nullptr)
+    {
+        *size = slot->scratchSize;
+    }
+    return slot->scratch;
+}
+
+//阻塞直到取到任务
+bool ThreadPool::waitTask(WorkerSlot* slot, Task& task)
+{
+    if (slot->busyPoll)
+    {
+        return pollTask(slot, task);
+    }
+
+    if (!m_lockFree)
     {
         //任务队列访问先加锁
-        pthread_mutex_lock(&pool->m_lock);
+        pthread_mutex_lock(&m_lock);
         //未退出并且，任务为空则阻塞
-        while(pool->m_taskQ->empty() && !pool->m_shutdown)
+        while(m_taskQ->empty() && !m_shutdown)
         {
-            //阻塞等待非空信号
-            pthread_cond_wait(&pool->m_not_Empty, &pool->m_lock);
+            //先登记再解锁检查队列，提交者先入队再通知，不会漏掉唤醒
+            m_workReady.prepareWait();
+            pthread_mutex_unlock(&m_lock);
+            bool notified = true;
+            if (m_taskQ->empty() && !m_shutdown)
+            {
+                //阻塞等待非空信号，空闲超时后检查是否需要退出
+                m_metrics.worker(slot->index).onPark();
+                notified = m_workReady.wait((int64_t)m_idleTimeoutMs.load() * 1000000);
+                m_metrics.worker(slot->index).onUnpark();
+            }
+            else
+            {
+                m_workReady.cancelWait();
+            }
+            pthread_mutex_lock(&m_lock);
             //空任务队列线程被唤醒
-            std::cout << " thread tid:" << pthread_self() << " is wake up ,cur exit num:" << pool->m_exitNum << std::endl;
+            LOG_DEBUG("thread tid:{} is wake up ,cur exit num:{}", pthread_self(), m_exitNum.load());
 
             //解除阻塞之后判断是否要销毁线程
-            //任务列表为空的线程，并且线程池需要线程退出，
-            //则减少退出线程数量
-            if (pool->m_exitNum > 0)
+            if (shouldRetire(!notified))
             {
-                //减少退出线程数量
-                pool->m_exitNum--;
-                if (pool->m_aliveNum > pool->m_minNum)
-                {
-                    pool->m_aliveNum --;
-                    pthread_mutex_unlock(&pool->m_lock);
-                    pool->threadExit();
-                }
+                m_aliveNum --;
+                threadExit(slot);
             }
         }
 
         //如果线程池要结束
-        if (pool->m_shutdown)
+        if (m_shutdown)
         {
-            //解锁，销毁
-            pthread_mutex_unlock(&pool->m_lock);
-            pool->threadExit();
+            pthread_mutex_unlock(&m_lock);
+            return false;
         }
 
         //从任务队列中取出一个任务
-        Task task = pool->m_taskQ->getTask();
+        task = m_taskQ->getTask();
         //工作线程加1
-        pool->m_busyNum ++;
+        m_busyNum ++;
         //解锁
-        pthread_mutex_unlock(&pool->m_lock);
+        pthread_mutex_unlock(&m_lock);
+        return true;
+    }
+
+    while (!m_shutdown)
+    {
+        //先不加锁地找任务
+        if (takeTask(slot, task))
+        {
+            m_pendingNum.fetch_sub(1);
+            m_busyNum ++;
+            return true;
+        }
+
+        //确实没有任务了才睡眠，先登记再检查任务计数
+        m_workReady.prepareWait();
+        if (m_pendingNum.load() > 0 || m_shutdown)
+        {
+            m_workReady.cancelWait();
+            continue;
+        }
+        m_metrics.worker(slot->index).onPark();
+        bool notified = m_workReady.wait((int64_t)m_idleTimeoutMs.load() * 1000000);
+        m_metrics.worker(slot->index).onUnpark();
 
-        //执行任务
-        std::cout << "arg:" << task.getArg() << " callback" << std::endl;
-        task.function(task.arg);
+        //管理者要求减少线程，或者空闲超时，才需要加锁判断
+        if (!notified || m_exitNum.load() > 0)
+        {
+            pthread_mutex_lock(&m_lock);
+            if (shouldRetire(!notified))
+            {
+                m_aliveNum --;
+                threadExit(slot);
+            }
+            pthread_mutex_unlock(&m_lock);
+        }
+    }
 
-        //释放任务参数指针
-        free(task.arg);
-        task.arg = NULL;
+    return false;
+}
 
+//工作线程任务函数
+void* ThreadPool::worker(void* arg)
+{
+    //强转参数
+    WorkerSlot* slot = static_cast<WorkerSlot*>(arg);
+    ThreadPool* pool = slot->pool;
+    s_currentSlot = slot;
+    pool->localizeSlot(slot);
+
+    //循环执行任务
+    Task task;
+    while (pool->waitTask(slot, task))
+    {
+        pool->runTask(task);
         //任务执行完成，工作线程减1
-        pthread_mutex_lock(&pool->m_lock);
         pool->m_busyNum --;
-        pthread_mutex_unlock(&pool->m_lock);
-        
+        pool->m_completedNum.fetch_add(1, std::memory_order_relaxed);
     }
 
+    //线程池销毁，线程保持可连接状态，由析构函数回收
     return nullptr;
 }
 
+//执行任务，执行完立即释放任务捕获的资源
+//只在本线程池的工作线程上调用，包括环形队列满时提交者直接执行的任务
+void ThreadPool::runTask(Task& task)
+{
+    uint64_t enqueued = task.enqueueTime();
+    uint64_t start = m_metrics.stamp();
+    task();
+    task.reset();
+    m_metrics.worker(s_currentSlot->index).onTask(enqueued, start, start != 0 ? metricsNowNs() : 0);
+}
+
+std::shared_ptr<PoolLink> poolLink(ThreadPool* pool)
+{
+    return pool != nullptr ? pool->m_link : nullptr;
+}
+
+//Future的续延投递到线程池：先登记再读线程池指针，和析构函数的先断开再等登记归零配对，
+//读到指针之后线程池不会被释放
+bool scheduleOnPool(PoolLink* link, Task&& task)
+{
+    link->users.fetch_add(1);
+    ThreadPool* pool = link->pool.load();
+    bool ok = pool != nullptr && !pool->m_shutdown;
+    if (ok)
+    {
+        //和关闭同时发生时addTask仍可能丢弃任务，任务里的FutureDropGuard会让Future以异常结束
+        pool->addTask(std::move(task));
+    }
+    link->users.fetch_sub(1);
+    return ok;
+}
+
+//获得忙线程个数
+const int ThreadPool::getBusyNumber()
+{
+    return m_busyNum.load();
+}
+
+//获得活着的线程个数
+const int ThreadPool::getAliveNumber()
+{
+    return m_aliveNum.load();
+}
+
+//获得控制器的目标线程数
+int ThreadPool::getTargetNumber() const
+{
+    return m_targetNum.load();
+}
+
+void ThreadPool::setTunables(const Tunables& tunables)
+{
+    pthread_mutex_lock(&m_lock);
+    m_tunables = tunables;
+    m_idleTimeoutMs = tunables.idleTimeoutMs;
+    pthread_cond_signal(&m_managerCond);
+    pthread_mutex_unlock(&m_lock);
+}
+
+ThreadPool::Tunables ThreadPool::getTunables()
+{
+    pthread_mutex_lock(&m_lock);
+    Tunables t = m_tunables;
+    pthread_mutex_unlock(&m_lock);
+    return t;
+}
+
+std::vector<ThreadPool::Decision> ThreadPool::getDecisions()
+{
+    std::vector<Decision> out;
+    pthread_mutex_lock(&m_lock);
+    uint64_t begin = m_decisionNum > MaxDecisions ? m_decisionNum - MaxDecisions : 0;
+    for (uint64_t i = begin; i < m_decisionNum; i++)
+    {
+        out.push_back(m_decisions[i % MaxDecisions]);
+    }
+    pthread_mutex_unlock(&m_lock);
+    return out;
+}
+
+PoolMetricsSnapshot ThreadPool::getMetrics()
+{
+    return m_metrics.snapshot();
+}
+
+void ThreadPool::setMetricsTiming(bool enable)
+{
+    m_metrics.setTiming(enable);
+}
+
+//记录一条决策，只保留最近MaxDecisions条
+void ThreadPool::logDecision(int64_t now, double throughput, int pending, int alive, int target, const char* reason)
+{
+    Decision& d = m_decisions[m_decisionNum % MaxDecisions];
+    d.timeNs = now;
+    d.throughput = throughput;
+    d.pending = pending;
+    d.alive = alive;
+    d.target = target;
+    d.reason = reason;
+    m_decisionNum++;
+}
+
+//积压的任务数
+int ThreadPool::pendingNumber()
+{
+    return m_lockFree ? m_pendingNum.load() : m_taskQ->taskNumber();
+}
+
+//提交任务时发现没有空闲线程，通知控制器尽快检查是否需要加线程
+void ThreadPool::notifyManager()
+{
+    if (m_workReady.waiters() > 0 || m_aliveNum.load() >= m_maxNum || m_managerWake.load())
+    {
+        return;
+    }
+    if (!m_managerWake.exchange(true))
+    {
+        pthread_mutex_lock(&m_lock);
+        pthread_cond_signal(&m_managerCond);
+        pthread_mutex_unlock(&m_lock);
+    }
+}
+
+//创建一个工作线程，从空闲槽位栈顶取一个槽位
+bool ThreadPool::spawnWorker()
+{
+    if (m_freeTop == 0)
+    {
+        return false;
+    }
+
+    int index = m_freeSlots[--m_freeTop];
+    WorkerSlot* slot = &m_slots[index];
+    //创建时就设置好亲和性，线程从第一条指令起就运行在目标CPU上
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (!m_affinity.cpus.empty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (slot->cpu >= 0)
+        {
+            CPU_SET(slot->cpu, &set);
+        }
+        else
+        {
+            for (size_t i = 0; i < m_affinity.cpus.size(); i++)
+            {
+                CPU_SET(m_affinity.cpus[i], &set);
+            }
+        }
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    slot->active = true;
+    int ret = pthread_create(&m_threadIDs[index], &attr, worker, slot);
+    pthread_attr_destroy(&attr);
+    if (ret != 0)
+    {
+        m_slots[index].active = false;
+        m_threadIDs[index] = 0;
+        m_freeSlots[m_freeTop++] = index;
+        return false;
+    }
+    m_aliveNum++;
+    return true;
+}
+
+//空闲线程是否应该退出：控制器要求减少线程，或者空闲超时并且线程数多于目标值
+bool ThreadPool::shouldRetire(bool timedOut)
+{
+    if (m_shutdown || m_aliveNum <= m_minNum || m_aliveNum <= m_targetNum)
+    {
+        m_exitNum = 0;
+        return false;
+    }
+    if (m_exitNum > 0)
+    {
+        m_exitNum--;
+        return true;
+    }
+    return timedOut;
+}
+
 //管理者线程任务函数
 void* ThreadPool::manager(void* arg)
 {
     //参数强转
     ThreadPool* pool = static_cast<ThreadPool*>(arg);
-    //线程池没关闭就一直检测
-    while(!pool->m_shutdown)
-    {
-        //每5s监控一次线程池状态
-        sleep(5);
-        //取出任务数量和线程数量
-        pthread_mutex_lock(&pool->m_lock);
-        int queuesize = pool->m_taskQ->taskNumber();
-        int liveNum = pool->m_aliveNum;
-        int busyNum = pool->m_busyNum;
-        pthread_mutex_unlock(&pool->m_lock);
-
-        //创建线程
-        const int NUMBER = 2;
-        //当前任务太多，需要增加线程处理
-        if (queuesize > liveNum && liveNum < pool->m_maxNum)
-        {
-            //线程池加锁
-            pthread_mutex_lock(&pool->m_lock);
-            int num = 0;
-            for (int i = 0; i < pool->m_maxNum && num < NUMBER && pool->m_aliveNum < pool->m_maxNum; i++)
+    pool->controlLoop();
+    return nullptr;
+}
+
+/**
+ * 并发控制循环
+ * 1、线程池空闲时管理者一直阻塞，只有提交任务时发现没有空闲线程才被唤醒
+ * 2、有积压并且没有空闲线程：立即加一个线程（有冷却时间），应对突发流量
+ * 3、线程池繁忙时每个采样周期计算一次吞吐量，用爬山算法调整目标线程数
+ * 4、多余的线程由空闲超时的工作线程自己退出，或者由管理者通知退出
+*/
+void ThreadPool::controlLoop()
+{
+    int64_t lastSample = nowNs();
+    uint64_t lastCompleted = m_completedNum.load();
+    int64_t lastGrow = 0;
+
+    pthread_mutex_lock(&m_lock);
+    while (!m_shutdown)
+    {
+        m_managerWake = false;
+        bool idle = pendingNumber() == 0 && m_busyNum.load() == 0;
+        if (idle && m_targetNum > m_minNum)
+        {
+            //线程池完全空闲，目标值回到最小线程数，多余的线程空闲超时后退出
+            m_targetNum = m_minNum;
+            logDecision(nowNs(), 0, 0, m_aliveNum, m_minNum, "pool idle, shrink to min");
+        }
+        if (!idle || m_aliveNum > m_targetNum)
+        {
+            struct timespec deadline = deadlineAfterMs(m_tunables.sampleIntervalMs);
+            pthread_cond_timedwait(&m_managerCond, &m_lock, &deadline);
+        }
+        else
+        {
+            pthread_cond_wait(&m_managerCond, &m_lock);
+            //空闲期间的完成数不计入吞吐量
+            lastSample = nowNs();
+            lastCompleted = m_completedNum.load();
+        }
+        if (m_shutdown)
+        {
+            break;
+        }
+
+        int64_t now = nowNs();
+        int pending = pendingNumber();
+        int alive = m_aliveNum;
+        int target = m_targetNum;
+
+        //队列积压并且没有空闲线程，立即加线程
+        if (pending > 0 && m_workReady.waiters() == 0 && alive < m_maxNum
+            && now - lastGrow >= (int64_t)m_tunables.growCooldownMs * 1000000)
+        {
+            if (spawnWorker())
             {
-                if (pool->m_threadIDs[i] == 0)
+                lastGrow = now;
+                if (m_aliveNum > target)
                 {
-                    pthread_create(&pool->m_threadIDs[i], NULL, worker, pool);
-                    num ++;
-                    pool->m_aliveNum++;
+                    target = m_aliveNum;
+                    m_targetNum = target;
                 }
+                logDecision(now, 0, pending, alive, target, "backlog with no idle worker, grow");
+                alive = m_aliveNum;
             }
+        }
 
-            //线程池解锁
-            pthread_mutex_unlock(&pool->m_lock);
+        //采样周期到了，爬山
+        int64_t elapsed = now - lastSample;
+        if (elapsed < (int64_t)m_tunables.sampleIntervalMs * 1000000)
+        {
+            continue;
         }
-        
-        //当前任务太少，需要减少线程，减轻系统负担
-        if (busyNum * 2 < liveNum && liveNum > pool->m_minNum + NUMBER)
+        uint64_t completed = m_completedNum.load();
+        uint64_t samples = completed - lastCompleted;
+        //任务比采样周期长时一个周期完成不了几个任务，延长窗口直到样本足够，最多MaxSampleWindows个周期
+        if (pending > 0 && samples < (uint64_t)HillClimbing::MinSampleTasks
+            && elapsed < (int64_t)m_tunables.sampleIntervalMs * 1000000 * MaxSampleWindows)
         {
-            //加锁
-            pthread_mutex_lock(&pool->m_lock);
-            pool->m_exitNum = NUMBER;
-            //解锁
-            pthread_mutex_unlock(&pool->m_lock);
+            continue;
+        }
+        double throughput = (double)samples * 1e9 / elapsed;
+        lastSample = now;
+        lastCompleted = completed;
+
+        const char* reason = "";
+        int newTarget = m_climber.update(throughput, samples, pending, m_busyNum.load(), target,
+            m_minNum, m_maxNum, m_tunables.step, m_tunables.threshold, reason);
+        if (newTarget == target && alive == target)
+        {
+            continue;
+        }
+        m_targetNum = newTarget;
+        logDecision(now, throughput, pending, alive, newTarget, reason);
 
-            //唤醒线程，自动删除无任务的线程
-            for (int i = 0; i < NUMBER; i++)
+        if (newTarget > alive && pending > 0)
+        {
+            //只有积压时才加线程
+            for (int i = alive; i < newTarget; i++)
             {
-                pthread_cond_signal(&pool->m_not_Empty);
+                spawnWorker();
             }
         }
+        else if (newTarget < alive)
+        {
+            //通知多余的空闲线程退出
+            m_exitNum = alive - newTarget;
+            m_workReady.notify(alive - newTarget);
+        }
     }
-
-    return nullptr;
+    pthread_mutex_unlock(&m_lock);
 }
 
 //线程退出
-void ThreadPool::threadExit()
+void ThreadPool::threadExit(WorkerSlot* slot)
 {
-    pthread_t tid = pthread_self();
-    for (int i = 0; i < m_maxNum; i++)
+    //槽位直接由参数给出，归还到空闲槽位栈
+    m_threadIDs[slot->index] = 0;
+    slot->active = false;
+    m_freeSlots[m_freeTop++] = slot->index;
+    //退出前如果还有任务，把唤醒传递给其他线程
+    if (!m_taskQ->empty() || m_pendingNum.load() > 0)
     {
-        if (m_threadIDs[i] == tid)
-        {
-            m_threadIDs[i] = 0;
-            break;
-        }
+        m_workReady.notifyOne();
     }
+    pthread_mutex_unlock(&m_lock);
 
+    //被回收的线程没有人join，分离后退出
+    pthread_detach(pthread_self());
     pthread_exit(NULL);
 }
@@ -2,44 +2,276 @@
 #define _THREAD_POOL_H_
 
 #include "TaskQueue.h"
+#include "WorkStealingQueue.h"
+#include "Future.h"
+#include "HillClimbing.h"
+#include "../common/PoolMetrics.h"
+#include "../common/Topology.h"
+#include "../common/EventCount.h"
+#include "../common/TimerWheel.h"
 #include <thread>
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+//工作窃取队列中的任务节点，定义在ThreadPool.cpp中
+struct TaskNode;
+//定时任务，定义在ThreadPool.cpp中
+struct ScheduledTask;
+//co_await pool.schedule()的等待对象，定义在Coroutine.h中
+class ScheduleAwaiter;
 
 class ThreadPool
 {
 public:
-    ThreadPool(const int min, const int max);
+    //并发控制器的可调参数
+    struct Tunables
+    {
+        //线程池繁忙时的吞吐量采样周期
+        int sampleIntervalMs = 100;
+        //工作线程空闲超过该时间，并且线程数多于目标值时退出
+        int idleTimeoutMs = 2000;
+        //因为队列积压而连续加线程的最小间隔
+        int growCooldownMs = 10;
+        //爬山算法每次调整的线程数
+        int step = 1;
+        //吞吐量变化超过该比例才认为有变化
+        double threshold = 0.05;
+    };
+
+    //控制器的一条决策记录
+    struct Decision
+    {
+        int64_t timeNs;         //CLOCK_MONOTONIC时间
+        double throughput;      //任务数/秒
+        int pending;            //积压任务数
+        int alive;              //决策前的线程数
+        int target;             //决策后的目标线程数
+        const char* reason;
+    };
+
+    //工作线程的绑核和NUMA配置
+    struct Affinity
+    {
+        //工作线程可以使用的CPU，为空表示不绑核
+        std::vector<int> cpus;
+        //true：第i个槽位的线程只绑定cpus[i % cpus.size()]；false：所有线程共用整个CPU集合
+        bool pinEach = true;
+        //每个工作线程的本地内存大小（字节），由工作线程绑核后自己分配，落在本地NUMA节点上
+        size_t scratchBytes = 0;
+        //忙轮询的工作线程数，占用最前面的槽位，从不睡眠也不退出，适合隔离出来的核，不超过min
+        int busyPollWorkers = 0;
+    };
+
+    //workStealing为true时，每个工作线程拥有自己的任务队列，空闲线程从其他线程窃取任务
+    //queueCapacity大于0时共享任务队列使用无锁有界环形队列，取任务不再需要加锁
+    ThreadPool(const int min, const int max, const bool workStealing = false, const size_t queueCapacity = 0);
+    //绑核后，工作窃取优先窃取同一NUMA节点上的线程，外部提交的任务优先交给提交者所在节点的线程
+    ThreadPool(const int min, const int max, const bool workStealing, const size_t queueCapacity,
+               const Affinity& affinity);
     ThreadPool() : ThreadPool(5, 20) {}
     ~ThreadPool();
 
-    //添加任务
-    void addTask(Task task);
-    //添加任务
-    void addTask(callback func, void* arg);
+    //添加任务，可以是任意可调用对象，例如带捕获的lambda
+    //priority为TaskPriority，高优先级的任务先执行，低优先级的任务有老化不会饿死
+    void addTask(Task task, int priority = PriorityNormal);
+    //添加任务，arg由调用者负责释放
+    void addTask(callback func, void* arg, int priority = PriorityNormal);
+    //批量添加同一优先级的任务，整批只加一次锁，最多唤醒min(n, 空闲线程数)个线程，任务会被移走
+    void addTasks(Task* tasks, size_t n, int priority = PriorityNormal);
+    template <typename It>
+    void addTasks(It begin, It end, int priority = PriorityNormal);
+    //添加任务，尽量交给下标为worker的工作线程执行（仅工作窃取模式，其他模式等同addTask），
+    //该线程忙不过来时任务仍然可以被其他线程窃取
+    void addTaskTo(int worker, Task task, int priority = PriorityNormal);
+    //当前线程在本线程池中的工作线程下标，不是本线程池的工作线程返回-1
+    int currentWorker() const;
+    //提交任务并返回结果，可以通过then继续在线程池上处理结果；
+    //线程池关闭时还没有执行的任务和续延都被丢弃，它们的Future以runtime_error结束
+    template <typename F>
+    Future<decltype(std::declval<F&>()())> submit(F&& f, int priority = PriorityNormal);
+    //协程中co_await pool.schedule()切到线程池上继续执行，需要包含Coroutine.h（C++20）
+    ScheduleAwaiter schedule(int priority = PriorityNormal);
+    //delayMs毫秒后把任务放进任务队列，返回定时器编号，线程池已经关闭或创建定时器线程失败返回0
+    TimerId scheduleAfter(int64_t delayMs, Task task, int priority = PriorityNormal);
+    //每隔periodMs毫秒把任务放进任务队列一次，上一次还在排队或执行时跳过这一次，不会重叠执行
+    TimerId scheduleEvery(int64_t periodMs, Task task, int priority = PriorityNormal);
+    //取消定时任务，还没到期返回true，已经放进任务队列的那一次不受影响
+    bool cancelTimer(TimerId id);
     //获得忙线程个数
     const int getBusyNumber();
     //获得活着的线程个数
     const int getAliveNumber();
+    //获得控制器当前的目标线程数
+    int getTargetNumber() const;
+    //设置/获取控制器参数
+    void setTunables(const Tunables& tunables);
+    Tunables getTunables();
+    //最近的控制器决策，按时间先后排列
+    std::vector<Decision> getDecisions();
+    //性能指标快照：每个工作线程的计数器，以及排队时间、执行时间直方图
+    PoolMetricsSnapshot getMetrics();
+    //是否统计排队时间和执行时间，打开后每个任务多两三次取时钟
+    void setMetricsTiming(bool enable);
+    //当前工作线程的本地内存，size返回大小，不是工作线程或没有配置时返回nullptr
+    static void* localScratch(size_t* size);
 
 private:
+    //工作窃取模式下每取这么多次任务，先取一次收件箱再取本地队列（和Go调度器的61相同），
+    //否则一直往本地队列压任务的线程永远取不到收件箱里外部投递的任务
+    static const uint32_t FairInterval = 61;
+    //吞吐量采样窗口最多延长到多少个采样周期
+    static const int MaxSampleWindows = 10;
+
+    //工作线程槽位，每个槽位对应m_threadIDs中的一个下标
+    struct WorkerSlot
+    {
+        ThreadPool* pool;
+        int index;
+        //绑定的CPU和所在的NUMA节点，没有绑到单个CPU时为-1
+        int cpu;
+        int node;
+        //忙轮询线程，从不睡眠
+        bool busyPoll;
+        //本地队列是否已经在绑核后重新分配过
+        bool localized;
+        //本地内存，槽位第一个线程分配，之后复用
+        void* scratch;
+        size_t scratchSize;
+        //槽位上是否有存活的工作线程
+        std::atomic<bool> active;
+        //本地双端队列，工作线程自己提交的任务放这里（仅工作窃取模式）
+        WorkStealingQueue<TaskNode*> deque;
+        //外部线程投递给该工作线程的任务，以及非普通优先级的任务（仅工作窃取模式）
+        TaskQueue inbox;
+        //取任务的次数，只有本槽位的工作线程读写，每FairInterval次先看收件箱
+        uint32_t ticks;
+    };
+
     //工作线程的任务函数
     static void* worker(void* arg);
     //管理者线程的任务函数
     static void* manager(void* arg);
-    //线程退出
-    void threadExit();
+    //并发控制循环
+    void controlLoop();
+    //创建一个工作线程，调用前需持有m_lock
+    bool spawnWorker();
+    //判断空闲的工作线程是否应该退出，调用前需持有m_lock
+    bool shouldRetire(bool timedOut);
+    //有积压且没有空闲线程时通知控制器
+    void notifyManager();
+    //记录一条决策，调用前需持有m_lock
+    void logDecision(int64_t now, double throughput, int pending, int alive, int target, const char* reason);
+    //积压的任务数
+    int pendingNumber();
+    //线程退出，调用前需持有m_lock
+    void threadExit(WorkerSlot* slot);
+    //阻塞直到取到一个任务，线程池销毁时返回false
+    bool waitTask(WorkerSlot* slot, Task& task);
+    //无锁模式：不加锁地取任务，工作窃取时依次从本地队列、收件箱、其他线程窃取
+    bool takeTask(WorkerSlot* slot, Task& task);
+    //无锁模式：提交一个任务，只有存在睡眠线程时才加锁唤醒
+    void pushTask(Task task, int priority);
+    //执行一个任务
+    void runTask(Task& task);
+    //唤醒最多n个睡眠的工作线程
+    void wakeWorkers(size_t n);
+    //定时器线程上调用，把一批到期的定时任务按优先级分组批量放进任务队列
+    void dispatchTimers(std::vector<std::shared_ptr<ScheduledTask> >& batch);
+    //工作窃取模式：两次随机选择，挑选负载较轻的工作线程，绑核时优先提交者所在节点
+    WorkerSlot* pickSlot();
+    //从victim窃取一个任务，inboxFirst为true时先取它的收件箱
+    bool stealFrom(WorkerSlot* slot, WorkerSlot* victim, Task& task, bool inboxFirst);
+    //忙轮询线程取任务，线程池销毁时返回false
+    bool pollTask(WorkerSlot* slot, Task& task);
+    //工作线程启动后在本地节点上分配本地队列和本地内存
+    void localizeSlot(WorkerSlot* slot);
 
 private:
     pthread_mutex_t m_lock;
-    pthread_cond_t m_not_Empty;
+    //空闲的工作线程在这里睡眠，提交任务时没有线程睡眠就不进内核，有则只唤醒确定的一个
+    EventCount m_workReady;
+    //唤醒控制器，和m_lock配合使用
+    pthread_cond_t m_managerCond;
     pthread_t* m_threadIDs;
     pthread_t m_managerID;
     TaskQueue* m_taskQ;
+    WorkerSlot* m_slots;
     int m_minNum;
     int m_maxNum;
-    int m_busyNum;
-    int m_aliveNum;
-    int m_exitNum;
-    bool m_shutdown;
+    std::atomic<int> m_busyNum;
+    std::atomic<int> m_aliveNum;
+    //管理者要求退出的线程数，唤醒的线程不加锁检查它，决定要不要加锁退出
+    std::atomic<int> m_exitNum;
+    std::atomic<bool> m_shutdown;
+    bool m_workStealing;
+    //工作窃取或无锁队列模式，取任务不需要持有m_lock
+    bool m_lockFree;
+    //无锁模式下还未被取走的任务数
+    std::atomic<int> m_pendingNum;
+    //m_tunables.idleTimeoutMs的副本，工作线程不加锁读取
+    std::atomic<int> m_idleTimeoutMs;
+    //控制器的目标线程数
+    std::atomic<int> m_targetNum;
+    //已完成的任务数，用来计算吞吐量
+    std::atomic<uint64_t> m_completedNum;
+    //已经有人通知过控制器，避免重复唤醒
+    std::atomic<bool> m_managerWake;
+    //空闲槽位栈，创建和回收线程都是O(1)，m_lock保护
+    int* m_freeSlots;
+    int m_freeTop;
+    //以下由m_lock保护
+    Tunables m_tunables;
+    HillClimbing m_climber;
+    static const int MaxDecisions = 64;
+    Decision m_decisions[MaxDecisions];
+    uint64_t m_decisionNum;
+    //每个槽位一份指标，下标和m_slots一致
+    PoolMetrics m_metrics;
+    Affinity m_affinity;
+    //每个NUMA节点上的槽位下标，只有绑到单个CPU时才有
+    std::vector<std::vector<int> > m_nodeSlots;
+    //延迟任务和周期任务的时间轮，第一次使用时才创建定时器线程
+    TimerWheel<std::shared_ptr<ScheduledTask> >* m_timers;
+
+    //Future共享状态对线程池的引用，析构时断开
+    std::shared_ptr<PoolLink> m_link;
+
+    //当前线程所属的槽位，外部线程为nullptr
+    static thread_local WorkerSlot* s_currentSlot;
+
+    friend std::shared_ptr<PoolLink> poolLink(ThreadPool* pool);
+    friend bool scheduleOnPool(PoolLink* link, Task&& task);
 };
 
-#endif // !_THREAD_POOL_H_
\ No newline at end of file
+template <typename It>
+void ThreadPool::addTasks(It begin, It end, int priority)
+{
+    std::vector<Task> batch;
+    for (; begin != end; ++begin)
+    {
+        batch.emplace_back(std::move(*begin));
+    }
+    addTasks(batch.data(), batch.size(), priority);
+}
+
+template <typename F>
+Future<decltype(std::declval<F&>()())> ThreadPool::submit(F&& f, int priority)
+{
+    typedef decltype(std::declval<F&>()()) R;
+    std::shared_ptr<FutureState<R> > state = std::make_shared<FutureState<R> >(m_link);
+    if (m_shutdown)
+    {
+        state->setException(std::make_exception_ptr(std::runtime_error("thread pool is shut down")));
+        return Future<R>(state);
+    }
+
+    //任务在关闭时被丢弃（addTask发现已经关闭，或者析构时还在队列里），guard让Future以异常结束
+    addTask(Task([state, guard = FutureDropGuard(state), fn = typename std::decay<F>::type(std::forward<F>(f))]() mutable
+    {
+        FutureSetter<R>::run(*state, fn);
+    }), priority);
+    return Future<R>(state);
+}
+
+#endif // !_THREAD_POOL_H_
@@ -0,0 +1,181 @@
+#ifndef _WORK_STEALING_QUEUE_H_
+#define _WORK_STEALING_QUEUE_H_
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * Chase-Lev 工作窃取双端队列（Lê 等人给出的 C11 内存序版本）
+ *
+ * 1、只有拥有者线程可以调用 push/pop，在队尾（bottom）操作，后进先出，缓存更热
+ * 2、其他线程调用 steal，从队头（top）窃取，先进先出
+ * 3、只有队列中剩最后一个元素时，拥有者和窃取者才需要通过 CAS 竞争
+ *
+ * 元素类型 T 必须能放进 std::atomic（一般为指针），队列满时自动扩容，
+ * 旧数组可能仍被窃取者读取，所以留到析构时统一释放。
+*/
+template <typename T>
+class WorkStealingQueue
+{
+public:
+    explicit WorkStealingQueue(int64_t capacity = 256) :
+    m_top(0),
+    m_bottom(0)
+    {
+        //容量向上取整为2的幂，下标用位与取模
+        int64_t cap = 1;
+        while (cap < capacity)
+        {
+            cap <<= 1;
+        }
+        m_array.store(new Array(cap), std::memory_order_relaxed);
+    }
+
+    ~WorkStealingQueue()
+    {
+        for (Array* a : m_garbage)
+        {
+            delete a;
+        }
+        delete m_array.load(std::memory_order_relaxed);
+    }
+
+    WorkStealingQueue(const WorkStealingQueue&) = delete;
+    WorkStealingQueue& operator=(const WorkStealingQueue&) = delete;
+
+    //拥有者线程：压入队尾
+    void push(T item)
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        Array* a = m_array.load(std::memory_order_relaxed);
+        //队列已满，扩容
+        if (b - t > a->capacity - 1)
+        {
+            Array* bigger = a->grow(b, t);
+            m_garbage.push_back(a);
+            a = bigger;
+            m_array.store(a, std::memory_order_release);
+        }
+        a->put(b, item);
+        //release保证窃取者看到新的bottom时也能看到元素
+        m_bottom.store(b + 1, std::memory_order_release);
+    }
+
+    //拥有者线程：从队尾弹出
+    bool pop(T& item)
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        Array* a = m_array.load(std::memory_order_relaxed);
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+
+        if (t > b)
+        {
+            //队列为空，恢复bottom
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        item = a->get(b);
+        if (t == b)
+        {
+            //最后一个元素，和窃取者竞争
+            bool won = m_top.compare_exchange_strong(t, t + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    //其他线程：从队头窃取
+    bool steal(T& item)
+    {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if (t >= b)
+        {
+            return false;
+        }
+
+        Array* a = m_array.load(std::memory_order_acquire);
+        T x = a->get(t);
+        //CAS失败说明被其他窃取者或拥有者抢走了
+        if (!m_top.compare_exchange_strong(t, t + 1,
+            std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            return false;
+        }
+        item = x;
+        return true;
+    }
+
+    //拥有者线程：在当前线程上重新分配同样大小的数组并拷贝元素，
+    //线程绑核后调用，数组按首次访问落在本地NUMA节点上
+    void localize()
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        Array* a = m_array.load(std::memory_order_relaxed);
+        Array* local = a->copy(a->capacity, b, t);
+        m_garbage.push_back(a);
+        m_array.store(local, std::memory_order_release);
+    }
+
+    //近似的元素个数，只用于负载均衡的参考
+    inline int64_t size() const
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        return b > t ? b - t : 0;
+    }
+
+    inline bool empty() const
+    {
+        return size() == 0;
+    }
+
+private:
+    struct Array
+    {
+        int64_t capacity;
+        int64_t mask;
+        std::atomic<T>* slots;
+
+        explicit Array(int64_t cap) : capacity(cap), mask(cap - 1), slots(new std::atomic<T>[cap]) {}
+        ~Array() { delete[] slots; }
+
+        inline T get(int64_t i) { return slots[i & mask].load(std::memory_order_relaxed); }
+        inline void put(int64_t i, T x) { slots[i & mask].store(x, std::memory_order_relaxed); }
+
+        //扩容为原来的两倍，并拷贝[t, b)之间的元素
+        Array* grow(int64_t b, int64_t t)
+        {
+            return copy(capacity * 2, b, t);
+        }
+
+        //分配容量为cap的新数组，并拷贝[t, b)之间的元素
+        Array* copy(int64_t cap, int64_t b, int64_t t)
+        {
+            Array* a = new Array(cap);
+            for (int64_t i = t; i < b; i++)
+            {
+                a->put(i, get(i));
+            }
+            return a;
+        }
+    };
+
+    //top和bottom分别被窃取者和拥有者频繁修改，放在不同的缓存行避免伪共享
+    alignas(64) std::atomic<int64_t> m_top;
+    alignas(64) std::atomic<int64_t> m_bottom;
+    alignas(64) std::atomic<Array*> m_array;
+    //只由拥有者线程访问
+    std::vector<Array*> m_garbage;
+};
+
+#endif // _WORK_STEALING_QUEUE_H_
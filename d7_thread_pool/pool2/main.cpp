@@ -1,10 +1,12 @@
 /**
- * g++ -o thread_pool main.cpp Task.h TaskQueue.h ThreadPool.cpp -lpthread
+ * g++ -std=c++20 -o thread_pool main.cpp Task.h TaskQueue.h MPMCQueue.h WorkStealingQueue.h Future.h HillClimbing.h ../common/PoolMetrics.h ../common/AsyncLog.h ../common/Priority.h ../common/Topology.h ../common/Parallel.h ../common/EventCount.h ../common/TimerWheel.h ../common/TaskGroup.h ../common/Locks.h Coroutine.h Strand.h ThreadPool.cpp -lpthread
  * 
  * 该线程池的实现思路：
  * 1. 线程池中创建一个任务队列，用于存储任务
  * 2. 同时创建一定数量的工作者线程，用于从任务队列获取任务并执行任务
  * 3、线程池创建一个管理线程，来动态调整工作线程的数量
+ *    管理线程平时阻塞，提交任务发现没有空闲线程时被唤醒；繁忙时按采样周期测吞吐量，
+ *    用爬山算法选择线程数，空闲线程超时后自己退出
  * 
  * 缺点：
  * 1、频繁的加锁和解锁操作
@@ -14,30 +16,177 @@
  * 每个线程都会创建单独的锁和条件变量，在任务添加的时候，先获取工作任务少的线程，添加到该线程中
  * 这样可以减少频繁的锁操作，同时，也不会存在惊群问题
  * 
+ * 工作窃取模式（ThreadPool(min, max, true)）：
+ * 1、每个工作线程拥有一个Chase-Lev双端队列，工作线程内部提交的任务直接压入本地队列，无锁
+ * 2、外部线程提交的任务随机挑两个工作线程，放入队列较短的那个的收件箱
+ * 3、空闲线程先取本地队列，再取收件箱，最后从其他线程队头窃取，都没有任务时才加锁睡眠
+ * 4、每取61次任务先取一次收件箱（窃取时也先取对方的收件箱），一直往本地队列压任务的线程
+ *    也不会饿死外部投递的任务和低优先级任务
+ * 
+ * 绑核（ThreadPool::Affinity）：
+ * 1、工作线程创建时就绑定CPU，本地队列和本地内存由绑核后的工作线程自己分配，落在本地NUMA节点
+ * 2、窃取时先找同一节点的线程，外部提交的任务优先交给提交者所在节点的线程
+ * 3、可以指定若干忙轮询线程，放在隔离的核上，从不睡眠，省掉唤醒的延迟
+ * 
+ * 队列锁（../common/Locks.h）：
+ * 1、加锁的任务队列和工作线程的收件箱默认用pthread_mutex_t保护
+ * 2、编译时加-DTASK_QUEUE_LOCK=AdaptiveMutex（McsLock、TicketLock）换成自旋后再睡眠的锁或者队列锁，
+ *    任务很短、队列锁竞争激烈时不用每次都进内核
+ * 
+ * 睡眠和唤醒（../common/EventCount.h）：
+ * 1、空闲线程在futex事件计数上睡眠，每个线程睡在自己的futex字上
+ * 2、提交任务时没有线程睡眠就不加锁也不进内核，有则只唤醒一个确定的线程，没有惊群
+ * 
+ * 定时任务（../common/TimerWheel.h）：
+ * 1、scheduleAfter/scheduleEvery把任务挂到分层时间轮上，添加和取消都是O(1)
+ * 2、一个定时器线程在timerfd上等待，同一时刻到期的任务整批放进普通任务队列
+ * 
+ * 任务组（../common/TaskGroup.h）：
+ * 1、spawn把任务提交到组里，wait只等这一组任务，调用线程帮着执行组里排队的任务
+ * 2、cancel之后组里排队的任务不再执行，正在执行的任务通过取消标志协作退出
+ * 
+ * 协程（Coroutine.h）：
+ * 1、CoTask<T>在等待时挂起而不是阻塞工作线程，co_await pool.schedule()切到线程池上执行
+ * 2、when_all并发等待多个子任务，完成后通过对称转移切回等待者，协程帧按线程缓存复用
+ * 
+ * 串行执行器（Strand.h）：
+ * 1、同一个strand或同一个key的任务按提交顺序一个接一个执行，不同key并行，执行用户代码时不持锁
+ * 2、strand记住上次执行的工作线程，之后的任务尽量交给同一个线程，会话状态留在同一个核的缓存里
+ * 
 */
 #include "ThreadPool.h"
+#include "../common/Parallel.h"
+#include "../common/TaskGroup.h"
+#include "Coroutine.h"
+#include "Strand.h"
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <vector>
 #include <unistd.h>
 
-void taskFunc(void* arg)
+void taskFunc(int num)
 {
-    int num = *(int*)arg;
     std::cout << "thread tid:" << pthread_self() << " is working, number = " << num << std::endl;
     sleep(1);
 }
 
-int main()
+//一个请求流程：并发查询两次，再等待一段时间，等待期间不占用工作线程
+CoTask<int> query(ThreadPool& pool, int key)
 {
-    //创建线程池
-    ThreadPool* pool = new ThreadPool(2, 5);
+    co_await pool.schedule();
+    co_return key % 10;
+}
+
+CoTask<int> handleRequest(ThreadPool& pool, int id)
+{
+    co_await pool.schedule();
+    auto [a, b] = co_await when_all(query(pool, id), query(pool, id + 1));
+    co_await coSleep(pool, 100);
+    co_return a + b;
+}
+
+int main(int argc, char* argv[])
+{
+    //创建线程池，带任意参数运行时使用工作窃取模式
+    ThreadPool* pool = new ThreadPool(2, 5, argc > 1);
+    //统计排队时间和执行时间
+    pool->setMetricsTiming(true);
+    //定时任务：每秒打印一次忙线程数，5秒后打印一次，取消后不再执行；
+    //在提交任务之前注册，和后面的任务同时运行，高优先级不用排在这一批任务后面
+    TimerId ticker = pool->scheduleEvery(1000, [pool]()
+    {
+        std::cout << "timer: busy=" << pool->getBusyNumber() << " alive=" << pool->getAliveNumber() << std::endl;
+    }, PriorityHigh);
+    std::atomic<bool> later(false);
+    pool->scheduleAfter(5000, [&later]()
+    {
+        std::cout << "timer: 5 seconds later" << std::endl;
+        later.store(true);
+    }, PriorityHigh);
+    //一批任务放在一个任务组里，之后等待这一批完成，不需要销毁线程池
+    TaskGroup<ThreadPool> batch(*pool);
     for (int i = 0; i < 100; i++)
     {
-        int* num = (int*)malloc(sizeof(int));
-        *num = i;
-        pool->addTask(taskFunc, num);
+        //lambda捕获的参数直接保存在任务内部，不需要malloc/free
+        batch.spawn([i]() { taskFunc(i); });
+    }
+
+    //提交带返回值的任务，结果出来后在线程池上继续处理，不需要阻塞一个线程等待
+    Future<int> result = pool->submit([]() { return 6; }).then([](int x) { return x * 7; });
+    std::cout << "submit result = " << result.get() << std::endl;
+
+    //并行归约：数组按块分给工作线程和当前线程，块之间按固定顺序合并
+    std::vector<long> records(1000000);
+    parallelFor(*pool, (size_t)0, records.size(), [&](size_t i) { records[i] = i % 100; });
+    long total = parallelReduce(*pool, records.begin(), records.end(), 0L, [](long a, long b) { return a + b; });
+    std::cout << "parallel reduce total = " << total << std::endl;
+
+    //一万个请求流程同时在途，只用线程池现有的几个工作线程
+    std::vector<Future<int> > requests;
+    for (int i = 0; i < 10000; i++)
+    {
+        requests.push_back(coSpawn(*pool, handleRequest(*pool, i)));
     }
+    long answered = 0;
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+        answered += requests[i].get();
+    }
+    std::cout << "coroutine requests = " << requests.size() << " sum = " << answered << std::endl;
 
-    sleep(30);
+    //每个会话的消息按key串行处理，会话状态不加锁；不同会话在不同工作线程上并行
+    const int sessionNum = 8;
+    KeyedStrands<int> sessions(*pool, sessionNum * 4);
+    std::vector<std::vector<int> > inbox(sessionNum);
+    std::atomic<int> closed(0);
+    for (int msg = 0; msg < 1000; msg++)
+    {
+        for (int id = 0; id < sessionNum; id++)
+        {
+            sessions.post(id, [&inbox, id, msg]() { inbox[id].push_back(msg); });
+        }
+    }
+    for (int id = 0; id < sessionNum; id++)
+    {
+        sessions.post(id, [&inbox, &closed, id]()
+        {
+            bool ordered = std::is_sorted(inbox[id].begin(), inbox[id].end());
+            std::cout << "session " << id << ": messages=" << inbox[id].size() << " ordered=" << ordered << std::endl;
+            closed.fetch_add(1);
+        });
+    }
+    while (closed.load() < sessionNum)
+    {
+        usleep(1000);
+    }
+
+    //等待这一批任务完成，当前线程也帮着执行排队的任务
+    batch.wait();
+    //等5秒的定时任务执行过再取消周期任务，否则这一批任务早就做完时定时任务一次也来不及执行
+    while (!later.load())
+    {
+        usleep(1000);
+    }
+    pool->cancelTimer(ticker);
+    //打印管理线程的决策记录
+    std::vector<ThreadPool::Decision> decisions = pool->getDecisions();
+    for (size_t i = 0; i < decisions.size(); i++)
+    {
+        std::cout << "manager: throughput=" << decisions[i].throughput << " pending=" << decisions[i].pending
+                  << " alive=" << decisions[i].alive << " target=" << decisions[i].target
+                  << " reason=" << decisions[i].reason << std::endl;
+    }
+    //打印性能指标
+    PoolMetricsSnapshot metrics = pool->getMetrics();
+    std::cout << "metrics: tasks=" << metrics.total.tasks << " steals=" << metrics.total.steals
+              << " parks=" << metrics.total.parks << " unparks=" << metrics.total.unparks << std::endl;
+    std::cout << "queue wait us: p50=" << metrics.queueWait.percentile(50) / 1000
+              << " p99=" << metrics.queueWait.percentile(99) / 1000
+              << " max=" << metrics.queueWait.maxNs / 1000 << std::endl;
+    std::cout << "run time us: p50=" << metrics.runTime.percentile(50) / 1000
+              << " p99=" << metrics.runTime.percentile(99) / 1000
+              << " max=" << metrics.runTime.maxNs / 1000 << std::endl;
     delete pool;
     pool = nullptr;
     